@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "carveHelper.h"
+#include "image.h"
+
+/// Number of heap allocations of the whole program, on all threads. The global operator new of seam-bench counts
+/// them, so that the bench can show that carving with a kept workspace doesn't allocate.
+static std::atomic<int64_t> numAllocations{0};
+
+void* operator new(size_t size) {
+	numAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+
+/// Create a deterministic image with flat blocks, edges between them and some noise.
+static void makeImage(Image& image, int width, int height) {
+	std::mt19937 rng(width * 31 + height);
+	std::vector<Pixel> pixels(size_t(width) * height);
+	for (int row = 0; row < height; ++row) {
+		for (int col = 0; col < width; ++col) {
+			const bool block = ((col / 37 + row / 29) & 1) != 0;
+			Pixel& p = pixels[size_t(row) * width + col];
+			p.r = uint8_t((block ? 180 : 50) + rng() % 32);
+			p.g = uint8_t((col * 255) / width);
+			p.b = uint8_t((row * 255) / height);
+		}
+	}
+	Error err = image.create(width, height, pixels.data());
+	if (err) {
+		err.print();
+		exit(1);
+	}
+}
+
+/// Carve the image a few times and return the median time in milliseconds.
+/// @param[out] stats The numbers collected by the last run.
+/// @param[out] laterAllocations If set, receives the number of allocations during the carves after the first one.
+static double measure(Image& original, Image& result, int seams, int repeats, CarveOptions options,
+	CarveStats& stats, int64_t* laterAllocations = nullptr)
+{
+	std::vector<double> times;
+	times.reserve(repeats);
+	int64_t allocations = 0;
+	for (int i = 0; i < repeats; ++i) {
+		// Shared planes would be copied by the carve itself, so that copy would be measured as well
+		result.copyPlanesFrom(original);
+		stats = CarveStats();
+		options.stats = &stats;
+		const int64_t startAllocations = numAllocations;
+		const auto startTime = std::chrono::steady_clock::now();
+		result.carveCols(seams, options);
+		const std::chrono::duration<double, std::milli> deltaTime = std::chrono::steady_clock::now() - startTime;
+		if (i > 0) {
+			allocations += numAllocations - startAllocations;
+		}
+		times.push_back(deltaTime.count());
+	}
+	if (laterAllocations) {
+		*laterAllocations = allocations;
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+/// Measure an approximate carving and print how much more energy it removes than the exact one.
+/// @param exactStats The numbers from the exact carving.
+/// @param name Printed name of the carving.
+/// @return The median time in milliseconds.
+static double measureApproximate(Image& original, int seams, int repeats, const CarveOptions& options,
+	const CarveStats& exactStats, const char* name)
+{
+	Image result;
+	CarveStats stats;
+	const double time = measure(original, result, seams, repeats, options, stats);
+	// Positive when more energy was removed than with the exact carving, i.e. the result is worse.
+	const double drift = (stats.energy - exactStats.energy) / std::max(1e-9, exactStats.energy);
+	printf("  %-8s %10.3fms  removed energy %+.2f%%, %d passes", name, time, drift * 100.0, stats.passes);
+	return time;
+}
+
+/// Compares the two dynamic table storages. If a batch size or a pyramid band is given, it also compares those
+/// approximate carvings with the exact one.
+/// Usage: seam-bench [width] [height] [seams] [repeats] [threads] [batch] [band]
+int main(int argc, char* argv[]) {
+	const int width = (argc > 1) ? atoi(argv[1]) : 8000;
+	const int height = (argc > 2) ? atoi(argv[2]) : 1000;
+	const int seams = (argc > 3) ? atoi(argv[3]) : 200;
+	const int repeats = (argc > 4) ? std::max(1, atoi(argv[4])) : 5;
+	ThreadPool threadPool((argc > 5) ? atoi(argv[5]) : 1);
+	const int batchSize = (argc > 6) ? atoi(argv[6]) : 1;
+	const int band = (argc > 7) ? atoi(argv[7]) : 0;
+
+	Image original;
+	makeImage(original, width, height);
+	constexpr int numStorages = 3;
+	Image results[numStorages];
+	const CarveStorage storages[numStorages] = {CarveStorage::Indexed, CarveStorage::Compact, CarveStorage::LowMemory};
+	const char* names[numStorages] = {"Indexed", "Compact", "LowMem"};
+	double times[numStorages] = {};
+	size_t memory[numStorages] = {};
+	CarveStats stats[numStorages];
+	for (int i = 0; i < numStorages; ++i) {
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.storage = storages[i];
+		times[i] = measure(original, results[i], seams, repeats, options, stats[i]);
+
+		// Size of the buffers needed for a single seam
+		CarveWorkspace workspace;
+		options.workspace = &workspace;
+		Image result;
+		result.copyFrom(original);
+		result.carveCols(1, options);
+		memory[i] = workspace.getCapacity();
+	}
+
+	// All storages must give the same image
+	const Pixel* a = results[0].getData();
+	for (int i = 1; i < numStorages; ++i) {
+		const Pixel* b = results[i].getData();
+		for (int row = 0; row < results[0].getHeight(); ++row) {
+			for (int col = 0; col < results[0].getWidth(); ++col) {
+				const size_t idx = size_t(row) * results[0].getStride() + col;
+				if (a[idx].r != b[idx].r || a[idx].g != b[idx].g || a[idx].b != b[idx].b) {
+					printf("Error: %s result differs at (%d, %d)\n", names[i], col, row);
+					return 1;
+				}
+			}
+		}
+	}
+
+	printf("\nImage %dx%d, removing %d columns, %d threads, median of %d runs\n",
+		width, height, seams, threadPool.getNumThreads(), repeats);
+	const double numPixels = double(width) * height;
+	for (int i = 0; i < numStorages; ++i) {
+		printf("  %-8s %10.3fms  (%.2fx)  workspace of %.2f bytes per pixel\n", names[i], times[i],
+			times[0] / times[i], double(memory[i]) / numPixels);
+	}
+
+	// Keeping the workspace between runs, only the first one should allocate it
+	{
+		CarveWorkspace workspace;
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.workspace = &workspace;
+		Image result;
+		CarveStats workspaceStats;
+		int64_t laterAllocations = 0;
+		const double time = measure(original, result, seams, repeats, options, workspaceStats, &laterAllocations);
+		printf("  %-8s %10.3fms  (%.2fx)  workspace of %.1fMB, %lld allocations in the %d runs after the first\n",
+			"Reused", time, times[0] / time, double(workspace.getCapacity()) / (1024.0 * 1024.0),
+			(long long)laterAllocations, repeats - 1);
+	}
+
+	if (batchSize > 1) {
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.batchSize = batchSize;
+		const double time = measureApproximate(original, seams, repeats, options, stats[1], "Batched");
+		printf(" (batch of %d, %.2fx)\n", batchSize, times[0] / time);
+	}
+	if (band > 0) {
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.pyramidBand = band;
+		options.pyramidMinPixels = 0;
+		const double time = measureApproximate(original, seams, repeats, options, stats[1], "Pyramid");
+		printf(" (band of %d, %.2fx)\n", band, times[0] / time);
+	}
+	return 0;
+}
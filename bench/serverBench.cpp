@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "serverProtocol.h"
+
+/// Settings from the command line.
+struct BenchOptions {
+	std::string socketPath = "/tmp/seam-server.sock";
+	std::vector<std::string> inputs; ///< Images sent one after another by each client.
+	int numClients = 4; ///< Connections sending requests at the same time.
+	int numRequests = 200; ///< Requests carved in total.
+	int targetWidth = 0; ///< See RequestHeader::targetWidth.
+	int targetHeight = 0; ///< See RequestHeader::targetHeight.
+	std::string format = "png"; ///< See RequestHeader::format.
+	bool sendPaths = false; ///< Send the paths of the inputs instead of their bytes.
+	std::string outputPath; ///< If set, the first result is written here.
+};
+
+static void printUsage() {
+	printf(
+		"Usage: seam-bench-server [options] <input>...\n"
+		"Sends the inputs to a running seam-server from several clients at once, and measures the throughput and\n"
+		"the latency of the requests. Requests turned away as busy are retried.\n"
+		"\n"
+		"Options:\n"
+		"  -S, --socket PATH    Path of the socket of the server. The default is /tmp/seam-server.sock.\n"
+		"  -s, --size WxH       Size of the results, in pixels. An empty side keeps the input size.\n"
+		"  -f, --format NAME    Format of the results. The default is png.\n"
+		"  -c, --clients N      Number of connections sending requests at the same time. The default is 4.\n"
+		"  -n, --requests N     Number of requests in total. The default is 200.\n"
+		"      --paths          Send the paths of the inputs, for the server to read, instead of their bytes.\n"
+		"  -o, --output PATH    Write the first result here.\n"
+		"  -h, --help           Show this message.\n");
+}
+
+/// Parse the arguments.
+/// @return False if they are not valid.
+static bool parseArgs(int argc, char* argv[], BenchOptions& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const char* value = (i+1 < argc) ? argv[i+1] : nullptr;
+		if (arg == "-S" || arg == "--socket") {
+			if (!value) return false;
+			options.socketPath = argv[++i];
+		} else if (arg == "-s" || arg == "--size") {
+			if (!value || !strchr(value, 'x')) return false;
+			options.targetWidth = atoi(value);
+			options.targetHeight = atoi(strchr(value, 'x') + 1);
+			++i;
+		} else if (arg == "-f" || arg == "--format") {
+			if (!value || strlen(value) >= sizeof(RequestHeader::format)) return false;
+			options.format = argv[++i];
+		} else if (arg == "-c" || arg == "--clients") {
+			options.numClients = value ? atoi(argv[++i]) : 0;
+			if (options.numClients < 1) return false;
+		} else if (arg == "-n" || arg == "--requests") {
+			options.numRequests = value ? atoi(argv[++i]) : 0;
+			if (options.numRequests < 1) return false;
+		} else if (arg == "--paths") {
+			options.sendPaths = true;
+		} else if (arg == "-o" || arg == "--output") {
+			if (!value) return false;
+			options.outputPath = argv[++i];
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			return false;
+		} else {
+			options.inputs.push_back(arg);
+		}
+	}
+	return !options.inputs.empty();
+}
+
+/// Read a whole file.
+/// @return False if it can't be read.
+static bool readFile(const std::string& path, std::vector<uint8_t>& bytes) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) return false;
+	fseek(file, 0, SEEK_END);
+	bytes.resize(size_t(ftell(file)));
+	fseek(file, 0, SEEK_SET);
+	const bool ok = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	fclose(file);
+	return ok;
+}
+
+/// Connect to the server.
+/// @return The socket, or -1 if the connection failed.
+static int connectTo(const std::string& path) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) return -1;
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/// Measures seam-server, see printUsage.
+int main(int argc, char* argv[]) {
+	BenchOptions options;
+	if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0 || !parseArgs(argc, argv, options)) {
+		printUsage();
+		return 2;
+	}
+
+	// The payload of each input, sent as is
+	std::vector<std::vector<uint8_t>> payloads(options.inputs.size());
+	for (size_t i = 0; i < options.inputs.size(); ++i) {
+		if (options.sendPaths) {
+			payloads[i].assign(options.inputs[i].begin(), options.inputs[i].end());
+		} else if (!readFile(options.inputs[i], payloads[i])) {
+			printf("Error: Failed to read \"%s\"\n", options.inputs[i].c_str());
+			return 1;
+		}
+	}
+
+	std::mutex mutex;
+	std::vector<double> latencies; ///< Milliseconds of each carved request, from sending it to its result.
+	std::atomic<int> nextRequest{0};
+	std::atomic<int> numBusy{0};
+	std::atomic<int> numFailed{0};
+	const auto startTime = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (int client = 0; client < options.numClients; ++client) {
+		clients.emplace_back([&]() {
+			const int fd = connectTo(options.socketPath);
+			if (fd < 0) {
+				printf("Error: Failed to connect to \"%s\"\n", options.socketPath.c_str());
+				numFailed += 1;
+				return;
+			}
+			std::vector<uint8_t> result;
+			std::vector<double> clientLatencies;
+			for (int i = nextRequest++; i < options.numRequests; i = nextRequest++) {
+				const std::vector<uint8_t>& payload = payloads[i % payloads.size()];
+				RequestHeader request;
+				request.kind = options.sendPaths ? RequestKind::Path : RequestKind::Bytes;
+				request.targetWidth = uint32_t(options.targetWidth);
+				request.targetHeight = uint32_t(options.targetHeight);
+				memcpy(request.format, options.format.c_str(), options.format.size());
+				request.payloadSize = uint32_t(payload.size());
+
+				// The latency includes the retries after busy answers
+				ResponseHeader response;
+				const auto sendTime = std::chrono::steady_clock::now();
+				for (int attempt = 0;; ++attempt) {
+					if (!writeAll(fd, &request, sizeof(request)) || !writeAll(fd, payload.data(), payload.size()) ||
+						!readAll(fd, &response, sizeof(response)))
+					{
+						printf("Error: The server hung up\n");
+						numFailed += 1;
+						close(fd);
+						return;
+					}
+					result.resize(response.payloadSize);
+					if (!readAll(fd, result.data(), result.size())) {
+						numFailed += 1;
+						close(fd);
+						return;
+					}
+					if (response.status != ResponseStatus::Busy) {
+						const std::chrono::duration<double, std::milli> delta =
+							std::chrono::steady_clock::now() - sendTime;
+						clientLatencies.push_back(delta.count());
+						break;
+					}
+					// Back off a little more each time the server is busy
+					numBusy += 1;
+					std::this_thread::sleep_for(std::chrono::microseconds(200 << std::min(attempt, 6)));
+				}
+
+				if (response.status != ResponseStatus::Ok) {
+					printf("Error: %.*s\n", int(result.size()), reinterpret_cast<const char*>(result.data()));
+					numFailed += 1;
+					clientLatencies.pop_back();
+				} else if (i == 0 && !options.outputPath.empty()) {
+					FILE* file = fopen(options.outputPath.c_str(), "wb");
+					if (file) {
+						fwrite(result.data(), 1, result.size(), file);
+						fclose(file);
+					}
+				}
+			}
+			close(fd);
+			std::lock_guard<std::mutex> lock(mutex);
+			latencies.insert(latencies.end(), clientLatencies.begin(), clientLatencies.end());
+		});
+	}
+	for (std::thread& client : clients) {
+		client.join();
+	}
+	const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - startTime;
+
+	std::sort(latencies.begin(), latencies.end());
+	auto getPercentile = [&](double percent) {
+		if (latencies.empty()) return 0.0;
+		return latencies[std::min(latencies.size() - 1, size_t(percent / 100.0 * latencies.size()))];
+	};
+	printf("%d clients: %d images in %.2fs, %.1f images/s. %d failed, %d busy answers retried\n",
+		options.numClients, int(latencies.size()), seconds.count(), latencies.size() / seconds.count(),
+		int(numFailed), int(numBusy));
+	printf("Latency p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", getPercentile(50.0), getPercentile(90.0),
+		getPercentile(99.0), latencies.empty() ? 0.0 : latencies.back());
+	return (numFailed > 0) ? 1 : 0;
+}
@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "carveHelper.h"
+#include "image.h"
+
+namespace fs = std::filesystem;
+
+/// Kinds of synthetic images. Each one stresses the energies and the seams differently.
+enum class Pattern {
+	Noise, ///< Random pixels. Every pixel has a high energy.
+	Gradient, ///< Smooth ramps. Low, almost uniform energy.
+	Flat, ///< Flat blocks with sharp edges between them. Most of the energy is zero.
+	Text, ///< Dark strokes on a light background, in lines like text. Many short edges.
+};
+
+static const Pattern patterns[] = {Pattern::Noise, Pattern::Gradient, Pattern::Flat, Pattern::Text};
+
+static const char* getPatternName(Pattern pattern) {
+	switch (pattern) {
+	case Pattern::Noise: return "noise";
+	case Pattern::Gradient: return "gradient";
+	case Pattern::Flat: return "flat";
+	case Pattern::Text: return "text";
+	}
+	return "";
+}
+
+/// Create a deterministic image of the given pattern.
+static void makeImage(Image& image, Pattern pattern, int width, int height, ThreadPool& pool) {
+	std::mt19937 rng(width * 31 + height * 7 + int(pattern));
+	std::vector<Pixel> pixels(size_t(width) * height);
+	auto at = [&](int col, int row) -> Pixel& { return pixels[size_t(row) * width + col]; };
+	switch (pattern) {
+	case Pattern::Noise:
+		for (Pixel& p : pixels) {
+			const uint32_t value = rng();
+			p = {uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16)};
+		}
+		break;
+	case Pattern::Gradient:
+		for (int row = 0; row < height; ++row) {
+			for (int col = 0; col < width; ++col) {
+				at(col, row) = {uint8_t(col * 255 / width), uint8_t(row * 255 / height),
+					uint8_t((col + row) * 255 / (width + height))};
+			}
+		}
+		break;
+	case Pattern::Flat: {
+		// Blocks of random sizes and colors, with no noise inside them
+		const int blockSize = std::max(8, std::min(width, height) / 16);
+		std::vector<Pixel> colors(64);
+		for (Pixel& color : colors) {
+			const uint32_t value = rng();
+			color = {uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16)};
+		}
+		for (int row = 0; row < height; ++row) {
+			for (int col = 0; col < width; ++col) {
+				const int block = (col / blockSize) * 7 + (row / blockSize) * 13 + (col / (3 * blockSize));
+				at(col, row) = colors[block % colors.size()];
+			}
+		}
+		break;
+	}
+	case Pattern::Text: {
+		// Lines of 8x12 glyphs made of random strokes, with spaces between words and lines
+		std::fill(pixels.begin(), pixels.end(), Pixel{235, 235, 230});
+		const Pixel ink{20, 20, 30};
+		for (int lineTop = 4; lineTop + 12 < height; lineTop += 18) {
+			for (int glyphLeft = 4; glyphLeft + 8 < width; glyphLeft += 9) {
+				if (rng() % 6 == 0) continue; // Space
+				for (int stroke = 0; stroke < 3; ++stroke) {
+					const bool vertical = rng() & 1;
+					const int x = glyphLeft + int(rng() % 8);
+					const int y = lineTop + int(rng() % 12);
+					const int length = 3 + int(rng() % 6);
+					for (int i = 0; i < length; ++i) {
+						const int col = vertical ? x : std::min(glyphLeft + 7, x + i);
+						const int row = vertical ? std::min(lineTop + 11, y + i) : y;
+						at(col, row) = ink;
+					}
+				}
+			}
+		}
+		break;
+	}
+	}
+	Error err = image.create(width, height, pixels.data(), &pool);
+	if (err) {
+		err.print();
+		exit(1);
+	}
+}
+
+/// Statistics of the repeated runs of a case, in milliseconds.
+struct Measurement {
+	std::string name; ///< Name of the case, e.g. "carveCols".
+	std::string pattern; ///< Name of the pattern of the image.
+	std::string format; ///< File format, only for load and save.
+	int width = 0;
+	int height = 0;
+	int seams = 0; ///< Number of removed seams, only for carving.
+	std::vector<double> times; ///< Time of each run.
+	double median = 0.0;
+	double mean = 0.0;
+	double stddev = 0.0;
+	double min = 0.0;
+	double max = 0.0;
+
+	/// Compute the statistics from the times.
+	void finish() {
+		std::vector<double> sorted = times;
+		std::sort(sorted.begin(), sorted.end());
+		const size_t n = sorted.size();
+		median = (n % 2) ? sorted[n/2] : 0.5 * (sorted[n/2 - 1] + sorted[n/2]);
+		min = sorted.front();
+		max = sorted.back();
+		mean = 0.0;
+		for (double time : times) {
+			mean += time;
+		}
+		mean /= double(n);
+		double variance = 0.0;
+		for (double time : times) {
+			variance += (time - mean) * (time - mean);
+		}
+		stddev = (n > 1) ? sqrt(variance / double(n - 1)) : 0.0;
+	}
+
+	/// Megapixels of the input processed per second, based on the median.
+	double getThroughput() const {
+		return 1e-6 * double(width) * height / (1e-3 * std::max(1e-6, median));
+	}
+};
+
+/// Run @p func a few times and collect the times. @p setup runs before each call and is not measured.
+template <typename SetupFunc, typename Func>
+static void measure(Measurement& result, int repeats, SetupFunc&& setup, Func&& func) {
+	for (int i = 0; i < repeats; ++i) {
+		setup();
+		const auto startTime = std::chrono::steady_clock::now();
+		func();
+		const std::chrono::duration<double, std::milli> deltaTime = std::chrono::steady_clock::now() - startTime;
+		result.times.push_back(deltaTime.count());
+	}
+	result.finish();
+	printf("  %-10s %-8s %-4s %5dx%-5d %5d seams  median %10.3fms  stddev %8.3fms  %8.2f MP/s\n",
+		result.name.c_str(), result.pattern.c_str(), result.format.c_str(), result.width, result.height,
+		result.seams, result.median, result.stddev, result.getThroughput());
+	fflush(stdout);
+}
+
+/// Settings from the command line.
+struct SuiteOptions {
+	std::vector<int> sizes = {256, 1024, 4096}; ///< Sides of the square images.
+	std::vector<int> seams = {1, 16, 128}; ///< Seam counts for carving.
+	std::vector<std::string> formats = {"bmp", "png", "jpg", "tif"}; ///< Formats for load and save.
+	int repeats = 5;
+	int threads = 1;
+	std::string jsonPath; ///< If set, the results are written there.
+	std::string filter; ///< If set, only the cases whose names contain it are run.
+};
+
+/// Parse a comma separated list.
+template <typename T, typename ParseFunc>
+static std::vector<T> parseList(const char* text, ParseFunc&& parse) {
+	std::vector<T> result;
+	std::string item;
+	for (const char* c = text; ; ++c) {
+		if (*c == ',' || *c == '\0') {
+			if (!item.empty()) {
+				result.push_back(parse(item));
+			}
+			item.clear();
+			if (*c == '\0') break;
+		} else {
+			item += *c;
+		}
+	}
+	return result;
+}
+
+/// Write a string with the JSON escapes.
+static void writeJsonString(FILE* file, const std::string& text) {
+	fputc('"', file);
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			fputc('\\', file);
+		}
+		fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+/// Write all results into a JSON file, so that runs can be compared with a script.
+static bool writeJson(const std::string& path, const SuiteOptions& options, const std::vector<Measurement>& results) {
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) return false;
+	fprintf(file, "{\n  \"repeats\": %d,\n  \"threads\": %d,\n  \"results\": [", options.repeats, options.threads);
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Measurement& m = results[i];
+		fprintf(file, "%s\n    {\"name\": ", i ? "," : "");
+		writeJsonString(file, m.name);
+		fprintf(file, ", \"pattern\": ");
+		writeJsonString(file, m.pattern);
+		fprintf(file, ", \"format\": ");
+		writeJsonString(file, m.format);
+		fprintf(file, ", \"width\": %d, \"height\": %d, \"seams\": %d,\n", m.width, m.height, m.seams);
+		fprintf(file, "     \"median_ms\": %.6f, \"mean_ms\": %.6f, \"stddev_ms\": %.6f, \"min_ms\": %.6f, "
+			"\"max_ms\": %.6f, \"mpix_per_s\": %.6f,\n     \"times_ms\": [",
+			m.median, m.mean, m.stddev, m.min, m.max, m.getThroughput());
+		for (size_t t = 0; t < m.times.size(); ++t) {
+			fprintf(file, "%s%.6f", t ? ", " : "", m.times[t]);
+		}
+		fprintf(file, "]}");
+	}
+	fprintf(file, "\n  ]\n}\n");
+	return fclose(file) == 0;
+}
+
+static void printUsage() {
+	printf(
+		"Usage: seam-bench-suite [options]\n"
+		"Measures the energies, the carving of columns and rows, and loading and saving, on synthetic images.\n"
+		"\n"
+		"Options:\n"
+		"  --sizes A,B,...     Sides of the square images. The default is 256,1024,4096. 16384 needs about 8GB.\n"
+		"  --seams A,B,...     Numbers of seams to carve. The default is 1,16,128.\n"
+		"  --formats A,B,...   File formats to load and save. The default is bmp,png,jpg,tif.\n"
+		"  --repeats N         Runs of each case. The default is 5.\n"
+		"  --threads N         Threads used by each case. The default is 1.\n"
+		"  --filter TEXT       Only run the cases whose names contain TEXT: energy, carveCols, carveRows, save, load.\n"
+		"  --json PATH         Write the results to PATH as JSON.\n");
+}
+
+/// Measures each part of the pipeline on synthetic images of several sizes, and reports the median, the spread and
+/// the throughput of each. With --json, the results can be compared against a baseline run.
+/// Usage: seam-bench-suite [options], see printUsage.
+int main(int argc, char* argv[]) {
+	SuiteOptions options;
+	auto parseInt = [](const std::string& text) { return atoi(text.c_str()); };
+	auto parseString = [](const std::string& text) { return text; };
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			return 0;
+		}
+		const char* value = (i+1 < argc) ? argv[++i] : nullptr;
+		if (!value) {
+			printUsage();
+			return 2;
+		}
+		if (arg == "--sizes") {
+			options.sizes = parseList<int>(value, parseInt);
+		} else if (arg == "--seams") {
+			options.seams = parseList<int>(value, parseInt);
+		} else if (arg == "--formats") {
+			options.formats = parseList<std::string>(value, parseString);
+		} else if (arg == "--repeats") {
+			options.repeats = std::max(1, atoi(value));
+		} else if (arg == "--threads") {
+			options.threads = std::max(1, atoi(value));
+		} else if (arg == "--filter") {
+			options.filter = value;
+		} else if (arg == "--json") {
+			options.jsonPath = value;
+		} else {
+			printUsage();
+			return 2;
+		}
+	}
+	auto isEnabled = [&options](const char* name) {
+		return options.filter.empty() || strstr(name, options.filter.c_str());
+	};
+
+	ThreadPool pool(options.threads);
+	CarveWorkspace workspace;
+	const fs::path tempDir = fs::temp_directory_path() / "seam-bench-suite";
+	std::error_code dirErr;
+	fs::create_directories(tempDir, dirErr);
+
+	printf("%d threads, %d runs of each case\n", pool.getNumThreads(), options.repeats);
+	std::vector<Measurement> results;
+	for (int size : options.sizes) {
+		for (Pattern pattern : patterns) {
+			Image original;
+			makeImage(original, pattern, size, size, pool);
+			auto makeMeasurement = [&](const char* name, int seams, const std::string& format) {
+				Measurement m;
+				m.name = name;
+				m.pattern = getPatternName(pattern);
+				m.format = format;
+				m.width = size;
+				m.height = size;
+				m.seams = seams;
+				return m;
+			};
+
+			// Luma and energies. Image::create also copies the pixels, which is a small part of it.
+			if (isEnabled("energy")) {
+				std::vector<Pixel> pixels(original.getData(), original.getData() + size_t(size) * size);
+				Image image;
+				Measurement m = makeMeasurement("energy", 0, "");
+				measure(m, options.repeats, [] {}, [&] { image.create(size, size, pixels.data(), &pool); });
+				results.push_back(m);
+			}
+
+			// Columns with CarveHelper<true>, rows in place with CarveHelper<false>. The setup gives the image planes of
+			// its own, since carving shared planes starts with copying them.
+			CarveOptions carveOptions;
+			carveOptions.threadPool = &pool;
+			carveOptions.workspace = &workspace;
+			carveOptions.transpose = TransposeMode::Never;
+			for (int seams : options.seams) {
+				seams = std::min(seams, size - 1);
+				Image image;
+				if (isEnabled("carveCols")) {
+					Measurement m = makeMeasurement("carveCols", seams, "");
+					measure(m, options.repeats, [&] { image.copyPlanesFrom(original); },
+						[&] { image.carveCols(seams, carveOptions); });
+					results.push_back(m);
+				}
+				if (isEnabled("carveRows")) {
+					Measurement m = makeMeasurement("carveRows", seams, "");
+					measure(m, options.repeats, [&] { image.copyPlanesFrom(original); },
+						[&] { image.carveRows(seams, carveOptions); });
+					results.push_back(m);
+				}
+			}
+
+			// Each format is saved first, so that there is a file to load
+			for (const std::string& format : options.formats) {
+				const std::string path = (tempDir / ("image." + format)).string();
+				if (isEnabled("save")) {
+					Measurement m = makeMeasurement("save", 0, format);
+					measure(m, options.repeats, [] {}, [&] {
+						Error err = original.save(path.c_str());
+						if (err) err.print();
+					});
+					results.push_back(m);
+				}
+				if (isEnabled("load")) {
+					if (!isEnabled("save")) {
+						original.save(path.c_str());
+					}
+					Image image;
+					Measurement m = makeMeasurement("load", 0, format);
+					measure(m, options.repeats, [] {}, [&] {
+						Error err = image.load(path.c_str(), &pool);
+						if (err) err.print();
+					});
+					results.push_back(m);
+				}
+			}
+		}
+	}
+	fs::remove_all(tempDir, dirErr);
+
+	if (!options.jsonPath.empty()) {
+		if (!writeJson(options.jsonPath, options, results)) {
+			printf("Error: failed to write \"%s\"\n", options.jsonPath.c_str());
+			return 1;
+		}
+		printf("Wrote %d results to %s\n", int(results.size()), options.jsonPath.c_str());
+	}
+	return 0;
+}
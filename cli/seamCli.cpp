@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "carveHelper.h"
+#include "error.h"
+#include "image.h"
+#include "scratchMemory.h"
+#include "sequenceCarver.h"
+#include "threadPool.h"
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+/// How to compute the size of the results.
+struct TargetSpec {
+	/// Size of each side, in pixels or in percent of the input. Zero keeps the side of the input.
+	/// @{
+	double width = 0.0;
+	double height = 0.0;
+	bool widthPercent = false;
+	bool heightPercent = false;
+	/// @}
+	/// If positive, the result gets this aspect ratio (width / height) by carving only the side that is too long.
+	double aspect = 0.0;
+};
+
+/// Settings from the command line.
+struct CliOptions {
+	std::vector<std::string> inputs; ///< Files or patterns.
+	std::string outputTemplate = "{dir}/{name}_seam.{ext}"; ///< See printUsage.
+	TargetSpec target;
+	int numJobs = 0; ///< Images carved at the same time. 0 uses all cores.
+	int numThreads = 1; ///< Threads used for each image.
+	bool lowMemory = false; ///< Carve with CarveStorage::LowMemory.
+	bool sequence = false; ///< The inputs are the frames of one video, see carveSequence.
+	int band = 8; ///< See SequenceOptions::band.
+	int keyframeInterval = 0; ///< See SequenceOptions::keyframeInterval.
+	std::string tracePath; ///< If set, the phases of the work are traced and written here.
+	size_t scratchThreshold = 0; ///< See setScratchFileThreshold.
+	std::string scratchDir; ///< See setScratchFileDir.
+};
+
+static void printUsage() {
+	printf(
+		"Usage: seam-cli [options] <input>...\n"
+		"Resizes images with seam carving. Inputs are files, or patterns with * and ? in the file name, like\n"
+		"\"photos/*.jpg\".\n"
+		"\n"
+		"Options:\n"
+		"  -s, --size WxH       Size of the results. Each side is in pixels, or in percent with a trailing %%.\n"
+		"                       An empty side keeps the input size, e.g. 1280x, x75%% or 50%%x50%%.\n"
+		"  -a, --aspect W:H     Aspect ratio of the results. Only the side that is too long is carved.\n"
+		"  -o, --output PATH    Template of the output paths. {dir}, {name} and {ext} are replaced with the parts of\n"
+		"                       the input path, {w} and {h} with the size of the result.\n"
+		"                       The default is \"{dir}/{name}_seam.{ext}\".\n"
+		"  -j, --jobs N         Number of images carved at the same time. The default is the number of cores.\n"
+		"  -t, --threads N      Number of threads used for each image. The default is 1.\n"
+		"      --low-memory     Use the dynamic table that needs the least memory. Slower.\n"
+		"      --sequence       The inputs are the frames of one video, in order. Frames are loaded, carved and\n"
+		"                       saved in a pipeline, and each frame follows the seams of the previous one.\n"
+		"                       -j sets the number of frames loaded and saved at the same time.\n"
+		"      --band N         Columns around each seam of the previous frame that are searched in the next\n"
+		"                       one. The default is 8. 0 carves each frame on its own.\n"
+		"      --keyframes N    Carve every Nth frame on its own, so that the seams can follow cuts.\n"
+		"      --trace PATH     Write how long each phase took on each thread as a Chrome trace, for\n"
+		"                       chrome://tracing or ui.perfetto.dev.\n"
+		"      --scratch-threshold SIZE\n"
+		"                       Keep buffers of at least SIZE bytes, or with a K, M or G suffix, in memory-mapped\n"
+		"                       temporary files, so that images larger than the physical memory can be carved.\n"
+		"      --scratch-dir PATH\n"
+		"                       Directory of those files. The default is the temporary directory of the system.\n"
+		"  -h, --help           Show this message.\n");
+}
+
+/// Parse one side of a size. An empty string keeps the input size.
+/// @return False if it is not a valid number.
+static bool parseSide(const std::string& text, double& value, bool& isPercent) {
+	value = 0.0;
+	isPercent = false;
+	if (text.empty()) return true;
+	char* end = nullptr;
+	value = strtod(text.c_str(), &end);
+	if (*end == '%') {
+		isPercent = true;
+		++end;
+	}
+	return *end == '\0' && value > 0.0;
+}
+
+/// Parse the arguments.
+/// @return An error, if they are not valid.
+static Error parseArgs(int argc, char* argv[], CliOptions& options) {
+	bool hasTarget = false;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		auto getValue = [&]() -> const char* {
+			return (i+1 < argc) ? argv[++i] : nullptr;
+		};
+		if (arg == "-s" || arg == "--size") {
+			const char* value = getValue();
+			const char* separator = value ? strchr(value, 'x') : nullptr;
+			if (!separator) {
+				return Error("Expected a size like 1280x720 after %s", arg.c_str());
+			}
+			TargetSpec& target = options.target;
+			if (!parseSide(std::string(value, separator), target.width, target.widthPercent) ||
+				!parseSide(separator + 1, target.height, target.heightPercent))
+			{
+				return Error("Invalid size \"%s\"", value);
+			}
+			hasTarget = true;
+		} else if (arg == "-a" || arg == "--aspect") {
+			const char* value = getValue();
+			double w = 0.0, h = 0.0;
+			if (!value || sscanf(value, "%lf:%lf", &w, &h) != 2 || w <= 0.0 || h <= 0.0) {
+				return Error("Expected an aspect ratio like 16:9 after %s", arg.c_str());
+			}
+			options.target.aspect = w / h;
+			hasTarget = true;
+		} else if (arg == "-o" || arg == "--output") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.outputTemplate = value;
+		} else if (arg == "-j" || arg == "--jobs") {
+			const char* value = getValue();
+			options.numJobs = value ? atoi(value) : 0;
+			if (options.numJobs < 1) {
+				return Error("Expected a positive number after %s", arg.c_str());
+			}
+		} else if (arg == "-t" || arg == "--threads") {
+			const char* value = getValue();
+			options.numThreads = value ? atoi(value) : 0;
+			if (options.numThreads < 1) {
+				return Error("Expected a positive number after %s", arg.c_str());
+			}
+		} else if (arg == "--low-memory") {
+			options.lowMemory = true;
+		} else if (arg == "--sequence") {
+			options.sequence = true;
+		} else if (arg == "--band") {
+			const char* value = getValue();
+			options.band = value ? atoi(value) : -1;
+			if (options.band < 0) {
+				return Error("Expected a number after %s", arg.c_str());
+			}
+		} else if (arg == "--keyframes") {
+			const char* value = getValue();
+			options.keyframeInterval = value ? atoi(value) : 0;
+			if (options.keyframeInterval < 1) {
+				return Error("Expected a positive number after %s", arg.c_str());
+			}
+		} else if (arg == "--trace") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.tracePath = value;
+		} else if (arg == "--scratch-threshold") {
+			const char* value = getValue();
+			if (!parseScratchSize(value, options.scratchThreshold) || options.scratchThreshold == 0) {
+				return Error("Expected a size like 512M after %s", arg.c_str());
+			}
+		} else if (arg == "--scratch-dir") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.scratchDir = value;
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			return Error("Unknown option %s", arg.c_str());
+		} else {
+			options.inputs.push_back(arg);
+		}
+	}
+
+	if (options.inputs.empty()) {
+		return Error("No input images");
+	}
+	if (!hasTarget) {
+		return Error("No target size, use --size or --aspect");
+	}
+	return Error();
+}
+
+/// Return true if @p name matches @p pattern, where * matches any sequence of characters and ? a single one.
+static bool matchPattern(const char* pattern, const char* name) {
+	// Where to continue after the last *, if the rest doesn't match.
+	const char* starPattern = nullptr;
+	const char* starName = nullptr;
+	while (*name) {
+		if (*pattern == '*') {
+			starPattern = ++pattern;
+			starName = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			++pattern;
+			++name;
+		} else if (starPattern) {
+			pattern = starPattern;
+			name = ++starName;
+		} else {
+			return false;
+		}
+	}
+	while (*pattern == '*') {
+		++pattern;
+	}
+	return *pattern == '\0';
+}
+
+/// Expand the patterns in the inputs. Each pattern gives its matches in alphabetical order.
+static Error expandInputs(const std::vector<std::string>& inputs, std::vector<fs::path>& result) {
+	for (const std::string& input : inputs) {
+		const fs::path path = input;
+		const std::string pattern = path.filename().string();
+		if (pattern.find_first_of("*?") == std::string::npos) {
+			result.push_back(path);
+			continue;
+		}
+
+		const fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+		std::error_code err;
+		std::vector<fs::path> matches;
+		for (fs::directory_iterator it(dir, err), end; !err && it != end; it.increment(err)) {
+			if (it->is_regular_file() && matchPattern(pattern.c_str(), it->path().filename().string().c_str())) {
+				matches.push_back(path.has_parent_path() ? it->path() : it->path().filename());
+			}
+		}
+		if (err) {
+			return Error("Failed to list \"%s\": %s", dir.string().c_str(), err.message().c_str());
+		}
+		if (matches.empty()) {
+			return Error("No files match \"%s\"", input.c_str());
+		}
+		std::sort(matches.begin(), matches.end());
+		result.insert(result.end(), matches.begin(), matches.end());
+	}
+	return Error();
+}
+
+/// Compute the size of the result for an input of the given size. Sides are never enlarged.
+static void getTargetSize(const TargetSpec& target, int width, int height, int& targetWidth, int& targetHeight) {
+	auto getSide = [](double value, bool isPercent, int side) {
+		if (value <= 0.0) return side;
+		const double pixels = isPercent ? side * value / 100.0 : value;
+		return std::clamp(int(pixels + 0.5), 1, side);
+	};
+	targetWidth = getSide(target.width, target.widthPercent, width);
+	targetHeight = getSide(target.height, target.heightPercent, height);
+	if (target.aspect > 0.0) {
+		if (targetWidth > targetHeight * target.aspect) {
+			targetWidth = std::max(1, int(targetHeight * target.aspect + 0.5));
+		} else {
+			targetHeight = std::max(1, int(targetWidth / target.aspect + 0.5));
+		}
+	}
+}
+
+/// Replace all occurrences of @p key in @p text.
+static void replaceAll(std::string& text, const std::string& key, const std::string& value) {
+	for (size_t pos = text.find(key); pos != std::string::npos; pos = text.find(key, pos + value.size())) {
+		text.replace(pos, key.size(), value);
+	}
+}
+
+/// Fill in the output template for an input.
+static fs::path getOutputPath(const std::string& outputTemplate, const fs::path& input, int width, int height) {
+	std::string result = outputTemplate;
+	const std::string ext = input.extension().string();
+	replaceAll(result, "{dir}", input.has_parent_path() ? input.parent_path().string() : ".");
+	replaceAll(result, "{name}", input.stem().string());
+	replaceAll(result, "{ext}", ext.empty() ? "png" : ext.substr(1));
+	replaceAll(result, "{w}", std::to_string(width));
+	replaceAll(result, "{h}", std::to_string(height));
+	return result;
+}
+
+/// Milliseconds since @p start.
+static double getMillis(std::chrono::steady_clock::time_point start) {
+	const std::chrono::duration<double, std::milli> delta = std::chrono::steady_clock::now() - start;
+	return delta.count();
+}
+
+/// Carve the inputs as the frames of one video.
+/// @return The number of frames that failed.
+static int resizeSequence(const CliOptions& options, const std::vector<fs::path>& inputs) {
+	const int numJobs = options.numJobs > 0 ? options.numJobs : 2;
+	printf("Resizing %d frames, %d loaded and saved at a time, carving with %d threads\n", int(inputs.size()),
+		numJobs, options.numThreads);
+
+	ThreadPool carvePool(options.numThreads);
+	CarveWorkspace workspace;
+	SequenceOptions sequenceOptions;
+	sequenceOptions.carve.threadPool = &carvePool;
+	sequenceOptions.carve.workspace = &workspace;
+	if (options.lowMemory) {
+		sequenceOptions.carve.storage = CarveStorage::LowMemory;
+	}
+	sequenceOptions.band = options.band;
+	sequenceOptions.keyframeInterval = options.keyframeInterval;
+	sequenceOptions.numLoaders = numJobs;
+	sequenceOptions.numSavers = numJobs;
+	sequenceOptions.maxFramesInFlight = 2 * numJobs + 2;
+	sequenceOptions.getTargetSize = [&](int width, int height, int& targetWidth, int& targetHeight) {
+		getTargetSize(options.target, width, height, targetWidth, targetHeight);
+	};
+	sequenceOptions.getOutputPath = [&](int frame, int targetWidth, int targetHeight) {
+		const fs::path output = getOutputPath(options.outputTemplate, inputs[frame], targetWidth, targetHeight);
+		std::error_code dirErr;
+		if (output.has_parent_path()) {
+			fs::create_directories(output.parent_path(), dirErr);
+		}
+		return output.string();
+	};
+
+	int numKeyframes = 0;
+	double carveTime = 0.0;
+	sequenceOptions.onFrame = [&](const FrameResult& result) {
+		printf("[%d/%d] %s: ", result.frame + 1, int(inputs.size()), inputs[result.frame].string().c_str());
+		Error frameErr = result.error;
+		if (frameErr) {
+			frameErr.print();
+			return;
+		}
+		numKeyframes += result.isKeyframe;
+		carveTime += result.carveMillis;
+		printf("%dx%d -> %dx%d %s, load %.1fms, carve %.1fms%s, save %.1fms\n", result.width, result.height,
+			result.targetWidth, result.targetHeight, result.output.c_str(), result.loadMillis, result.carveMillis,
+			result.isKeyframe ? " (keyframe)" : "", result.saveMillis);
+	};
+
+	std::vector<std::string> paths;
+	for (const fs::path& input : inputs) {
+		paths.push_back(input.string());
+	}
+	const auto startTime = std::chrono::steady_clock::now();
+	const int numFailed = carveSequence(paths, sequenceOptions);
+	const double seconds = 1e-3 * getMillis(startTime);
+	const int numDone = int(inputs.size()) - numFailed;
+	printf("Resized %d of %d frames in %.2fs, %.2f frames/s. %d keyframes, %.1fms carving per frame\n", numDone,
+		int(inputs.size()), seconds, numDone / std::max(1e-6, seconds), numKeyframes,
+		carveTime / std::max(1, numDone));
+	return numFailed;
+}
+
+/// Resizes the images given on the command line, several of them at the same time.
+/// Usage: seam-cli [options] <input>..., see printUsage.
+int main(int argc, char* argv[]) {
+	if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		printUsage();
+		return (argc < 2) ? 2 : 0;
+	}
+
+	CliOptions options;
+	std::vector<fs::path> inputs;
+	Error err = parseArgs(argc, argv, options);
+	if (!err) {
+		err = expandInputs(options.inputs, inputs);
+	}
+	if (err) {
+		err.print();
+		return 2;
+	}
+	setScratchFileThreshold(options.scratchThreshold);
+	setScratchFileDir(options.scratchDir.c_str());
+
+	if (options.sequence) {
+		if (!options.tracePath.empty()) {
+			startTracing();
+		}
+		const int numFailed = resizeSequence(options, inputs);
+		if (!options.tracePath.empty()) {
+			stopTracing();
+			if (Error traceErr = writeTrace(options.tracePath.c_str())) {
+				traceErr.print();
+			} else {
+				printf("Wrote trace to %s\n", options.tracePath.c_str());
+			}
+		}
+		return (numFailed > 0) ? 1 : 0;
+	}
+
+	const int numCores = std::max(1, int(std::thread::hardware_concurrency()));
+	const int numJobs = std::min(int(inputs.size()),
+		options.numJobs > 0 ? options.numJobs : std::max(1, numCores / options.numThreads));
+	printf("Resizing %d images, %d at a time with %d threads each\n", int(inputs.size()), numJobs,
+		options.numThreads);
+
+	if (!options.tracePath.empty()) {
+		startTracing();
+	}
+
+	// Each job takes the next image until all are done
+	std::mutex printMutex;
+	std::atomic<int> nextImage{0};
+	std::atomic<int> numFailed{0};
+	std::atomic<int64_t> totalPixels{0};
+	const auto startTime = std::chrono::steady_clock::now();
+	ThreadPool jobPool(numJobs);
+	jobPool.run(numJobs, [&](int job) {
+		setTraceThreadName(("Job " + std::to_string(job)).c_str());
+		ThreadPool imagePool(options.numThreads);
+		// Images of similar sizes reuse the planes and buffers of the previous one
+		Image image;
+		CarveWorkspace workspace;
+		CarveOptions carveOptions;
+		carveOptions.threadPool = &imagePool;
+		carveOptions.workspace = &workspace;
+		if (options.lowMemory) {
+			carveOptions.storage = CarveStorage::LowMemory;
+		}
+
+		for (int i = nextImage++; i < int(inputs.size()); i = nextImage++) {
+			const fs::path& input = inputs[i];
+			const auto imageStart = std::chrono::steady_clock::now();
+			Error imageErr = image.load(input.string().c_str(), &imagePool);
+			const double loadTime = getMillis(imageStart);
+			const int width = image.getWidth();
+			const int height = image.getHeight();
+			int targetWidth = 0;
+			int targetHeight = 0;
+			double carveTime = 0.0;
+			double saveTime = 0.0;
+			fs::path output;
+			if (!imageErr) {
+				getTargetSize(options.target, width, height, targetWidth, targetHeight);
+				const auto carveStart = std::chrono::steady_clock::now();
+				image.carveCols(width - targetWidth, carveOptions);
+				image.carveRows(height - targetHeight, carveOptions);
+				carveTime = getMillis(carveStart);
+
+				const auto saveStart = std::chrono::steady_clock::now();
+				output = getOutputPath(options.outputTemplate, input, targetWidth, targetHeight);
+				std::error_code dirErr;
+				if (output.has_parent_path()) {
+					fs::create_directories(output.parent_path(), dirErr);
+				}
+				imageErr = image.save(output.string().c_str());
+				saveTime = getMillis(saveStart);
+			}
+
+			std::lock_guard<std::mutex> lock(printMutex);
+			printf("[%d/%d] %s: ", i+1, int(inputs.size()), input.string().c_str());
+			if (imageErr) {
+				++numFailed;
+				imageErr.print();
+				continue;
+			}
+			const double megapixels = 1e-6 * width * height;
+			totalPixels += int64_t(width) * height;
+			printf("%dx%d -> %dx%d %s, load %.1fms, carve %.1fms, save %.1fms, %.2f MP/s\n", width, height,
+				targetWidth, targetHeight, output.string().c_str(), loadTime, carveTime, saveTime,
+				megapixels / (1e-3 * std::max(1e-3, loadTime + carveTime + saveTime)));
+		}
+	});
+
+	const double seconds = 1e-3 * getMillis(startTime);
+	const double megapixels = 1e-6 * double(totalPixels);
+	printf("Resized %d of %d images, %.1f MP in %.2fs, %.2f MP/s\n", int(inputs.size()) - numFailed,
+		int(inputs.size()), megapixels, seconds, megapixels / std::max(1e-6, seconds));
+
+	if (!options.tracePath.empty()) {
+		stopTracing();
+		if (Error traceErr = writeTrace(options.tracePath.c_str())) {
+			traceErr.print();
+		} else {
+			printf("Wrote trace to %s\n", options.tracePath.c_str());
+		}
+	}
+	return (numFailed > 0) ? 1 : 0;
+}
@@ -0,0 +1,601 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "carveHelper.h"
+#include "error.h"
+#include "image.h"
+#include "scratchMemory.h"
+#include "serverProtocol.h"
+#include "threadPool.h"
+#include "trace.h"
+
+/// Settings from the command line.
+struct ServerOptions {
+	std::string socketPath = "/tmp/seam-server.sock"; ///< Where to listen.
+	int numWorkers = 0; ///< Images carved at the same time. 0 uses all cores.
+	int numThreads = 1; ///< Threads used for each image.
+	int queueSize = 0; ///< Requests that can wait for a worker before new ones are turned away. 0 is two per worker.
+	int maxConnections = 256; ///< Clients connected at the same time. Further ones are closed right away.
+	/// Size of the image that each worker carves before the server starts, so that its buffers are allocated.
+	/// @{
+	int warmupWidth = 512;
+	int warmupHeight = 512;
+	/// @}
+	bool lowMemory = false; ///< Carve with CarveStorage::LowMemory.
+	std::string tracePath; ///< If set, the requests are traced until the server stops, and written here.
+	size_t scratchThreshold = 0; ///< See setScratchFileThreshold.
+	std::string scratchDir; ///< See setScratchFileDir.
+};
+
+static void printUsage() {
+	printf(
+		"Usage: seam-server [options]\n"
+		"Resizes images with seam carving for clients that connect to a Unix socket. The workers and their buffers\n"
+		"are kept between requests. See server/serverProtocol.h for the messages.\n"
+		"\n"
+		"Options:\n"
+		"  -S, --socket PATH    Path of the socket. The default is /tmp/seam-server.sock.\n"
+		"  -w, --workers N      Number of images carved at the same time. The default is the number of cores.\n"
+		"  -t, --threads N      Number of threads used for each image. The default is 1.\n"
+		"  -q, --queue N        Number of requests that can wait for a worker. Requests beyond it are answered\n"
+		"                       with Busy right away. The default is two per worker.\n"
+		"      --connections N  Number of clients connected at the same time. The default is 256.\n"
+		"      --warmup WxH     Size of the image each worker carves at startup. The default is 512x512, 0x0\n"
+		"                       skips it.\n"
+		"      --low-memory     Use the dynamic table that needs the least memory. Slower.\n"
+		"      --trace PATH     Write how long each phase took on each thread as a Chrome trace when the server\n"
+		"                       stops, for chrome://tracing or ui.perfetto.dev.\n"
+		"      --scratch-threshold SIZE\n"
+		"                       Keep buffers of at least SIZE bytes, or with a K, M or G suffix, in memory-mapped\n"
+		"                       temporary files, so that images larger than the physical memory can be carved.\n"
+		"      --scratch-dir PATH\n"
+		"                       Directory of those files. The default is the temporary directory of the system.\n"
+		"  -h, --help           Show this message.\n"
+		"\n"
+		"Stop the server with Ctrl+C or SIGTERM. It finishes the requests it has taken, and prints its statistics.\n");
+}
+
+/// Parse the arguments.
+/// @return An error, if they are not valid.
+static Error parseArgs(int argc, char* argv[], ServerOptions& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		auto getValue = [&]() -> const char* {
+			return (i+1 < argc) ? argv[++i] : nullptr;
+		};
+		auto getCount = [&](int& count, int minimum) -> Error {
+			const char* value = getValue();
+			count = value ? atoi(value) : minimum - 1;
+			if (count < minimum) {
+				return Error("Expected a number of at least %d after %s", minimum, arg.c_str());
+			}
+			return Error();
+		};
+		Error err;
+		if (arg == "-S" || arg == "--socket") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.socketPath = value;
+		} else if (arg == "-w" || arg == "--workers") {
+			err = getCount(options.numWorkers, 1);
+		} else if (arg == "-t" || arg == "--threads") {
+			err = getCount(options.numThreads, 1);
+		} else if (arg == "-q" || arg == "--queue") {
+			err = getCount(options.queueSize, 1);
+		} else if (arg == "--connections") {
+			err = getCount(options.maxConnections, 1);
+		} else if (arg == "--warmup") {
+			const char* value = getValue();
+			if (!value || sscanf(value, "%dx%d", &options.warmupWidth, &options.warmupHeight) != 2 ||
+				options.warmupWidth < 0 || options.warmupHeight < 0)
+			{
+				return Error("Expected a size like 512x512 after %s", arg.c_str());
+			}
+		} else if (arg == "--low-memory") {
+			options.lowMemory = true;
+		} else if (arg == "--trace") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.tracePath = value;
+		} else if (arg == "--scratch-threshold") {
+			const char* value = getValue();
+			if (!parseScratchSize(value, options.scratchThreshold) || options.scratchThreshold == 0) {
+				return Error("Expected a size like 512M after %s", arg.c_str());
+			}
+		} else if (arg == "--scratch-dir") {
+			const char* value = getValue();
+			if (!value) {
+				return Error("Expected a path after %s", arg.c_str());
+			}
+			options.scratchDir = value;
+		} else {
+			return Error("Unknown option %s", arg.c_str());
+		}
+		if (err) {
+			return err;
+		}
+	}
+	return Error();
+}
+
+/// Milliseconds since @p start.
+static double getMillis(std::chrono::steady_clock::time_point start) {
+	const std::chrono::duration<double, std::milli> delta = std::chrono::steady_clock::now() - start;
+	return delta.count();
+}
+
+/// Set by the signal handlers to stop the server.
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+	stopRequested = 1;
+}
+
+/// A request, from the time it is read until its response is written. Each connection reuses one for all its
+/// requests, so that the buffers are kept.
+struct Job {
+	RequestHeader request;
+	std::vector<uint8_t> payload; ///< The input bytes or path.
+	ResponseHeader response;
+	std::vector<uint8_t> output; ///< The encoded result, or the error message.
+	bool done = false; ///< Set by the worker once the response is ready. Guarded by Server::mutex.
+	std::condition_variable finished; ///< Signals done.
+};
+
+/// Counts latencies in buckets that grow by 2^(1/8), about 9%, so that a server that runs for months keeps the same
+/// few kilobytes. Percentiles are the upper bound of their bucket.
+struct LatencyHistogram {
+	static constexpr double minMillis = 1e-3; ///< Upper bound of the first bucket.
+	static constexpr int bucketsPerDoubling = 8;
+	static constexpr int numBuckets = 40 * bucketsPerDoubling; ///< The last bucket starts at about 12 days.
+	std::array<int64_t, numBuckets> counts{};
+	int64_t count = 0;
+	double maxMillis = 0.0;
+
+	void add(double millis) {
+		const double doublings = std::log2(std::max(minMillis, millis) / minMillis);
+		const int bucket = std::min(numBuckets - 1, int(std::ceil(doublings * bucketsPerDoubling)));
+		++counts[bucket];
+		++count;
+		maxMillis = std::max(maxMillis, millis);
+	}
+
+	/// Return the latency that @p percent of the requests didn't exceed, or 0 if there are none.
+	double getPercentile(double percent) const {
+		if (count == 0) return 0.0;
+		const int64_t rank = std::min(count - 1, int64_t(percent / 100.0 * count));
+		int64_t numBelow = 0;
+		for (int bucket = 0; bucket < numBuckets; ++bucket) {
+			numBelow += counts[bucket];
+			if (numBelow > rank) {
+				return std::min(maxMillis, minMillis * std::exp2(double(bucket) / bucketsPerDoubling));
+			}
+		}
+		return maxMillis;
+	}
+};
+
+/// State shared by the connections and the workers.
+struct Server {
+	std::mutex mutex;
+	std::condition_variable hasJobs; ///< Signals that a job was queued, or that the server stops.
+	std::deque<Job*> queue; ///< Jobs waiting for a worker. Guarded by mutex.
+	size_t maxQueued = 1; ///< Jobs beyond this are answered with Busy.
+	bool stopping = false; ///< Set once no more jobs come. Guarded by mutex.
+
+	std::mutex statsMutex;
+	/// Milliseconds from reading each carved request to writing its response. Guarded by statsMutex.
+	LatencyHistogram latencies;
+	int64_t numBusy = 0; ///< Requests turned away because the queue was full. Guarded by statsMutex.
+	int64_t numFailed = 0; ///< Requests that failed. Guarded by statsMutex.
+	/// Time with at least one request between reading its header and writing its response, so that the throughput
+	/// doesn't count the time that the server waits for clients.
+	/// @{
+	int numActive = 0; ///< Requests in progress. Guarded by statsMutex.
+	std::chrono::steady_clock::time_point busyStart; ///< When numActive became positive. Guarded by statsMutex.
+	double busyMillis = 0.0; ///< Busy time before busyStart. Guarded by statsMutex.
+	/// @}
+
+	/// Count a request as in progress, from reading its header until endRequest.
+	void beginRequest() {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		if (numActive++ == 0) {
+			busyStart = std::chrono::steady_clock::now();
+		}
+	}
+
+	void endRequest() {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		if (--numActive == 0) {
+			const std::chrono::duration<double, std::milli> delta = std::chrono::steady_clock::now() - busyStart;
+			busyMillis += delta.count();
+		}
+	}
+
+	/// Queue a job for the workers.
+	/// @return False if the queue is full.
+	bool submit(Job& job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (queue.size() >= maxQueued) return false;
+			job.done = false;
+			queue.push_back(&job);
+		}
+		hasJobs.notify_one();
+		return true;
+	}
+
+	/// Wait until a worker is done with @p job.
+	void wait(Job& job) {
+		std::unique_lock<std::mutex> lock(mutex);
+		job.finished.wait(lock, [&]() { return job.done; });
+	}
+
+	/// Wait for the next job.
+	/// @return Null once the server stops and all queued jobs are taken.
+	Job* take() {
+		std::unique_lock<std::mutex> lock(mutex);
+		hasJobs.wait(lock, [&]() { return !queue.empty() || stopping; });
+		if (queue.empty()) return nullptr;
+		Job* job = queue.front();
+		queue.pop_front();
+		return job;
+	}
+
+	/// Hand a job with its response back to its connection.
+	void finish(Job& job) {
+		// Notified under the lock, since the connection can destroy the job as soon as it sees done
+		std::lock_guard<std::mutex> lock(mutex);
+		job.done = true;
+		job.finished.notify_one();
+	}
+
+	/// Let the workers return once the queue is empty.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		hasJobs.notify_all();
+	}
+};
+
+/// Fill in a response that carries an error message.
+static void setError(Job& job, ResponseStatus status, const std::string& message) {
+	job.response = ResponseHeader();
+	job.response.status = status;
+	job.output.assign(message.begin(), message.end());
+	job.response.payloadSize = uint32_t(job.output.size());
+}
+
+/// Write the response of a job.
+/// @return False if the connection failed.
+static bool sendResponse(int fd, const Job& job) {
+	return writeAll(fd, &job.response, sizeof(job.response)) &&
+		(job.output.empty() || writeAll(fd, job.output.data(), job.response.payloadSize));
+}
+
+/// Counts a request as in progress while it exists, see Server::beginRequest.
+struct ActiveRequest {
+	Server& server;
+
+	explicit ActiveRequest(Server& _server)
+		: server(_server)
+	{
+		server.beginRequest();
+	}
+
+	~ActiveRequest() {
+		server.endRequest();
+	}
+};
+
+/// Read the requests of a client and answer them, until it hangs up.
+static void serveConnection(Server& server, int fd) {
+	Job job;
+	for (;;) {
+		if (!readAll(fd, &job.request, sizeof(job.request))) break;
+		const auto start = std::chrono::steady_clock::now();
+		const ActiveRequest active(server);
+		const RequestHeader& request = job.request;
+		if (request.magic != serverMagic ||
+			(request.kind != RequestKind::Bytes && request.kind != RequestKind::Path) ||
+			request.payloadSize > maxRequestPayload)
+		{
+			// The rest of the stream can't be trusted anymore
+			setError(job, ResponseStatus::BadRequest, "Invalid request header");
+			sendResponse(fd, job);
+			break;
+		}
+		job.payload.resize(request.payloadSize);
+		if (!readAll(fd, job.payload.data(), job.payload.size())) break;
+
+		if (!server.submit(job)) {
+			job.response = ResponseHeader();
+			job.response.status = ResponseStatus::Busy;
+			job.output.clear();
+			{
+				std::lock_guard<std::mutex> lock(server.statsMutex);
+				++server.numBusy;
+			}
+			if (!sendResponse(fd, job)) break;
+			continue;
+		}
+		server.wait(job);
+		if (!sendResponse(fd, job)) break;
+
+		std::lock_guard<std::mutex> lock(server.statsMutex);
+		if (job.response.status == ResponseStatus::Ok) {
+			server.latencies.add(getMillis(start));
+		} else {
+			++server.numFailed;
+		}
+	}
+	close(fd);
+}
+
+/// The buffers that a worker keeps between requests.
+struct Worker {
+	ThreadPool pool; ///< Threads for each image.
+	CarveWorkspace workspace;
+	CarveOptions carveOptions;
+	Image image; ///< Images of similar sizes reuse the planes of the previous one.
+
+	explicit Worker(const ServerOptions& options)
+		: pool(options.numThreads)
+	{
+		carveOptions.threadPool = &pool;
+		carveOptions.workspace = &workspace;
+		if (options.lowMemory) {
+			carveOptions.storage = CarveStorage::LowMemory;
+		}
+	}
+
+	/// Carve an image of the given size by half on each side, so that the buffers for images up to that size are
+	/// allocated before the first request.
+	void warmUp(int width, int height) {
+		if (width <= 1 || height <= 1) return;
+		TRACE_SCOPE("warm up");
+		std::mt19937 rng(width * 31 + height);
+		std::vector<Pixel> pixels(size_t(width) * height);
+		for (Pixel& pixel : pixels) {
+			pixel.r = uint8_t(rng());
+			pixel.g = uint8_t(rng());
+			pixel.b = uint8_t(rng());
+		}
+		if (image.create(width, height, pixels.data(), &pool)) return;
+		image.carveCols(width / 2, carveOptions);
+		image.carveRows(height / 2, carveOptions);
+	}
+
+	/// Load, carve and encode the image of a request, and fill in its response.
+	void process(Job& job) {
+		TRACE_SCOPE("request");
+		const RequestHeader& request = job.request;
+		Error err;
+		if (request.kind == RequestKind::Path) {
+			const std::string path(job.payload.begin(), job.payload.end());
+			err = image.load(path.c_str(), &pool);
+		} else {
+			err = image.loadFromMemory(job.payload.data(), job.payload.size(), &pool);
+		}
+		if (err) {
+			setError(job, ResponseStatus::Failed, err.getMessage());
+			return;
+		}
+
+		const int width = image.getWidth();
+		const int height = image.getHeight();
+		const uint32_t targetWidth = request.targetWidth > 0 ? request.targetWidth : uint32_t(width);
+		const uint32_t targetHeight = request.targetHeight > 0 ? request.targetHeight : uint32_t(height);
+		if (targetWidth > uint32_t(width) || targetHeight > uint32_t(height)) {
+			setError(job, ResponseStatus::Failed, Error("Can't enlarge %dx%d to %ux%u", width, height, targetWidth,
+				targetHeight).getMessage());
+			return;
+		}
+		image.carveCols(width - int(targetWidth), carveOptions);
+		image.carveRows(height - int(targetHeight), carveOptions);
+
+		const size_t formatLength = strnlen(request.format, sizeof(request.format));
+		const std::string format = formatLength > 0 ? std::string(request.format, formatLength) : "png";
+		err = image.saveToMemory(format.c_str(), job.output);
+		if (err) {
+			setError(job, ResponseStatus::Failed, err.getMessage());
+			return;
+		}
+		job.response = ResponseHeader();
+		job.response.width = uint32_t(image.getWidth());
+		job.response.height = uint32_t(image.getHeight());
+		job.response.payloadSize = uint32_t(job.output.size());
+	}
+};
+
+/// Take jobs until the server stops.
+static void runWorker(Server& server, const ServerOptions& options) {
+	Worker worker(options);
+	worker.warmUp(options.warmupWidth, options.warmupHeight);
+	while (Job* job = server.take()) {
+		worker.process(*job);
+		server.finish(*job);
+	}
+}
+
+/// A connected client.
+struct Connection {
+	int fd = -1;
+	std::thread thread;
+	std::atomic<bool> closed{false}; ///< Set once the thread is about to return.
+};
+
+/// Accept clients until a stop is requested, then let the connected ones finish their requests.
+static void acceptConnections(Server& server, int listenFd, const ServerOptions& options) {
+	std::list<Connection> connections;
+	auto reapClosed = [&]() {
+		for (auto it = connections.begin(); it != connections.end();) {
+			if (it->closed) {
+				it->thread.join();
+				it = connections.erase(it);
+			} else {
+				++it;
+			}
+		}
+	};
+
+	while (!stopRequested) {
+		// Wake up now and then to check for a stop
+		pollfd listening = {listenFd, POLLIN, 0};
+		if (poll(&listening, 1, 200) <= 0) continue;
+		const int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0) continue;
+		reapClosed();
+		if (int(connections.size()) >= options.maxConnections) {
+			close(fd);
+			continue;
+		}
+		Connection& connection = connections.emplace_back();
+		connection.fd = fd;
+		connection.thread = std::thread([&server, &connection]() {
+			serveConnection(server, connection.fd);
+			connection.closed = true;
+		});
+	}
+
+	// Stop reading new requests. The ones that were read still get their responses.
+	for (Connection& connection : connections) {
+		shutdown(connection.fd, SHUT_RD);
+	}
+	for (Connection& connection : connections) {
+		connection.thread.join();
+	}
+	server.stop();
+}
+
+/// Print the numbers of the requests so far.
+/// @param seconds Time since the server started.
+static void printStats(Server& server, double seconds) {
+	std::lock_guard<std::mutex> lock(server.statsMutex);
+	const LatencyHistogram& latencies = server.latencies;
+	const double busySeconds = 1e-3 * server.busyMillis;
+	printf("Resized %lld images in %.2fs of uptime, busy for %.2fs, %.1f images/s while busy. %lld failed, "
+		"%lld turned away busy\n", (long long)latencies.count, seconds, busySeconds,
+		latencies.count / std::max(1e-6, busySeconds), (long long)server.numFailed, (long long)server.numBusy);
+	printf("Latency p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", latencies.getPercentile(50.0),
+		latencies.getPercentile(90.0), latencies.getPercentile(99.0), latencies.maxMillis);
+}
+
+/// Open the socket and listen on it.
+/// @param[out] listenFd The listening socket.
+static Error listenOn(const std::string& path, int& listenFd) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		return Error("Socket path \"%s\" is too long", path.c_str());
+	}
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		return Error("Failed to create a socket: %s", strerror(errno));
+	}
+	// A socket file left by a server that didn't stop cleanly would make bind fail
+	unlink(path.c_str());
+	if (bind(listenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+		listen(listenFd, SOMAXCONN) != 0)
+	{
+		Error err("Failed to listen on \"%s\": %s", path.c_str(), strerror(errno));
+		close(listenFd);
+		listenFd = -1;
+		return err;
+	}
+	return Error();
+}
+
+/// Serves seam carving requests on a Unix socket until it is stopped.
+/// Usage: seam-server [options], see printUsage.
+int main(int argc, char* argv[]) {
+	if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+		printUsage();
+		return 0;
+	}
+
+	ServerOptions options;
+	Error err = parseArgs(argc, argv, options);
+	int listenFd = -1;
+	if (!err) {
+		err = listenOn(options.socketPath, listenFd);
+	}
+	if (err) {
+		err.print();
+		return 2;
+	}
+	setScratchFileThreshold(options.scratchThreshold);
+	setScratchFileDir(options.scratchDir.c_str());
+
+	// Clients that hang up early must not kill the server while it writes to them
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+
+	const int numCores = std::max(1, int(std::thread::hardware_concurrency()));
+	const int numWorkers = options.numWorkers > 0 ? options.numWorkers : std::max(1, numCores / options.numThreads);
+	Server server;
+	server.maxQueued = size_t(options.queueSize > 0 ? options.queueSize : 2 * numWorkers);
+	printf("Listening on %s with %d workers, %d threads each, up to %d queued requests\n",
+		options.socketPath.c_str(), numWorkers, options.numThreads, int(server.maxQueued));
+	fflush(stdout);
+
+	if (!options.tracePath.empty()) {
+		startTracing();
+	}
+
+	// The connections are accepted on the calling thread, each worker gets its own
+	const auto startTime = std::chrono::steady_clock::now();
+	ThreadPool threads(1 + numWorkers);
+	threads.run(threads.getNumThreads(), [&](int job) {
+		if (job == 0) {
+			setTraceThreadName("Acceptor");
+			acceptConnections(server, listenFd, options);
+		} else {
+			setTraceThreadName(("Worker " + std::to_string(job)).c_str());
+			runWorker(server, options);
+		}
+	});
+	close(listenFd);
+	unlink(options.socketPath.c_str());
+
+	printStats(server, 1e-3 * getMillis(startTime));
+	if (!options.tracePath.empty()) {
+		stopTracing();
+		if (Error traceErr = writeTrace(options.tracePath.c_str())) {
+			traceErr.print();
+		} else {
+			printf("Wrote trace to %s\n", options.tracePath.c_str());
+		}
+	}
+	return 0;
+}
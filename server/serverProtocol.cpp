@@ -0,0 +1,28 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "serverProtocol.h"
+
+bool readAll(int fd, void* data, size_t size) {
+	char* dst = static_cast<char*>(data);
+	while (size > 0) {
+		const ssize_t count = read(fd, dst, size);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		dst += count;
+		size -= size_t(count);
+	}
+	return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+	const char* src = static_cast<const char*>(data);
+	while (size > 0) {
+		const ssize_t count = write(fd, src, size);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		src += count;
+		size -= size_t(count);
+	}
+	return true;
+}
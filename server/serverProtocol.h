@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <stddef.h>
+
+/// Messages of seam-server. A client connects to the Unix socket and sends requests one after another on the same
+/// connection, each followed by its response. Both ends run on the same machine, so the fields are in its byte
+/// order.
+
+/// First field of every request and response.
+static constexpr uint32_t serverMagic = 0x4d414553; // "SEAM"
+
+/// Largest payload of a request, so that a broken client can't make the server allocate without bounds.
+static constexpr uint32_t maxRequestPayload = 256u * 1024 * 1024;
+
+/// What the payload of a request holds.
+enum class RequestKind : uint32_t {
+	Bytes = 0, ///< The encoded input image.
+	Path = 1, ///< The path of the input image, without a terminating zero. The server reads the file itself.
+};
+
+/// Sent before the payload of a request.
+struct RequestHeader {
+	uint32_t magic = serverMagic;
+	RequestKind kind = RequestKind::Bytes;
+	/// Size of the result. Zero keeps the side of the input. Sides can only shrink.
+	/// @{
+	uint32_t targetWidth = 0;
+	uint32_t targetHeight = 0;
+	/// @}
+	/// Format of the result as known by FreeImage, e.g. "png" or "jpg", padded with zeros. Empty gives "png".
+	char format[8] = {};
+	uint32_t payloadSize = 0; ///< Number of bytes after the header.
+};
+
+/// Result of a request.
+enum class ResponseStatus : uint32_t {
+	Ok = 0, ///< The payload is the encoded result.
+	Busy = 1, ///< The queue is full, the request was not carved. Try again later. No payload.
+	Failed = 2, ///< The image couldn't be loaded, carved or encoded. The payload is the error message.
+	BadRequest = 3, ///< The header is not valid. The payload is the error message, and the server hangs up.
+};
+
+/// Sent before the payload of a response.
+struct ResponseHeader {
+	uint32_t magic = serverMagic;
+	ResponseStatus status = ResponseStatus::Ok;
+	/// Size of the result.
+	/// @{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	/// @}
+	uint32_t payloadSize = 0; ///< Number of bytes after the header.
+};
+
+/// Read exactly @p size bytes, retrying after interruptions and short reads.
+/// @return False if the connection was closed or failed first.
+bool readAll(int fd, void* data, size_t size);
+
+/// Write exactly @p size bytes, retrying after interruptions and short writes.
+/// @return False if the connection was closed or failed first.
+bool writeAll(int fd, const void* data, size_t size);
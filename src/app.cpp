@@ -227,6 +227,7 @@ void App::run() {
 	const float emaDecay = 0.95f;
 	int displayWidth = 0;
 	int displayHeight = 0;
+	const int maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
 
 	ImGuiIO& io = ImGui::GetIO();
 	io.IniFilename = nullptr;
@@ -236,6 +237,9 @@ void App::run() {
 		// Poll and handle events (inputs, window resize, etc.)
 		glfwPollEvents();
 
+		// Take the result of the carving in the background, if it is done
+		imageManager.update();
+
 		// Update state based on user input
 		glfwGetFramebufferSize(glfw.window, &displayWidth, &displayHeight);
 		canvas.update(displayWidth, displayHeight);
@@ -262,16 +266,48 @@ void App::run() {
 
 			ImGui::SeparatorText("Seam carving");
 			ImGui::Text("Target size");
-			tooltip("This is the final size after removing seams from the image.");
-			ImGui::SliderInt("Width", &targetWidth, bool(imageWidth), imageWidth);
-			ImGui::SliderInt("Height", &targetHeight, bool(imageHeight), imageHeight);
-			if (ImGui::Button("Carve", ImVec2(vMax.x - vMin.x, 0.0f))) {
+			tooltip("This is the final size after removing seams from the image. "
+				"The image is carved while the sliders move.");
+			bool sizeChanged = ImGui::SliderInt("Width", &targetWidth, bool(imageWidth), imageWidth);
+			sizeChanged |= ImGui::SliderInt("Height", &targetHeight, bool(imageHeight), imageHeight);
+			ImGui::BeginDisabled(!imageWidth);
+			if (ImGui::Button("Reset", ImVec2(buttonWidth, 0.0f))) {
+				targetWidth = imageWidth;
+				targetHeight = imageHeight;
+				sizeChanged = true;
+			}
+			ImGui::EndDisabled();
+			if (sizeChanged) {
 				imageManager.triggerSeam(targetWidth, targetHeight);
 			}
+			ImGui::SameLine();
+			ImGui::BeginDisabled(imageManager.hasSeamIndex() || imageManager.isCarving() || !imageWidth);
+			if (ImGui::Button("Build index", ImVec2(buttonWidth, 0.0f))) {
+				imageManager.triggerBuildSeamIndex();
+			}
+			ImGui::EndDisabled();
+			tooltip("Carve the image down to 1x1 once and remember the order of the seams. "
+				"After that, the sliders resize the image instantly.");
+			if (imageManager.isCarving()) {
+				const CarveProgress& progress = imageManager.getSeamProgress();
+				char progressText[64];
+				snprintf(progressText, sizeof(progressText), "%d / %d seams", progress.done, progress.total);
+				const float fraction = progress.total ? float(progress.done) / float(progress.total) : 0.0f;
+				ImGui::ProgressBar(fraction, ImVec2(buttonWidth, 0.0f), progressText);
+				ImGui::SameLine();
+				if (ImGui::Button("Cancel", ImVec2(buttonWidth, 0.0f))) {
+					imageManager.cancelSeam();
+				}
+			}
 
 			ImGui::SeparatorText("Settings");
 			ImGui::SliderInt("Zoom speed", &canvas.zoomSpeed, 1, 9, nullptr, ImGuiSliderFlags_NoInput);
 			ImGui::ColorEdit3("Background color", clearColor);
+			int numThreads = imageManager.getNumThreads();
+			if (ImGui::SliderInt("Threads", &numThreads, 1, maxThreads, nullptr, ImGuiSliderFlags_AlwaysClamp)) {
+				imageManager.setNumThreads(numThreads);
+			}
+			tooltip("Number of threads used for seam carving. The result is the same for any number.");
 
 			ImGui::SeparatorText("Info");
 			ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f * emaDeltaTime, 1.0f / emaDeltaTime);
@@ -317,3 +353,7 @@ void App::onImageChange() {
 void App::onImageSeamed() {
 	// Empty
 }
+
+void App::onSeamPreview() {
+	// Empty
+}
@@ -99,4 +99,5 @@ private:
 	// From ImageManagerObserver
 	virtual void onImageChange() override;
 	virtual void onImageSeamed() override;
+	virtual void onSeamPreview() override;
 };
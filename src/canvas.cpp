@@ -1,26 +1,65 @@
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+
 #include <Windows.h> // Need to include before gl ;(
 #include <gl/GL.h>
+#define GLFW_INCLUDE_NONE
+#include "GLFW/glfw3.h"
 
 #include "canvas.h"
 #include "image.h"
 
+// Pixel buffer objects are newer than the OpenGL headers of Windows, so their functions are loaded at runtime.
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_STREAM_DRAW 0x88E0
+#define GL_WRITE_ONLY 0x88B9
+
+/// The buffer functions used for the uploads. All null if the driver doesn't have them.
+struct PixelBufferFunctions {
+	void (APIENTRY* genBuffers)(GLsizei n, GLuint* buffers) = nullptr;
+	void (APIENTRY* bindBuffer)(GLenum target, GLuint buffer) = nullptr;
+	void (APIENTRY* bufferData)(GLenum target, ptrdiff_t size, const void* data, GLenum usage) = nullptr;
+	void* (APIENTRY* mapBuffer)(GLenum target, GLenum access) = nullptr;
+	GLboolean (APIENTRY* unmapBuffer)(GLenum target) = nullptr;
+
+	/// Load the functions of the current context.
+	/// @return True if all of them are available.
+	bool load() {
+		genBuffers = reinterpret_cast<decltype(genBuffers)>(glfwGetProcAddress("glGenBuffers"));
+		bindBuffer = reinterpret_cast<decltype(bindBuffer)>(glfwGetProcAddress("glBindBuffer"));
+		bufferData = reinterpret_cast<decltype(bufferData)>(glfwGetProcAddress("glBufferData"));
+		mapBuffer = reinterpret_cast<decltype(mapBuffer)>(glfwGetProcAddress("glMapBuffer"));
+		unmapBuffer = reinterpret_cast<decltype(unmapBuffer)>(glfwGetProcAddress("glUnmapBuffer"));
+		return genBuffers && bindBuffer && bufferData && mapBuffer && unmapBuffer;
+	}
+};
+
+static PixelBufferFunctions pbo;
+
 Canvas::Canvas(ImageManager& _imgManager)
 	: imgManager(_imgManager)
 {}
 
 void Canvas::update(int _width, int _height) {
 	updateCanvasSize(_width, _height);
-
-	if (imageUpdated) {
-		makeTexture();
-		imageUpdated = false;
-	}
+	updatePlanes();
 }
 
 void Canvas::draw() {
-	if (textureID == 0) {
+	// The image can change between update and draw, e.g. when it is loaded from the UI
+	updatePlanes();
+	const bool drawEnergy = showEnergy && !showPreview && !energyPyramid.empty();
+	const Plane plane = drawEnergy ? Plane::Energy : Plane::Rgb;
+	MipPyramid& pyramid = drawEnergy ? energyPyramid : rgbPyramid;
+	if (pyramid.empty()) {
 		return;
 	}
+	++frame;
+	numUploads = 0;
 
 	const int canvasW = width / 2;
 	const int canvasH = height / 2;
@@ -38,14 +77,72 @@ void Canvas::draw() {
 	// We want first scale, then rotate, then translate.
 	glTranslatef(centerX, centerY, 0.0f);
 	glScalef(scaleFactor, scaleFactor, 1.0f);
+
+	// Corners of the image, before the transformation
+	const float left = float(-1 - geomW);
+	const float top = float(-1 - geomH);
+	const float quadW = float(geomWidth + 2);
+	const float quadH = float(geomHeight + 2);
+
+	// Take the mip level with one to two pixels for each pixel of the screen
+	const int numLevels = pyramid.getNumLevels();
+	const float pixelsPerScreenPixel = float(pyramid.getLevel(0).width) / (scaleFactor * quadW);
+	int level = 0;
+	while (level + 1 < numLevels && float(2 << level) <= pixelsPerScreenPixel) {
+		++level;
+	}
+
+	// The last level is a single tile, that is drawn where the finer tiles aren't uploaded yet
+	getTile(plane, pyramid, numLevels - 1, 0, 0, true);
+
+	// Find the tiles on the screen
+	const PlaneView& source = pyramid.getLevel(level);
+	const float tileW = quadW * float(tileSize) / float(source.width);
+	const float tileH = quadH * float(tileSize) / float(source.height);
+	const float visibleX0 = (float(-canvasW) - centerX) / scaleFactor - left;
+	const float visibleX1 = (float(width - canvasW) - centerX) / scaleFactor - left;
+	const float visibleY0 = (float(-canvasH) - centerY) / scaleFactor - top;
+	const float visibleY1 = (float(height - canvasH) - centerY) / scaleFactor - top;
+	const int tileX0 = std::max(0, int(floorf(visibleX0 / tileW)));
+	const int tileX1 = std::min((source.width - 1) / tileSize, int(floorf(visibleX1 / tileW)));
+	const int tileY0 = std::max(0, int(floorf(visibleY0 / tileH)));
+	const int tileY1 = std::min((source.height - 1) / tileSize, int(floorf(visibleY1 / tileH)));
+
 	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, showEnergy ? energyTextureId : textureID);
-	glBegin(GL_QUADS);
-	glTexCoord2f(0.0f, 0.0f); glVertex2i(-1 - geomW,           -1 - geomH);
-	glTexCoord2f(1.0f, 0.0f); glVertex2i(+1 + geomWidth-geomW, -1 - geomH);
-	glTexCoord2f(1.0f, 1.0f); glVertex2i(+1 + geomWidth-geomW, +1 + geomHeight-geomH);
-	glTexCoord2f(0.0f, 1.0f); glVertex2i(-1 - geomW,           +1 + geomHeight-geomH);
-	glEnd();
+	for (int tileY = tileY0; tileY <= tileY1; ++tileY) {
+		for (int tileX = tileX0; tileX <= tileX1; ++tileX) {
+			// Part of the image that the tile covers
+			const float x0 = float(tileX * tileSize) / float(source.width);
+			const float x1 = float(std::min((tileX + 1) * tileSize, source.width)) / float(source.width);
+			const float y0 = float(tileY * tileSize) / float(source.height);
+			const float y1 = float(std::min((tileY + 1) * tileSize, source.height)) / float(source.height);
+
+			// Fall back to the tiles of the coarser levels that hold the same part
+			for (int coarse = level; coarse < numLevels; ++coarse) {
+				const int shift = coarse - level;
+				const Tile* tile = getTile(plane, pyramid, coarse, tileX >> shift, tileY >> shift, coarse == level);
+				if (!tile) continue;
+
+				// Texture coordinates skip the border pixel
+				const PlaneView& coarseSource = pyramid.getLevel(coarse);
+				const float originX = float((tileX >> shift) * tileSize - 1);
+				const float originY = float((tileY >> shift) * tileSize - 1);
+				const float u0 = (x0 * float(coarseSource.width) - originX) / float(tileStorage);
+				const float u1 = (x1 * float(coarseSource.width) - originX) / float(tileStorage);
+				const float v0 = (y0 * float(coarseSource.height) - originY) / float(tileStorage);
+				const float v1 = (y1 * float(coarseSource.height) - originY) / float(tileStorage);
+				glBindTexture(GL_TEXTURE_2D, tile->id);
+				glBegin(GL_QUADS);
+				glTexCoord2f(u0, v0); glVertex2f(left + x0 * quadW, top + y0 * quadH);
+				glTexCoord2f(u1, v0); glVertex2f(left + x1 * quadW, top + y0 * quadH);
+				glTexCoord2f(u1, v1); glVertex2f(left + x1 * quadW, top + y1 * quadH);
+				glTexCoord2f(u0, v1); glVertex2f(left + x0 * quadW, top + y1 * quadH);
+				glEnd();
+				break;
+			}
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void Canvas::pan(int xoffset, int yoffset) {
@@ -91,7 +188,21 @@ void Canvas::onImageSeamed() {
 	const int imgW = image.getWidth();
 	const int imgH = image.getHeight();
 	updateImageGeometry(imgW, imgH);
+	// The RGB pyramid points into the old pixels
+	rgbPyramid.clear();
+	energyPyramid.clear();
 	imageUpdated = true;
+	energyUpdated = true;
+	previewUpdated = false;
+	showPreview = false;
+}
+
+void Canvas::onSeamPreview() {
+	const SeamPreview& preview = imgManager.getSeamPreview();
+	updateImageGeometry(preview.width, preview.height);
+	rgbPyramid.clear();
+	previewUpdated = true;
+	showPreview = true;
 }
 
 void Canvas::updateCanvasSize(int _width, int _height) {
@@ -101,6 +212,11 @@ void Canvas::updateCanvasSize(int _width, int _height) {
 
 	width = _width;
 	height = _height;
+	if (showPreview) {
+		const SeamPreview& preview = imgManager.getSeamPreview();
+		updateImageGeometry(preview.width, preview.height);
+		return;
+	}
 	Image& image = imgManager.getActiveImage();
 	if (!image) {
 		return;
@@ -124,57 +240,200 @@ void Canvas::updateImageGeometry(int imgW, int imgH) {
 	}
 }
 
-void Canvas::makeTexture() {
+void Canvas::updatePlanes() {
+	if (previewUpdated) {
+		makePreviewPlane();
+	} else if (imageUpdated) {
+		makeImagePlane();
+	}
+	previewUpdated = false;
+	imageUpdated = false;
+	if (energyUpdated && showEnergy && !showPreview) {
+		makeEnergyPlane();
+		energyUpdated = false;
+	}
+}
+
+void Canvas::makeImagePlane() {
+	invalidateTiles(Plane::Rgb);
 	Image& image = imgManager.getActiveImage();
 	if (!image) {
+		rgbPyramid.clear();
 		return;
 	}
-	unsigned int tid[2] = {textureID, energyTextureId};
-	if (textureID != 0) {
-		glDeleteTextures(2, tid);
-	}
-	glGenTextures(2, tid);
-	textureID = tid[0];
-	energyTextureId = tid[1];
 
-	// Create RGB texture
 	static_assert(sizeof(image.getData()[0]) == 3);
-	glBindTexture(GL_TEXTURE_2D, textureID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, image.getStride());
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(
-		GL_TEXTURE_2D,
-		0, // level
-		GL_RGB,
-		image.getWidth(),
-		image.getHeight(),
-		0, // border
-		GL_RGB,
-		GL_UNSIGNED_BYTE,
-		image.getData()
-	);
-
-	// Create energy texture
-	static_assert(sizeof(image.getEnergy()[0]) == 4);
-	glBindTexture(GL_TEXTURE_2D, energyTextureId);
+	PlaneView base;
+	base.data = reinterpret_cast<const uint8_t*>(image.getData());
+	base.stride = image.getStride() * 3;
+	base.width = image.getWidth();
+	base.height = image.getHeight();
+	base.channels = 3;
+	rgbPyramid.reset(base, tileSize);
+}
+
+void Canvas::makeEnergyPlane() {
+	invalidateTiles(Plane::Energy);
+	Image& image = imgManager.getActiveImage();
+	if (!image) {
+		energyPyramid.clear();
+		return;
+	}
+
+	// One byte per pixel is plenty for viewing, and a quarter of the floats
+	const float* energy = image.getEnergy();
+	const int imgW = image.getWidth();
+	const int imgH = image.getHeight();
+	const size_t stride = image.getStride();
+	energyBytes.resize(size_t(imgW) * imgH);
+	for (int y = 0; y < imgH; ++y) {
+		const float* src = energy + y * stride;
+		uint8_t* row = &energyBytes[size_t(y) * imgW];
+		for (int x = 0; x < imgW; ++x) {
+			row[x] = uint8_t(std::clamp(src[x], 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
+	}
+
+	PlaneView base;
+	base.data = energyBytes.data();
+	base.stride = size_t(imgW);
+	base.width = imgW;
+	base.height = imgH;
+	base.channels = 1;
+	energyPyramid.reset(base, tileSize);
+}
+
+void Canvas::makePreviewPlane() {
+	// Only the RGB plane is replaced. The energies stay with the last finished image.
+	invalidateTiles(Plane::Rgb);
+	const SeamPreview& preview = imgManager.getSeamPreview();
+	if (preview.pixels.empty()) {
+		rgbPyramid.clear();
+		return;
+	}
+
+	PlaneView base;
+	base.data = reinterpret_cast<const uint8_t*>(preview.pixels.data());
+	base.stride = size_t(preview.width) * 3;
+	base.width = preview.width;
+	base.height = preview.height;
+	base.channels = 3;
+	rgbPyramid.reset(base, tileSize);
+}
+
+void Canvas::invalidateTiles(Plane plane) {
+	for (Tile& tile : tiles) {
+		if (tile.key != 0 && (tile.key >> 48 & 0xff) == uint64_t(plane)) {
+			tileIndex.erase(tile.key);
+			tile.key = 0;
+			tile.lastUsed = 0;
+		}
+	}
+}
+
+const Canvas::Tile* Canvas::getTile(Plane plane, MipPyramid& pyramid, int level, int tileX, int tileY, bool allowUpload) {
+	const uint64_t key = makeTileKey(plane, level, tileX, tileY);
+	auto found = tileIndex.find(key);
+	if (found != tileIndex.end()) {
+		Tile& tile = tiles[found->second];
+		tile.lastUsed = frame;
+		return &tile;
+	}
+	if (!allowUpload || numUploads >= maxUploadsPerFrame) {
+		return nullptr;
+	}
+
+	// Take a new texture, or the least recently used one that isn't drawn in this frame
+	int index = -1;
+	if (int(tiles.size()) < maxTiles) {
+		tiles.reserve(maxTiles);
+		tiles.emplace_back();
+		index = int(tiles.size()) - 1;
+	} else {
+		for (int i = 0; i < int(tiles.size()); ++i) {
+			if (tiles[i].lastUsed != frame && (index < 0 || tiles[i].lastUsed < tiles[index].lastUsed)) {
+				index = i;
+			}
+		}
+		if (index < 0) {
+			return nullptr;
+		}
+	}
+
+	Tile& tile = tiles[index];
+	if (tile.key != 0) {
+		tileIndex.erase(tile.key);
+	}
+	tile.key = key;
+	tile.lastUsed = frame;
+	tileIndex[key] = index;
+	++numUploads;
+	uploadTile(tile, pyramid.getLevel(level), tileX, tileY);
+	return &tile;
+}
+
+void Canvas::uploadTile(Tile& tile, const PlaneView& source, int tileX, int tileY) {
+	if (!pixelBuffersChecked) {
+		pixelBuffersChecked = true;
+		if (pbo.load()) {
+			pbo.genBuffers(2, pixelBuffers);
+		}
+	}
+
+	if (tile.id == 0) {
+		glGenTextures(1, &tile.id);
+		glBindTexture(GL_TEXTURE_2D, tile.id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tileStorage, tileStorage, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, tile.id);
+	}
+
+	// The tile with one more pixel on each side. Past the edges of the image, the edge pixels are repeated.
+	const int x0 = tileX * tileSize;
+	const int y0 = tileY * tileSize;
+	const int innerW = std::min(tileSize, source.width - x0);
+	const int innerH = std::min(tileSize, source.height - y0);
+	const int tileW = innerW + 2;
+	const int tileH = innerH + 2;
+	const int channels = source.channels;
+	const auto writePixels = [&](uint8_t* dst) {
+		const size_t rowBytes = size_t(tileW) * channels;
+		for (int y = 0; y < tileH; ++y) {
+			const int srcY = std::clamp(y0 - 1 + y, 0, source.height - 1);
+			uint8_t* row = dst + y * rowBytes;
+			memcpy(row, source.at(std::max(x0 - 1, 0), srcY), channels);
+			memcpy(row + channels, source.at(x0, srcY), size_t(innerW) * channels);
+			memcpy(row + rowBytes - channels, source.at(std::min(x0 + innerW, source.width - 1), srcY), channels);
+		}
+	};
+
+	// Luminance is expanded to RGB, so that a texture can hold the tiles of any plane
+	const GLenum format = channels == 1 ? GL_LUMINANCE : GL_RGB;
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, image.getStride());
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(
-		GL_TEXTURE_2D,
-		0, // level
-		GL_LUMINANCE,
-		image.getWidth(),
-		image.getHeight(),
-		0, // border
-		GL_LUMINANCE,
-		GL_FLOAT,
-		image.getEnergy()
-	);
-
-	// Unbind texture
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	const size_t size = size_t(tileW) * tileH * channels;
+	const unsigned int buffer = pixelBuffers[nextPixelBuffer];
+	if (buffer != 0) {
+		// Give the buffer new storage, so that the driver doesn't wait for the last upload that used it
+		nextPixelBuffer ^= 1;
+		pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		pbo.bufferData(GL_PIXEL_UNPACK_BUFFER, ptrdiff_t(size), nullptr, GL_STREAM_DRAW);
+		if (void* mapped = pbo.mapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY)) {
+			writePixels(static_cast<uint8_t*>(mapped));
+			if (pbo.unmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+				// The data pointer is an offset into the bound buffer
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tileW, tileH, format, GL_UNSIGNED_BYTE, nullptr);
+				pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				return;
+			}
+		}
+		// The buffer got lost, e.g. on a mode change. Upload from memory instead.
+		pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	uploadBuffer.resize(size);
+	writePixels(uploadBuffer.data());
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tileW, tileH, format, GL_UNSIGNED_BYTE, uploadBuffer.data());
 }
@@ -1,4 +1,10 @@
 #pragma once
+#include <functional>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "mipPyramid.h"
 #include "observer.h"
 
 class ImageManager;
@@ -47,13 +53,49 @@ public:
 	// From ImageManagerObserver
 	virtual void onImageChange() override;
 	virtual void onImageSeamed() override;
+	virtual void onSeamPreview() override;
 
 private:
+	/// The images are drawn in tiles of this many pixels on each side, so that no texture is larger than the driver
+	/// allows. Must be even, so that each tile of a mip level lies inside one tile of the next level.
+	static constexpr int tileSize = 510;
+	/// Size of the tile textures. A tile also holds the pixels around it, so that filtering doesn't show the edges.
+	static constexpr int tileStorage = tileSize + 2;
+	static constexpr int maxTiles = 96; ///< Number of tile textures we keep. Bounds the GPU memory.
+	static constexpr int maxUploadsPerFrame = 16; ///< Bounds the time spent in uploads by each frame.
+
+	/// The images that can be shown.
+	enum class Plane {
+		Rgb, ///< The image, or the preview of the carving.
+		Energy, ///< The energies of the image.
+	};
+
+	/// A tile of a mip level of a plane, in a texture.
+	struct Tile {
+		unsigned int id = 0; ///< OpenGL texture id.
+		uint64_t key = 0; ///< Which tile it holds, see #makeTileKey. Zero if none.
+		uint64_t lastUsed = 0; ///< The last frame that drew it.
+	};
+
 	ImageManager& imgManager; ///< Image manager to get the image.
-	unsigned int textureID = 0; ///< OpenGL texture id.
-	unsigned int energyTextureId = 0; ///< Texture id for the energy view.
-	bool showEnergy = false; ///< If true, show the energy texture instead of the RGB image.
-	bool imageUpdated = false; ///< Set to true if the image has been updated. In this case we have to recreate the texture.
+	MipPyramid rgbPyramid; ///< Mip levels of the image or the preview. Empty until the next update.
+	MipPyramid energyPyramid; ///< Mip levels of #energyBytes. Only built while the energies are shown.
+	std::vector<uint8_t> energyBytes; ///< The energies of the image, one byte per pixel.
+	std::vector<Tile> tiles; ///< The tile textures. At most #maxTiles.
+	std::unordered_map<uint64_t, int> tileIndex; ///< Index in #tiles of each uploaded tile.
+	uint64_t frame = 0; ///< Number of drawn frames, used to find the least recently used tile.
+	int numUploads = 0; ///< Number of tiles uploaded in the current frame.
+	/// Pixel buffer objects that the uploads go through, in turn, so that writing the next one doesn't wait for the
+	/// last upload. Zero if the driver doesn't support them, then the uploads read from #uploadBuffer.
+	unsigned int pixelBuffers[2] = {0, 0};
+	int nextPixelBuffer = 0; ///< Index of the pixel buffer for the next upload.
+	bool pixelBuffersChecked = false; ///< True once we tried to create the pixel buffers.
+	std::vector<uint8_t> uploadBuffer; ///< Used for the uploads without pixel buffers.
+	bool showEnergy = false; ///< If true, show the energies instead of the RGB image.
+	bool imageUpdated = false; ///< Set to true if the image has been updated. In this case we have to rebuild the RGB plane.
+	bool energyUpdated = false; ///< Set to true if the energy plane is out of date. It is rebuilt once it is shown.
+	bool previewUpdated = false; ///< Set to true if there is a new preview of the carving to show.
+	bool showPreview = false; ///< If true, the RGB plane is a preview, and there is no energy plane for it.
 
 	int width = 0; ///< Canvas width.
 	int height = 0; ///< Canvas height.
@@ -78,8 +120,46 @@ private:
 	/// @param imgH Image height.
 	void updateImageGeometry(int imgW, int imgH);
 
-	/// (Re-)Creates the OpenGL texture. Has to be called from the main thread.
-	void makeTexture();
+	/// Rebuild the planes that changed since the last call. Has to be called from the main thread.
+	void updatePlanes();
+
+	/// Use the image as the RGB plane. Has to be called from the main thread.
+	void makeImagePlane();
+
+	/// Convert the energies of the image into the energy plane. Has to be called from the main thread.
+	void makeEnergyPlane();
+
+	/// Use the preview of the carving as the RGB plane. Has to be called from the main thread.
+	void makePreviewPlane();
+
+	/// Forget the uploaded tiles of a plane, since its pixels changed. The textures are kept for other tiles.
+	void invalidateTiles(Plane plane);
+
+	/// Return the key of a tile, that tells which pixels it holds. Never zero.
+	/// @param plane The plane.
+	/// @param level Mip level.
+	/// @param tileX Column of the tile in the level.
+	/// @param tileY Row of the tile in the level.
+	static uint64_t makeTileKey(Plane plane, int level, int tileX, int tileY) {
+		return uint64_t(level + 1) << 56 | uint64_t(plane) << 48 | uint64_t(tileY) << 24 | uint64_t(tileX);
+	}
+
+	/// Return a tile of a plane, and upload it if it isn't in a texture yet.
+	/// @param plane The plane.
+	/// @param pyramid Mip levels of the plane.
+	/// @param level Mip level.
+	/// @param tileX Column of the tile in the level.
+	/// @param tileY Row of the tile in the level.
+	/// @param allowUpload If false, only an uploaded tile is returned.
+	/// @return Null if it isn't uploaded, and can't be in this frame.
+	const Tile* getTile(Plane plane, MipPyramid& pyramid, int level, int tileX, int tileY, bool allowUpload);
+
+	/// Upload the pixels of a tile and the ones around it into its texture. The texture is created if needed.
+	/// @param tile The tile.
+	/// @param source The mip level that holds the tile.
+	/// @param tileX Column of the tile in the level.
+	/// @param tileY Row of the tile in the level.
+	void uploadTile(Tile& tile, const PlaneView& source, int tileX, int tileY);
 
 	/// Map the interger zoom value to a real scale.
 	/// @param value Zoom value.
@@ -0,0 +1,1235 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <tuple>
+#include <vector>
+
+#include "image.h"
+#include "scratchMemory.h"
+#include "simd.h"
+#include "threadPool.h"
+#include "trace.h"
+
+/// Initial value of the cumulative energy. Also used for pixels outside the image, so they are never chosen.
+static constexpr float maxTotal = 1e38f;
+
+/// One term of the pixel energy: the luma difference of the two neighbours in one direction. A pixel on the border
+/// uses the difference to its only neighbour, doubled.
+inline float computeGradient(float prev, float center, float next, bool hasPrev, bool hasNext) {
+	if (hasPrev && hasNext) return fabsf(next - prev);
+	if (hasNext) return fabsf(next - center)*2.0f;
+	if (hasPrev) return fabsf(center - prev)*2.0f;
+	return 0.0f;
+}
+
+/// A range of columns [begin, end).
+struct ColRange {
+	int begin = 0;
+	int end = 0;
+
+	bool empty() const {
+		return begin >= end;
+	}
+
+	int size() const {
+		return end - begin;
+	}
+
+	/// Extend the range to also cover @p other.
+	void merge(const ColRange& other) {
+		if (other.empty()) return;
+		if (empty()) {
+			*this = other;
+		} else {
+			begin = std::min(begin, other.begin);
+			end = std::max(end, other.end);
+		}
+	}
+};
+
+/// Contiguous copies of a row range, so that it can be processed with SIMD. One per job.
+struct RowScratch {
+	std::vector<float> parents; ///< Totals of the previous row, with one extra pixel on each side.
+	std::vector<float> energy; ///< Energies of the range.
+	std::vector<float> total; ///< Computed totals of the range.
+	std::vector<int8_t> prev; ///< Computed offsets to the parents.
+
+	/// Make room for a row with @p cols pixels.
+	void resize(int cols) {
+		parents.resize(cols+2);
+		energy.resize(cols);
+		total.resize(cols);
+		prev.resize(cols);
+	}
+
+	/// Return the allocated memory in bytes.
+	size_t getCapacity() const {
+		return (parents.capacity() + energy.capacity() + total.capacity()) * sizeof(float) + prev.capacity();
+	}
+};
+
+/// Dynamic table where the elements do not move. Instead there is another 2d table with indices (idxMap). After
+/// removing each seam, only that map changes - each pixel in a row gets moved by one. The map transforms virtual
+/// (row, col) into actual offsets in our dynamic table. (dyn[r*idxStride + idxMap[r*idxStride + c]]).
+/// Row ranges are gathered into contiguous buffers before they are processed, and the results are scattered back.
+struct IndexedTable {
+	static constexpr bool keepsAllTotals = true; ///< The totals of all rows are kept, so the table can be repaired.
+	static constexpr int colAlignment = 1; ///< Row ranges computed by different threads can start at any column.
+	/// Number of pixels to the next row of the index map. It is the number of columns of the image, but we can't use
+	/// them directly, since they will change after each seam.
+	int idxStride = 0;
+	/// Stores the original column of each pixel, which is also its position in its row of #dyn. When removing a
+	/// seam, remove it from this map and do changes only here. Columns fit in an int, even when the whole table
+	/// doesn't.
+	ScratchVector<int> idxMap;
+	/// Struct to keep the whole dynamic state. A bottleneck in the performance is accesing memory that is
+	/// far away. So this will keep everything we need next to each other.
+	struct DynamicState {
+		float energy; ///< Keeps the image energy.
+		float total; ///< Dynamic table for computing the lowest energies.
+		int8_t prev; ///< Stores the indices of the seam for each row or column.
+	};
+	ScratchVector<DynamicState> dyn;
+
+	/// Allocate the table for the given size.
+	void allocate(int rows, int cols) {
+		idxStride = cols;
+		dyn.resize(size_t(cols) * rows);
+		idxMap.resize(size_t(cols) * rows);
+	}
+
+	/// Return the allocated memory in bytes.
+	size_t getCapacity() const {
+		return dyn.capacity() * sizeof(DynamicState) + idxMap.capacity() * sizeof(int);
+	}
+
+	/// Fill a row with the image data.
+	/// @param getImageIdx Returns the offset in the image of a given column.
+	/// @param energy The image energy.
+	template <typename IdxFunc>
+	void initRow(int r, int cols, IdxFunc&& getImageIdx, const float* energy) {
+		for (int c = 0; c < cols; ++c) {
+			const size_t idx = size_t(r)*idxStride + c;
+			idxMap[idx] = c;
+			dyn[idx].energy = energy[getImageIdx(c)];
+			dyn[idx].total = (r == 0) ? dyn[idx].energy : maxTotal;
+			dyn[idx].prev = 0;
+		}
+	}
+
+	/// Recompute the pixels in the columns [cBegin, cLast] of row @p r from the previous row.
+	void computeRange(int r, int cBegin, int cLast, int cols, RowScratch& scratch) {
+		if (cLast < cBegin) return;
+		computeTotals(r, cBegin, cLast, cols, scratch);
+		for (int c = cBegin; c <= cLast; ++c) {
+			DynamicState& state = dyn[getIdx(r, c)];
+			state.total = scratch.total[c - cBegin];
+			state.prev = scratch.prev[c - cBegin];
+		}
+	}
+
+	/// Same as computeRange, but return the columns where the total changed.
+	ColRange updateRange(int r, int cBegin, int cLast, int cols, RowScratch& scratch) {
+		ColRange changed;
+		if (cLast < cBegin) return changed;
+		computeTotals(r, cBegin, cLast, cols, scratch);
+		for (int c = cBegin; c <= cLast; ++c) {
+			DynamicState& state = dyn[getIdx(r, c)];
+			if (state.total != scratch.total[c - cBegin]) {
+				changed.merge({c, c+1});
+				state.total = scratch.total[c - cBegin];
+			}
+			state.prev = scratch.prev[c - cBegin];
+		}
+		return changed;
+	}
+
+	/// Compute the pixels in the columns [cBegin, cLast] of row @p r into the scratch buffers.
+	void computeTotals(int r, int cBegin, int cLast, int cols, RowScratch& scratch) {
+		const int count = cLast - cBegin + 1;
+
+		// Gather the parents, with a huge value outside the image, so that they are never chosen.
+		float* parents = scratch.parents.data() + 1;
+		const int pBegin = std::max(0, cBegin-1);
+		const int pEnd = std::min(cols, cLast+2);
+		parents[-1] = parents[count] = maxTotal;
+		for (int c = pBegin; c < pEnd; ++c) {
+			parents[c - cBegin] = dyn[getIdx(r-1, c)].total;
+		}
+		float* energy = scratch.energy.data();
+		for (int c = cBegin; c <= cLast; ++c) {
+			energy[c - cBegin] = dyn[getIdx(r, c)].energy;
+		}
+
+		computeTotalRow(parents, energy, scratch.total.data(), scratch.prev.data(), count);
+	}
+
+	/// Return the totals of a row as a contiguous array.
+	const float* getTotals(int r, int cols, RowScratch& scratch) {
+		float* totals = scratch.total.data();
+		for (int c = 0; c < cols; ++c) {
+			totals[c] = dyn[getIdx(r, c)].total;
+		}
+		return totals;
+	}
+
+	/// Return the offset to the parent of a pixel.
+	int getPrev(int r, int c) const {
+		return dyn[getIdx(r, c)].prev;
+	}
+
+	/// Return the column of a pixel before any seam was removed.
+	int getOriginalCol(int r, int c) const {
+		return idxMap[size_t(r)*idxStride + c];
+	}
+
+	/// Return the energy of a pixel.
+	float getEnergy(int r, int c) const {
+		return dyn[getIdx(r, c)].energy;
+	}
+
+	/// Change the energy of a pixel. Pixels in the first row have no parents, so their total changes as well.
+	void setEnergy(int r, int c, float value) {
+		DynamicState& state = dyn[getIdx(r, c)];
+		state.energy = value;
+		if (r == 0) {
+			state.total = value;
+		}
+	}
+
+	/// Remove the pixel at column @p c from row @p r, which has @p cols pixels.
+	void removePixel(int r, int c, int cols) {
+		removePixels(r, &c, 1, cols);
+	}
+
+	/// Remove @p count pixels from row @p r, which has @p cols pixels, in a single pass.
+	/// @param sortedCols Columns of the pixels, in increasing order.
+	void removePixels(int r, const int* sortedCols, int count, int cols) {
+		int* row = &idxMap[size_t(r)*idxStride];
+		int dst = sortedCols[0];
+		for (int i = 0; i < count; ++i) {
+			const int srcEnd = (i+1 < count) ? sortedCols[i+1] : cols;
+			for (int c = sortedCols[i]+1; c < srcEnd; ++c) {
+				row[dst++] = row[c];
+			}
+		}
+	}
+
+	/// Get the offset in our dynamic table for a given virtual row and column.
+	size_t getIdx(const int& r, const int& c) const {
+		const size_t rowOffset = size_t(r)*idxStride;
+		return rowOffset + idxMap[rowOffset + c];
+	}
+};
+
+/// Dynamic table where every row is kept compacted, with each field in its own array. Removing a seam shifts the
+/// tail of each row once, but there is no indirection, and the SIMD kernels work directly on the table.
+/// Each row has one extra pixel on both sides, which always has the maximal total, so that it is never chosen.
+struct CompactTable {
+	static constexpr bool keepsAllTotals = true; ///< The totals of all rows are kept, so the table can be repaired.
+	static constexpr int colAlignment = 1; ///< Row ranges computed by different threads can start at any column.
+	int rowStride = 0; ///< Number of elements to the next row, including the two extra pixels.
+	ScratchVector<float> energy; ///< Keeps the image energy.
+	ScratchVector<float> total; ///< Dynamic table for computing the lowest energies.
+	ScratchVector<int8_t> prev; ///< Offset to the parent of each pixel.
+	ScratchVector<int> originalCol; ///< Column of each pixel before any seam was removed.
+
+	/// Allocate the table for the given size.
+	void allocate(int rows, int cols) {
+		rowStride = cols+2;
+		energy.resize(size_t(rowStride) * rows);
+		total.resize(size_t(rowStride) * rows);
+		prev.resize(size_t(rowStride) * rows);
+		originalCol.resize(size_t(rowStride) * rows);
+	}
+
+	/// Return the allocated memory in bytes.
+	size_t getCapacity() const {
+		return (energy.capacity() + total.capacity()) * sizeof(float) + prev.capacity()
+			+ originalCol.capacity() * sizeof(int);
+	}
+
+	/// Fill a row with the image data.
+	/// @param getImageIdx Returns the offset in the image of a given column.
+	/// @param energy The image energy.
+	template <typename IdxFunc>
+	void initRow(int r, int cols, IdxFunc&& getImageIdx, const float* imageEnergy) {
+		const size_t offset = getOffset(r, 0);
+		total[offset-1] = total[offset+cols] = maxTotal;
+		for (int c = 0; c < cols; ++c) {
+			originalCol[offset+c] = c;
+			energy[offset+c] = imageEnergy[getImageIdx(c)];
+			total[offset+c] = (r == 0) ? energy[offset+c] : maxTotal;
+			prev[offset+c] = 0;
+		}
+	}
+
+	/// Recompute the pixels in the columns [cBegin, cLast] of row @p r from the previous row.
+	void computeRange(int r, int cBegin, int cLast, int /*cols*/, RowScratch& /*scratch*/) {
+		const int count = cLast - cBegin + 1;
+		if (count <= 0) return;
+		const size_t offset = getOffset(r, cBegin);
+		computeTotalRow(&total[offset - rowStride], &energy[offset], &total[offset], &prev[offset], count);
+	}
+
+	/// Same as computeRange, but return the columns where the total changed.
+	ColRange updateRange(int r, int cBegin, int cLast, int /*cols*/, RowScratch& scratch) {
+		ColRange changed;
+		const int count = cLast - cBegin + 1;
+		if (count <= 0) return changed;
+		const size_t offset = getOffset(r, cBegin);
+		float* oldTotal = scratch.total.data();
+		std::copy_n(&total[offset], count, oldTotal);
+		computeTotalRow(&total[offset - rowStride], &energy[offset], &total[offset], &prev[offset], count);
+		for (int i = 0; i < count; ++i) {
+			if (oldTotal[i] != total[offset+i]) {
+				changed.merge({cBegin+i, cBegin+i+1});
+			}
+		}
+		return changed;
+	}
+
+	/// Return the totals of a row as a contiguous array.
+	const float* getTotals(int r, int /*cols*/, RowScratch& /*scratch*/) {
+		return &total[getOffset(r, 0)];
+	}
+
+	/// Return the offset to the parent of a pixel.
+	int getPrev(int r, int c) const {
+		return prev[getOffset(r, c)];
+	}
+
+	/// Return the column of a pixel before any seam was removed.
+	int getOriginalCol(int r, int c) const {
+		return originalCol[getOffset(r, c)];
+	}
+
+	/// Return the energy of a pixel.
+	float getEnergy(int r, int c) const {
+		return energy[getOffset(r, c)];
+	}
+
+	/// Change the energy of a pixel. Pixels in the first row have no parents, so their total changes as well.
+	void setEnergy(int r, int c, float value) {
+		energy[getOffset(r, c)] = value;
+		if (r == 0) {
+			total[getOffset(r, c)] = value;
+		}
+	}
+
+	/// Remove the pixel at column @p c from row @p r, which has @p cols pixels.
+	void removePixel(int r, int c, int cols) {
+		removePixels(r, &c, 1, cols);
+	}
+
+	/// Remove @p count pixels from row @p r, which has @p cols pixels, in a single pass.
+	/// @param sortedCols Columns of the pixels, in increasing order.
+	void removePixels(int r, const int* sortedCols, int count, int cols) {
+		size_t dst = getOffset(r, sortedCols[0]);
+		for (int i = 0; i < count; ++i) {
+			// Move the pixels between this removed pixel and the next one.
+			const size_t src = getOffset(r, sortedCols[i]+1);
+			const size_t size = getOffset(r, (i+1 < count) ? sortedCols[i+1] : cols) - src;
+			std::copy_n(&energy[src], size, &energy[dst]);
+			std::copy_n(&total[src], size, &total[dst]);
+			std::copy_n(&prev[src], size, &prev[dst]);
+			std::copy_n(&originalCol[src], size, &originalCol[dst]);
+			dst += size;
+		}
+		// The old pixel after the new last one becomes the extra pixel on the right.
+		total[getOffset(r, cols-count)] = maxTotal;
+	}
+
+	/// Get the offset in the table for a given virtual row and column.
+	size_t getOffset(int r, int c) const {
+		return size_t(r)*rowStride + c + 1;
+	}
+};
+
+/// Dynamic table for carving with little memory. Rows are kept compacted, like in CompactTable, but only the totals
+/// of the last two computed rows are kept, and the offsets to the parents are packed into 2 bits each. The dynamic
+/// state takes a quarter of a byte per pixel, instead of five, on top of the energies and the original columns.
+/// Without the totals of all rows, the table can't be repaired after removing a seam, so it is computed again.
+struct PackedTable {
+	static constexpr bool keepsAllTotals = false; ///< Only two rows of totals are kept.
+	static constexpr int colAlignment = 4; ///< Threads must compute whole bytes of the packed parents.
+	int rowStride = 0; ///< Number of elements to the next row, including the two extra pixels.
+	int prevStride = 0; ///< Number of bytes to the next row of #prev.
+	/// Keeps the image energy. The extra pixels have the maximal value, since the first row is used as the totals
+	/// of its parents.
+	ScratchVector<float> energy;
+	ScratchVector<float> total; ///< Totals of the last two computed rows, with the same layout as #energy.
+	ScratchVector<uint8_t> prev; ///< Offset to the parent of each pixel plus one, four pixels in each byte.
+	ScratchVector<int> originalCol; ///< Column of each pixel before any seam was removed.
+
+	/// Allocate the table for the given size.
+	void allocate(int rows, int cols) {
+		rowStride = cols+2;
+		prevStride = (cols + colAlignment - 1) / colAlignment;
+		energy.resize(size_t(rowStride) * rows);
+		total.assign(2 * size_t(rowStride), maxTotal);
+		prev.resize(size_t(prevStride) * rows);
+		originalCol.resize(size_t(rowStride) * rows);
+	}
+
+	/// Return the allocated memory in bytes.
+	size_t getCapacity() const {
+		return (energy.capacity() + total.capacity()) * sizeof(float) + prev.capacity()
+			+ originalCol.capacity() * sizeof(int);
+	}
+
+	/// Fill a row with the image data.
+	/// @param getImageIdx Returns the offset in the image of a given column.
+	/// @param energy The image energy.
+	template <typename IdxFunc>
+	void initRow(int r, int cols, IdxFunc&& getImageIdx, const float* imageEnergy) {
+		const size_t offset = getOffset(r, 0);
+		energy[offset-1] = energy[offset+cols] = maxTotal;
+		for (int c = 0; c < cols; ++c) {
+			originalCol[offset+c] = c;
+			energy[offset+c] = imageEnergy[getImageIdx(c)];
+		}
+	}
+
+	/// Compute the pixels in the columns [cBegin, cLast] of row @p r from the previous row, which must be the last
+	/// computed one. @p cBegin must be a multiple of #colAlignment.
+	void computeRange(int r, int cBegin, int cLast, int cols, RowScratch& scratch) {
+		const int count = cLast - cBegin + 1;
+		if (count <= 0) return;
+		const float* parents = (r == 1) ? &energy[getOffset(0, cBegin)] : &getTotalRow(r-1)[cBegin];
+		float* rowTotal = getTotalRow(r);
+		int8_t* rowPrev = scratch.prev.data();
+		computeTotalRow(parents, &energy[getOffset(r, cBegin)], &rowTotal[cBegin], rowPrev, count);
+		if (cLast == cols-1) {
+			rowTotal[cols] = maxTotal;
+		}
+
+		uint8_t* packed = &prev[size_t(r)*prevStride + cBegin/colAlignment];
+		for (int i = 0; i < count; i += colAlignment) {
+			uint8_t bits = 0;
+			for (int j = 0; j < colAlignment && i+j < count; ++j) {
+				bits |= uint8_t(rowPrev[i+j] + 1) << (2*j);
+			}
+			*packed++ = bits;
+		}
+	}
+
+	/// Return the totals of a row as a contiguous array. Only the last computed row and the first one are kept.
+	const float* getTotals(int r, int /*cols*/, RowScratch& /*scratch*/) {
+		return (r == 0) ? &energy[getOffset(0, 0)] : getTotalRow(r);
+	}
+
+	/// Return the offset to the parent of a pixel.
+	int getPrev(int r, int c) const {
+		const uint8_t bits = prev[size_t(r)*prevStride + c/colAlignment] >> (2*(c % colAlignment));
+		return int(bits & 3) - 1;
+	}
+
+	/// Return the column of a pixel before any seam was removed.
+	int getOriginalCol(int r, int c) const {
+		return originalCol[getOffset(r, c)];
+	}
+
+	/// Return the energy of a pixel.
+	float getEnergy(int r, int c) const {
+		return energy[getOffset(r, c)];
+	}
+
+	/// Change the energy of a pixel. The first row is its own total.
+	void setEnergy(int r, int c, float value) {
+		energy[getOffset(r, c)] = value;
+	}
+
+	/// Remove the pixel at column @p c from row @p r, which has @p cols pixels.
+	void removePixel(int r, int c, int cols) {
+		removePixels(r, &c, 1, cols);
+	}
+
+	/// Remove @p count pixels from row @p r, which has @p cols pixels, in a single pass. The parents are not moved,
+	/// since the whole table is computed again before they are read.
+	/// @param sortedCols Columns of the pixels, in increasing order.
+	void removePixels(int r, const int* sortedCols, int count, int cols) {
+		size_t dst = getOffset(r, sortedCols[0]);
+		for (int i = 0; i < count; ++i) {
+			// Move the pixels between this removed pixel and the next one.
+			const size_t src = getOffset(r, sortedCols[i]+1);
+			const size_t size = getOffset(r, (i+1 < count) ? sortedCols[i+1] : cols) - src;
+			std::copy_n(&energy[src], size, &energy[dst]);
+			std::copy_n(&originalCol[src], size, &originalCol[dst]);
+			dst += size;
+		}
+		// The old pixel after the new last one becomes the extra pixel on the right.
+		energy[getOffset(r, cols-count)] = maxTotal;
+	}
+
+	/// Get the offset in the table for a given virtual row and column.
+	size_t getOffset(int r, int c) const {
+		return size_t(r)*rowStride + c + 1;
+	}
+
+	/// Return the totals of row @p r, which must be one of the last two computed rows.
+	float* getTotalRow(int r) {
+		return &total[size_t(r & 1)*rowStride + 1];
+	}
+};
+
+/// One level of the energy pyramid. Each pixel is the mean of 2x2 pixels of the larger level.
+struct EnergyLevel {
+	int rows = 0;
+	int cols = 0;
+	std::vector<float> energy;
+};
+
+/// All buffers used while carving. Buffers only grow, so keeping a workspace between carves (see
+/// CarveOptions::workspace) means that carving images of the same or a smaller size again doesn't allocate memory.
+struct CarveWorkspace {
+	std::tuple<IndexedTable, CompactTable, PackedTable> tables; ///< The dynamic table of each storage.
+	std::vector<int> seam; ///< Stores the indices of the seam for each row or column.
+	std::vector<RowScratch> scratch; ///< Scratch buffers, one for each job.
+	std::vector<ColRange> removedCols; ///< Columns of each row that were removed by the last seams.
+	std::vector<ColRange> energyChanged; ///< Columns of each row where the energy was recomputed after the last seams.
+	/// Columns changed by each job while the table is repaired on all threads, for the even and the odd rows.
+	std::vector<ColRange> jobChanges[2];
+	/// Used for the coarse-to-fine search.
+	/// @{
+	std::vector<EnergyLevel> levels; ///< Smaller levels of the pyramid, from the largest one. Never shrinks.
+	std::vector<int> levelSeam; ///< Seam found on the current level.
+	std::vector<int> coarseSeam; ///< Seam found on the smaller level.
+	std::vector<int> bandBegin; ///< First column of the band in each row.
+	std::vector<float> bandTotal; ///< Totals of the band, row by row.
+	std::vector<int8_t> bandPrev; ///< Offsets to the parents in the band, row by row.
+	std::vector<float> bandParents; ///< Totals of the previous row, aligned to the current band.
+	std::vector<float> bandEnergy; ///< Energies of the current row of the band.
+	/// @}
+	/// Used when removing a batch of seams.
+	/// @{
+	std::vector<int> candidates; ///< Columns of the last row, ordered by their total.
+	std::vector<uint8_t> taken; ///< Marks the pixels of the seams in the batch.
+	std::vector<int> batchSeams; ///< The seams of the batch in each row, one row after another.
+	/// @}
+	/// Used when carving rows on the transposed image.
+	/// @{
+	Image transposed; ///< The transposed image.
+	std::vector<int> transposedOrder; ///< The transposed removal order.
+	std::vector<Pixel> transposedPreview; ///< The preview transposed back.
+	/// @}
+	std::vector<Pixel> preview; ///< Pixels given to CarveOptions::onPreview.
+
+	/// Return the allocated memory in bytes.
+	size_t getCapacity() const {
+		size_t result = std::get<IndexedTable>(tables).getCapacity() + std::get<CompactTable>(tables).getCapacity()
+			+ std::get<PackedTable>(tables).getCapacity();
+		for (const RowScratch& rowScratch : scratch) {
+			result += rowScratch.getCapacity();
+		}
+		for (const EnergyLevel& level : levels) {
+			result += level.energy.capacity() * sizeof(float);
+		}
+		result += (seam.capacity() + levelSeam.capacity() + coarseSeam.capacity() + bandBegin.capacity()
+			+ candidates.capacity() + batchSeams.capacity() + transposedOrder.capacity()) * sizeof(int);
+		result += (removedCols.capacity() + energyChanged.capacity() + jobChanges[0].capacity()
+			+ jobChanges[1].capacity()) * sizeof(ColRange);
+		result += (bandTotal.capacity() + bandParents.capacity() + bandEnergy.capacity()) * sizeof(float);
+		result += bandPrev.capacity() + taken.capacity();
+		result += size_t(transposed.capacity) * (sizeof(Pixel) + 2 * sizeof(float));
+		result += (preview.capacity() + transposedPreview.capacity()) * sizeof(Pixel);
+		return result;
+	}
+};
+
+/// Helper struct that implements the seam carving algorithm. It uses a template argument to determine
+/// if it should carve (remove) rows or columns. We copy the image energies and remove only columns.
+/// This way we have the data locally coherent, which improves speed a lot. At the end, we move the actual
+/// image data only once.
+/// @note The struct creates a new 2d table with the data needed for the dynamic algorithm. The Table type decides
+///     how it is stored (see IndexedTable, CompactTable and PackedTable). When removing seams, the table holds all the
+///     necessary information. At the end we move the image data into the correct places. Then we use the stored
+///     original column of each pixel. (image.data[r*imgStride+c] = image.data[ getOriginalIdx(r, c) ])
+/// @note Pixels are computed one row range at a time with computeTotalRow, which uses SIMD.
+/// @note All the work, except finding the start of the seam and following it back, is split between the threads
+///     of the pool. Pixels in one row only depend on the previous row, so a row is split into column ranges, and
+///     the threads wait for each other before moving to the next row. Rows are independent when we initialize,
+///     remove a seam or compact the image, so there we split the rows. Every pixel is computed the same way as
+///     with a single thread, so the result does not depend on the number of threads.
+/// @tparam doCols If true, it removes columns, otherwise it removes rows.
+/// @tparam Table The storage of the dynamic table.
+template <bool doCols, typename Table>
+struct CarveHelper {
+	/// Minimal number of pixels for a thread to process at once. Smaller ranges are not worth the synchronization.
+	static constexpr int minPixelsPerJob = 4096;
+	/// The smallest level of the energy pyramid has at most this many pixels. Its seam is found without a band.
+	static constexpr size_t pyramidTopPixels = 64 * 1024;
+
+	Image& image; ///< Reference to the image to carve.
+	const int& rows; ///< Virtual rows.
+	int& cols; ///< Virtual columns.
+	CarveWorkspace localWorkspace; ///< Used when no workspace is given.
+	CarveWorkspace& workspace; ///< Holds all buffers. The references below point into it.
+	Table& table; ///< The dynamic table.
+	std::vector<int>& seam; ///< Stores the indices of the seam for each row or column.
+	std::vector<RowScratch>& scratch; ///< Scratch buffers, one for each job.
+	ThreadPool localPool; ///< Used when no pool is given. It has a single thread, so it runs everything inline.
+	ThreadPool& pool; ///< Threads to split the work between.
+	const int batchSize; ///< Maximal number of seams removed from one dynamic table.
+	CarveStats localStats; ///< Used when no stats are requested.
+	CarveStats& stats; ///< Numbers collected while carving.
+	int* const removalOrder; ///< If set, receives the order in which the pixels are removed.
+	const bool updateEnergy; ///< Recompute the energies next to the removed seams.
+	const std::atomic<bool>* const cancel; ///< If set and true, no more seams are removed.
+	const std::function<void(int)>& onProgress; ///< Called with numRemoved after each removal, if set.
+	std::vector<ColRange>& removedCols; ///< Columns of each row that were removed by the last seams.
+	std::vector<ColRange>& energyChanged; ///< Columns of each row where the energy was recomputed after the last seams.
+	int numRemoved = 0; ///< Number of seams removed so far.
+	/// Previews of the image while carving.
+	/// @{
+	const std::function<void(const CarvePreview&)>& onPreview; ///< Called with the preview, if set.
+	const int previewSeams; ///< Seams between previews, or zero.
+	const int previewMillis; ///< Milliseconds between previews, or zero.
+	std::vector<Pixel>& preview; ///< The gathered pixels.
+	int numToRemove = 0; ///< Number of seams that this carve removes.
+	int lastPreviewSeams = 0; ///< numRemoved at the last preview.
+	std::chrono::steady_clock::time_point lastPreviewTime; ///< Time of the last preview, or of the start.
+	/// @}
+	/// Used for the coarse-to-fine search.
+	/// @{
+	const int pyramidBand; ///< Number of columns around the upsampled seam searched on each level.
+	const int pyramidMinPixels; ///< Smaller images are carved exactly.
+	std::vector<EnergyLevel>& levels; ///< Smaller levels of the pyramid, from the largest one.
+	int numLevels = 0; ///< Number of levels in use. There can be more of them in the workspace.
+	std::vector<int>& levelSeam; ///< Seam found on the current level.
+	std::vector<int>& coarseSeam; ///< Seam found on the smaller level.
+	std::vector<int>& bandBegin; ///< First column of the band in each row.
+	std::vector<float>& bandTotal; ///< Totals of the band, row by row.
+	std::vector<int8_t>& bandPrev; ///< Offsets to the parents in the band, row by row.
+	std::vector<float>& bandParents; ///< Totals of the previous row, aligned to the current band.
+	std::vector<float>& bandEnergy; ///< Energies of the current row of the band.
+	/// @}
+	/// Used when following the seams of another carve.
+	/// @{
+	const SeamGuide* const guide; ///< Seams to search around, or null.
+	const int guideBand; ///< Number of columns on each side of a seam of the guide that are searched.
+	SeamGuide* const recordGuide; ///< Receives the removed seams, if set.
+	/// @}
+	/// Used when removing a batch of seams.
+	/// @{
+	std::vector<int>& candidates; ///< Columns of the last row, ordered by their total.
+	std::vector<uint8_t>& taken; ///< Marks the pixels of the seams in the batch.
+	std::vector<int>& batchSeams; ///< The seams of the batch in each row, one row after another.
+	/// @}
+
+	CarveHelper(Image& _image, const CarveOptions& options)
+		: image(_image)
+		, rows(doCols ? _image.height : _image.width)
+		, cols(doCols ? _image.width : _image.height)
+		, workspace(options.workspace ? *options.workspace : localWorkspace)
+		, table(std::get<Table>(workspace.tables))
+		, seam(workspace.seam)
+		, scratch(workspace.scratch)
+		, pool(options.threadPool ? *options.threadPool : localPool)
+		, batchSize(std::max(1, options.batchSize))
+		, stats(options.stats ? *options.stats : localStats)
+		, removalOrder(options.removalOrder)
+		, updateEnergy(options.updateEnergy)
+		, cancel(options.cancel)
+		, onProgress(options.onProgress)
+		, removedCols(workspace.removedCols)
+		, energyChanged(workspace.energyChanged)
+		, onPreview(options.onPreview)
+		, previewSeams(options.previewSeams)
+		, previewMillis(options.previewMillis)
+		, preview(workspace.preview)
+		, pyramidBand(options.pyramidBand)
+		, pyramidMinPixels(options.pyramidMinPixels)
+		, levels(workspace.levels)
+		, levelSeam(workspace.levelSeam)
+		, coarseSeam(workspace.coarseSeam)
+		, bandBegin(workspace.bandBegin)
+		, bandTotal(workspace.bandTotal)
+		, bandPrev(workspace.bandPrev)
+		, bandParents(workspace.bandParents)
+		, bandEnergy(workspace.bandEnergy)
+		, guide(options.guide)
+		, guideBand(options.guideBand)
+		, recordGuide(options.recordGuide)
+		, candidates(workspace.candidates)
+		, taken(workspace.taken)
+		, batchSeams(workspace.batchSeams)
+	{}
+
+	/// Removes @p howMany seams from the image with the lowest energy.
+	void carve(int howMany) {
+		if (recordGuide) {
+			recordGuide->rows = rows;
+			recordGuide->cols = cols;
+			recordGuide->seams.clear();
+			recordGuide->seams.reserve(size_t(howMany) * rows);
+		}
+		if (howMany == 0) return;
+
+		table.allocate(rows, cols);
+		seam.resize(rows);
+		removedCols.assign(rows, ColRange());
+		energyChanged.assign(rows, ColRange());
+		if (scratch.size() < size_t(pool.getNumThreads())) {
+			scratch.resize(pool.getNumThreads());
+		}
+		for (RowScratch& rowScratch : scratch) {
+			rowScratch.resize(cols);
+		}
+
+		const int rowGrain = std::max(1, minPixelsPerJob / cols);
+		numToRemove = howMany;
+		lastPreviewTime = std::chrono::steady_clock::now();
+
+		// Initialize tables.
+		{
+			TRACE_SCOPE("init table");
+			pool.parallelFor(0, rows, rowGrain, [this](int rBegin, int rEnd) {
+				for (int r = rBegin; r < rEnd; ++r) {
+					table.initRow(r, cols, [this, r](int c) { return at(r, c); }, image.energy.get());
+				}
+			});
+		}
+
+		if (useGuide()) {
+			carveGuided(howMany, rowGrain);
+		} else if (usePyramid()) {
+			carvePyramid(howMany, rowGrain);
+		} else {
+			carveExact(howMany, rowGrain);
+		}
+
+		// After all seams are removed, compact the final image. Until now, the image was only read. If its planes
+		// are shared with other images, the compaction writes into new ones, which copies the image on the way.
+		TRACE_SCOPE("compact");
+		const bool isShared = image.isShared();
+		const std::shared_ptr<Pixel[]> srcData = image.data;
+		const std::shared_ptr<float[]> srcLuma = image.luma;
+		if (isShared) {
+			image.allocMemory(image.capacity);
+		}
+		pool.parallelFor(0, rows, rowGrain, [&](int rBegin, int rEnd) {
+			for (int r = rBegin; r < rEnd; ++r) {
+				const size_t offset = doCols ? 1 : image.stride;
+				size_t dst = at(r, 0);
+				for (int c = 0; c < cols; ++c, dst += offset) {
+					image.energy[dst] = table.getEnergy(r, c);
+					const size_t src = getOriginalIdx(r, c);
+					if (dst == src && !isShared) continue;
+					image.data[dst] = srcData[src];
+					image.luma[dst] = srcLuma[src];
+				}
+			}
+		});
+	}
+
+	/// Remove the seams with the dynamic table of the whole image.
+	void carveExact(int howMany, int rowGrain) {
+		// First pass. Compute the full dynamic table.
+		computeTable();
+
+		// Now that we have the dynamic table, we can find seams.
+		while (howMany && !isCancelled()) {
+			++stats.passes;
+			if (batchSize > 1 && howMany > 1) {
+				howMany -= removeSeamBatch(std::min(howMany, batchSize), rowGrain);
+				// The batch changes the table in many places, so it is simpler to compute it again
+				if (howMany && !isCancelled()) {
+					computeTable();
+				}
+				continue;
+			}
+			--howMany;
+
+			{
+				// Find the start of the optimal seam
+				TRACE_SCOPE("find seam");
+				const float* totals = table.getTotals(rows-1, cols, scratch[0]);
+				int minSeam = findLastMin(totals, cols);
+				++stats.seams;
+				stats.energy += totals[minSeam];
+
+				// Find all pixels of the seam
+				for (int r = rows-1; r >= 0; --r) {
+					seam[r] = minSeam;
+					minSeam += table.getPrev(r, minSeam);
+				}
+			}
+
+			removeSeam(rowGrain);
+
+			// If we have to remove more seams, update the dynamic table
+			if (howMany && !isCancelled()) {
+				if constexpr (Table::keepsAllTotals) {
+					repairTable();
+				} else {
+					computeTable();
+				}
+			}
+		}
+	}
+
+	/// Remove the seams found coarse-to-fine on the energy pyramid. The dynamic table is not used, only the energies.
+	void carvePyramid(int howMany, int rowGrain) {
+		// The levels are not updated after each seam, so their columns drift away from the image. Rebuild them
+		// before the drift gets close to the band.
+		const int rebuildInterval = std::max(1, pyramidBand / 2);
+		for (int i = 0; i < howMany && !isCancelled(); ++i) {
+			if (i % rebuildInterval == 0) {
+				buildPyramid();
+				// The image got too small for the pyramid
+				if (numLevels == 0) {
+					carveExact(howMany - i, rowGrain);
+					return;
+				}
+			}
+			++stats.passes;
+			++stats.seams;
+			stats.energy += findPyramidSeam();
+			removeSeam(rowGrain);
+		}
+	}
+
+	/// Remove each seam within a band around the seam of the guide with the same index. The dynamic table is not
+	/// used, only the energies. The seams past the ones of the guide are removed exactly.
+	void carveGuided(int howMany, int rowGrain) {
+		const int numGuided = std::min(howMany, guide->getNumSeams());
+		for (int i = 0; i < numGuided && !isCancelled(); ++i) {
+			{
+				TRACE_SCOPE("guided seam");
+				const int* guideSeam = guide->getSeam(i);
+				++stats.passes;
+				++stats.seams;
+				stats.energy += findBandSeam(rows, cols, guideBand, [guideSeam](int r) { return guideSeam[r]; },
+					[this](int r, int c) { return table.getEnergy(r, c); }, seam);
+			}
+			removeSeam(rowGrain);
+		}
+		if (numGuided < howMany && !isCancelled()) {
+			carveExact(howMany - numGuided, rowGrain);
+		}
+	}
+
+	/// Record the seam in #seam and remove it from the table.
+	void removeSeam(int rowGrain) {
+		TRACE_SCOPE("remove seam");
+		recordSeam(seam.data());
+		pool.parallelFor(0, rows, rowGrain, [this](int rBegin, int rEnd) {
+			for (int r = rBegin; r < rEnd; ++r) {
+				table.removePixel(r, seam[r], cols);
+				removedCols[r] = {seam[r], seam[r]+1};
+			}
+		});
+		--cols;
+		updateEnergies(rowGrain);
+		reportProgress();
+	}
+
+	/// Return true if the caller asked to stop carving.
+	bool isCancelled() const {
+		return cancel && cancel->load(std::memory_order_relaxed);
+	}
+
+	/// Tell the caller how many seams are removed so far, and send a preview if it is time for one.
+	void reportProgress() {
+		if (onProgress) {
+			onProgress(numRemoved);
+		}
+		if (!onPreview || numRemoved >= numToRemove || isCancelled()) return;
+		const auto now = std::chrono::steady_clock::now();
+		if ((previewSeams > 0 && numRemoved - lastPreviewSeams >= previewSeams) ||
+			(previewMillis > 0 && now - lastPreviewTime >= std::chrono::milliseconds(previewMillis)))
+		{
+			sendPreview();
+			lastPreviewSeams = numRemoved;
+			lastPreviewTime = std::chrono::steady_clock::now();
+		}
+	}
+
+	/// Gather the pixels that are left, in the orientation of the image, and pass them to onPreview. Reads the
+	/// image through the table, the same way the final compaction does, but into #preview.
+	void sendPreview() {
+		TRACE_SCOPE("preview");
+		preview.resize(size_t(rows) * cols);
+		const Pixel* data = image.data.get();
+		pool.parallelFor(0, rows, std::max(1, minPixelsPerJob / cols), [this, data](int rBegin, int rEnd) {
+			for (int r = rBegin; r < rEnd; ++r) {
+				for (int c = 0; c < cols; ++c) {
+					const size_t dst = doCols ? size_t(r) * cols + c : size_t(c) * rows + r;
+					preview[dst] = data[getOriginalIdx(r, c)];
+				}
+			}
+		});
+		onPreview(CarvePreview{preview.data(), doCols ? cols : rows, doCols ? rows : cols, numRemoved});
+	}
+
+	/// Recompute the energies next to the pixels in #removedCols, and store where they were recomputed in
+	/// #energyChanged. Does nothing if the energies are not updated.
+	void updateEnergies(int rowGrain) {
+		if (!updateEnergy) return;
+		TRACE_SCOPE("update energy");
+		pool.parallelFor(0, rows, rowGrain, [this](int rBegin, int rEnd) {
+			for (int r = rBegin; r < rEnd; ++r) {
+				// The pixels next to the removed ones get new neighbours in this row. The pixels between the removed
+				// ones of this and the previous or next row get new neighbours in those rows.
+				ColRange removed = removedCols[r];
+				if (r > 0) removed.merge(removedCols[r-1]);
+				if (r+1 < rows) removed.merge(removedCols[r+1]);
+				ColRange& range = energyChanged[r];
+				range.begin = std::max(0, removed.begin - 1);
+				range.end = std::min(cols, removed.end);
+				for (int c = range.begin; c < range.end; ++c) {
+					table.setEnergy(r, c, computeEnergy(r, c));
+				}
+			}
+		});
+	}
+
+	/// Compute the energy of a pixel from the luma of its current neighbours, like Image::computeEnergies does.
+	float computeEnergy(int r, int c) const {
+		const float* luma = image.luma.get();
+		const float center = luma[getOriginalIdx(r, c)];
+		const bool hasLeft = c > 0;
+		const bool hasRight = c+1 < cols;
+		const bool hasUp = r > 0;
+		const bool hasDown = r+1 < rows;
+		const float along = computeGradient(
+			hasLeft ? luma[getOriginalIdx(r, c-1)] : center,
+			center,
+			hasRight ? luma[getOriginalIdx(r, c+1)] : center,
+			hasLeft, hasRight);
+		const float across = computeGradient(
+			hasUp ? luma[getOriginalIdx(r-1, c)] : center,
+			center,
+			hasDown ? luma[getOriginalIdx(r+1, c)] : center,
+			hasUp, hasDown);
+		return (along + across) * image.energyScale;
+	}
+
+	/// Return true if there is a guide that was recorded from an image of the same size.
+	bool useGuide() const {
+		return guide && guideBand > 0 && guide->rows == rows && guide->cols == cols && guide->getNumSeams() > 0;
+	}
+
+	/// Return true if the image is large enough to carve it coarse-to-fine.
+	bool usePyramid() const {
+		const size_t numPixels = size_t(rows) * cols;
+		return pyramidBand > 0 && numPixels >= size_t(pyramidMinPixels) && numPixels > pyramidTopPixels;
+	}
+
+	/// Compute the smaller levels of the energy pyramid from the current table.
+	void buildPyramid() {
+		TRACE_SCOPE("build pyramid");
+		numLevels = 0;
+		int levelRows = rows;
+		int levelCols = cols;
+		while (size_t(levelRows) * levelCols > pyramidTopPixels && levelRows > 1 && levelCols > 1) {
+			levelRows = (levelRows + 1) / 2;
+			levelCols = (levelCols + 1) / 2;
+			++numLevels;
+		}
+		if (levels.size() < size_t(numLevels)) {
+			levels.resize(numLevels);
+		}
+
+		for (int l = 0; l < numLevels; ++l) {
+			const int srcRows = l ? levels[l-1].rows : rows;
+			const int srcCols = l ? levels[l-1].cols : cols;
+			EnergyLevel& level = levels[l];
+			level.rows = (srcRows + 1) / 2;
+			level.cols = (srcCols + 1) / 2;
+			level.energy.resize(size_t(level.rows) * level.cols);
+			const int grain = std::max(1, minPixelsPerJob / level.cols);
+			pool.parallelFor(0, level.rows, grain, [&](int rBegin, int rEnd) {
+				for (int r = rBegin; r < rEnd; ++r) {
+					// Mean of 2x2 pixels. On odd sizes, the last row and column are used twice.
+					const int sr0 = 2*r;
+					const int sr1 = std::min(2*r + 1, srcRows - 1);
+					float* dst = &level.energy[size_t(r) * level.cols];
+					if (l == 0) {
+						for (int c = 0; c < level.cols; ++c) {
+							const int sc0 = 2*c;
+							const int sc1 = std::min(2*c + 1, srcCols - 1);
+							dst[c] = 0.25f * (table.getEnergy(sr0, sc0) + table.getEnergy(sr0, sc1) +
+								table.getEnergy(sr1, sc0) + table.getEnergy(sr1, sc1));
+						}
+					} else {
+						const float* src0 = &levels[l-1].energy[size_t(sr0) * srcCols];
+						const float* src1 = &levels[l-1].energy[size_t(sr1) * srcCols];
+						for (int c = 0; c < level.cols; ++c) {
+							const int sc0 = 2*c;
+							const int sc1 = std::min(2*c + 1, srcCols - 1);
+							dst[c] = 0.25f * (src0[sc0] + src0[sc1] + src1[sc0] + src1[sc1]);
+						}
+					}
+				}
+			});
+		}
+	}
+
+	/// Find the seam on the smallest level, and refine it on each larger one, up to the table. Stores it in #seam.
+	/// @return Total energy of the seam.
+	float findPyramidSeam() {
+		TRACE_SCOPE("pyramid seam");
+		const EnergyLevel& top = levels[numLevels-1];
+		findBandSeam(top.rows, top.cols, top.cols, [](int) { return 0; }, [&top](int r, int c) {
+			return top.energy[size_t(r) * top.cols + c];
+		}, levelSeam);
+
+		for (int l = numLevels - 2; l >= 0; --l) {
+			std::swap(levelSeam, coarseSeam);
+			const EnergyLevel& level = levels[l];
+			findBandSeam(level.rows, level.cols, pyramidBand, [this](int r) { return getUpsampledCenter(r); },
+				[&level](int r, int c) { return level.energy[size_t(r) * level.cols + c]; }, levelSeam);
+		}
+
+		std::swap(levelSeam, coarseSeam);
+		return findBandSeam(rows, cols, pyramidBand, [this](int r) { return getUpsampledCenter(r); },
+			[this](int r, int c) { return table.getEnergy(r, c); }, seam);
+	}
+
+	/// Return the column in row @p r of a level, that is in the middle of the seam of the next smaller level.
+	int getUpsampledCenter(int r) const {
+		return 2 * coarseSeam[std::min(r / 2, int(coarseSeam.size()) - 1)] + 1;
+	}
+
+	/// Find the optimal seam that stays inside a band of columns around a given center in each row. The band is
+	/// shifted to stay inside the image. Each row is computed with computeTotalRow, the previous row is realigned
+	/// to it first.
+	/// @param numRows Number of rows.
+	/// @param numCols Number of columns.
+	/// @param band Number of columns on each side of the center.
+	/// @param getCenter Return the center column of a row.
+	/// @param getEnergy Return the energy of a pixel.
+	/// @param[out] result Column of the seam in each row.
+	/// @return Total energy of the seam.
+	template <typename CenterFunc, typename EnergyFunc>
+	float findBandSeam(int numRows, int numCols, int band, CenterFunc&& getCenter, EnergyFunc&& getEnergy,
+		std::vector<int>& result)
+	{
+		const int width = std::min(numCols, 2*band + 1);
+		bandBegin.resize(numRows);
+		bandTotal.resize(size_t(numRows) * width);
+		bandPrev.resize(size_t(numRows) * width);
+		bandParents.resize(width + 2);
+		bandEnergy.resize(width);
+
+		for (int r = 0; r < numRows; ++r) {
+			const int begin = std::clamp(getCenter(r) - band, 0, numCols - width);
+			bandBegin[r] = begin;
+			float* total = &bandTotal[size_t(r) * width];
+			for (int i = 0; i < width; ++i) {
+				bandEnergy[i] = getEnergy(r, begin + i);
+			}
+			if (r == 0) {
+				std::copy_n(bandEnergy.data(), width, total);
+				continue;
+			}
+
+			// Columns outside the band of the previous row are never chosen
+			const int shift = begin - bandBegin[r-1];
+			const float* prevTotal = &bandTotal[size_t(r-1) * width];
+			for (int i = -1; i <= width; ++i) {
+				const int p = i + shift;
+				bandParents[i+1] = (p >= 0 && p < width) ? prevTotal[p] : maxTotal;
+			}
+			computeTotalRow(bandParents.data() + 1, bandEnergy.data(), total, &bandPrev[size_t(r) * width], width);
+		}
+
+		// Follow the seam back
+		const float* lastTotal = &bandTotal[size_t(numRows-1) * width];
+		int i = findLastMin(lastTotal, width);
+		const float seamTotal = lastTotal[i];
+		result.resize(numRows);
+		for (int r = numRows-1; r >= 0; --r) {
+			const int c = bandBegin[r] + i;
+			result[r] = c;
+			if (r > 0) {
+				i = std::clamp(c + bandPrev[size_t(r) * width + i] - bandBegin[r-1], 0, width-1);
+			}
+		}
+		return seamTotal;
+	}
+
+	/// Find up to @p count seams in the current table that do not touch or cross each other, and remove all of them.
+	/// Seams are followed from the lowest totals in the last row, so the first one is always the optimal seam. Seams
+	/// that run into one of the already found ones are dropped.
+	/// @return Number of removed seams. At least one.
+	int removeSeamBatch(int count, int rowGrain) {
+		TRACE_SCOPE("batch");
+		// Lowest total first. On ties, the last column first, same as findLastMin.
+		const float* totals = table.getTotals(rows-1, cols, scratch[0]);
+		candidates.resize(cols);
+		for (int c = 0; c < cols; ++c) {
+			candidates[c] = c;
+		}
+		std::sort(candidates.begin(), candidates.end(), [totals](int a, int b) {
+			return (totals[a] != totals[b]) ? (totals[a] < totals[b]) : (a > b);
+		});
+
+		taken.assign(size_t(rows) * cols, 0);
+		batchSeams.resize(size_t(rows) * count);
+		int found = 0;
+		for (int i = 0; i < cols && found < count; ++i) {
+			if (!followSeam(candidates[i])) continue;
+			for (int r = 0; r < rows; ++r) {
+				taken[size_t(r)*cols + seam[r]] = 1;
+				batchSeams[size_t(r) * count + found] = seam[r];
+			}
+			recordSeam(seam.data());
+			stats.energy += totals[candidates[i]];
+			++found;
+		}
+		stats.seams += found;
+
+		// Remove all pixels of a row at once
+		pool.parallelFor(0, rows, rowGrain, [this, count, found](int rBegin, int rEnd) {
+			for (int r = rBegin; r < rEnd; ++r) {
+				int* rowSeams = &batchSeams[size_t(r) * count];
+				std::sort(rowSeams, rowSeams + found);
+				table.removePixels(r, rowSeams, found, cols);
+				removedCols[r] = {rowSeams[0], rowSeams[found-1]+1};
+			}
+		});
+
+		cols -= found;
+		updateEnergies(rowGrain);
+		reportProgress();
+		return found;
+	}
+
+	/// Write the order of the seam in the removal order, and add it to the recorded guide, if they were requested.
+	/// Must be called before removing it.
+	/// @param seamCols Column of the seam in each row.
+	void recordSeam(const int* seamCols) {
+		if (removalOrder) {
+			for (int r = 0; r < rows; ++r) {
+				removalOrder[getOriginalIdx(r, seamCols[r])] = numRemoved;
+			}
+		}
+		if (recordGuide) {
+			recordGuide->seams.insert(recordGuide->seams.end(), seamCols, seamCols + rows);
+		}
+		++numRemoved;
+	}
+
+	/// Follow the seam that ends in column @p start of the last row, and store it in #seam.
+	/// @return False if the seam touches or crosses one of the taken pixels.
+	bool followSeam(int start) {
+		int c = start;
+		for (int r = rows-1; r >= 0; --r) {
+			if (taken[size_t(r)*cols + c]) return false;
+			seam[r] = c;
+			if (r == 0) break;
+			const int parent = c + table.getPrev(r, c);
+			// A diagonal step can cross a seam without touching it, if that seam steps the other way.
+			if (parent != c && taken[size_t(r)*cols + parent] && taken[size_t(r-1)*cols + c]) return false;
+			c = parent;
+		}
+		return true;
+	}
+
+	/// Get the offset in the image for a given virtual row and column.
+	size_t at(const int& r, const int& c) const {
+		return doCols
+			? c + size_t(r)*image.stride
+			: r + size_t(c)*image.stride;
+	}
+
+	/// Get the offset in the image of the pixel that is now at the given virtual row and column.
+	size_t getOriginalIdx(int r, int c) const {
+		return at(r, table.getOriginalCol(r, c));
+	}
+
+	/// Compute the full dynamic table. Each row is split between the threads. The ranges start at multiples of
+	/// Table::colAlignment.
+	void computeTable() {
+		TRACE_SCOPE("compute table");
+		const int numJobs = pool.getNumJobs(cols, minPixelsPerJob);
+		if (numJobs <= 1) {
+			for (int r = 1; r < rows; ++r) {
+				table.computeRange(r, 0, cols-1, cols, scratch[0]);
+			}
+			return;
+		}
+
+		auto getJobBegin = [&](int job) {
+			return (job == numJobs) ? cols : (cols * job / numJobs) / Table::colAlignment * Table::colAlignment;
+		};
+		SpinBarrier barrier(numJobs);
+		pool.run(numJobs, [&](int job) {
+			const int cBegin = getJobBegin(job);
+			const int cLast = getJobBegin(job+1) - 1;
+			for (int r = 1; r < rows; ++r) {
+				table.computeRange(r, cBegin, cLast, cols, scratch[job]);
+				barrier.wait();
+			}
+		});
+	}
+
+	/// Return the columns of row @p r that have to be recomputed after removing the seam.
+	/// @param changed The columns of the previous row where the total changed.
+	ColRange getRepairRange(int r, const ColRange& changed) const {
+		// Only the pixels between the seam pixels of this and the previous row get different parents. Pixels
+		// further away keep the same ones, since both rows are shifted the same way.
+		ColRange range{std::min(seam[r], seam[r-1]-1), std::max(seam[r]-1, seam[r-1]) + 1};
+		// The children of the pixels that changed.
+		if (!changed.empty()) {
+			range.merge({changed.begin-1, changed.end+1});
+		}
+		// The pixels with a new energy.
+		range.merge(energyChanged[r]);
+		range.begin = std::max(0, range.begin);
+		range.end = std::min(cols, range.end);
+		return range;
+	}
+
+	/// Update the dynamic table after removing a seam. Instead of recomputing everything that could have changed, we
+	/// follow the changes down the rows. A pixel is recomputed only if its parents were moved or changed. The range
+	/// widens only where the totals actually changed, and it shrinks back to the seam once a row stops changing.
+	/// @note Rows are processed by one thread while the range is narrow. Once it gets wide enough, we switch to
+	///     all threads until the end.
+	void repairTable() {
+		TRACE_SCOPE("repair table");
+		ColRange changed = energyChanged[0]; // Columns of the previous row where the total changed.
+		int r = 1;
+		for (; r < rows; ++r) {
+			const ColRange range = getRepairRange(r, changed);
+			if (pool.getNumJobs(range.size(), minPixelsPerJob) > 1) break;
+			changed = table.updateRange(r, range.begin, range.end-1, cols, scratch[0]);
+		}
+		if (r == rows) return;
+
+		// Each job writes the columns it changed, and after the barrier all jobs merge them. The rows alternate
+		// between two sets, so that a job can write the next row while others are still reading the current one.
+		const int numJobs = pool.getNumThreads();
+		std::vector<ColRange>* jobChanges = workspace.jobChanges;
+		jobChanges[0].resize(numJobs);
+		jobChanges[1].resize(numJobs);
+		SpinBarrier barrier(numJobs);
+		// The lambda is shared by all jobs, so each job keeps its own copy of the loop state
+		const int firstRow = r;
+		const ColRange firstChanged = changed;
+		pool.run(numJobs, [&](int job) {
+			ColRange rowChanged = firstChanged;
+			for (int row = firstRow; row < rows; ++row) {
+				const ColRange range = getRepairRange(row, rowChanged);
+				const int rowJobs = pool.getNumJobs(range.size(), minPixelsPerJob);
+				ColRange& jobChanged = jobChanges[row & 1][job];
+				jobChanged = ColRange();
+				if (job < rowJobs) {
+					const int cBegin = range.begin + range.size() * job / rowJobs;
+					const int cLast = range.begin + range.size() * (job+1) / rowJobs - 1;
+					jobChanged = table.updateRange(row, cBegin, cLast, cols, scratch[job]);
+				}
+				barrier.wait();
+
+				rowChanged = ColRange();
+				for (const ColRange& other : jobChanges[row & 1]) {
+					rowChanged.merge(other);
+				}
+			}
+		});
+	}
+};
@@ -0,0 +1,76 @@
+#include "carveWorker.h"
+#include "trace.h"
+
+CarveWorker::CarveWorker() {
+	thread = std::thread([this]() { workerLoop(); });
+}
+
+CarveWorker::~CarveWorker() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		pendingJob = nullptr;
+		cancelFlag = true;
+	}
+	jobCond.notify_one();
+	thread.join();
+}
+
+void CarveWorker::submit(Job job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (running) {
+			cancelFlag = true;
+		}
+		pendingJob = std::move(job);
+	}
+	jobCond.notify_one();
+}
+
+void CarveWorker::cancel() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (running) {
+		cancelFlag = true;
+	}
+	pendingJob = nullptr;
+}
+
+void CarveWorker::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idleCond.wait(lock, [this]() { return !running && !pendingJob; });
+}
+
+bool CarveWorker::isBusy() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return running || pendingJob;
+}
+
+void CarveWorker::reportProgress(const CarveProgress& progress) {
+	progressQueue.push(progress);
+}
+
+bool CarveWorker::popProgress(CarveProgress& progress) {
+	return progressQueue.pop(progress);
+}
+
+void CarveWorker::workerLoop() {
+	setTraceThreadName("Carve worker");
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		jobCond.wait(lock, [this]() { return stopping || pendingJob; });
+		if (stopping) return;
+
+		// A cancel only applies to the job that was running when it came
+		Job job = std::move(pendingJob);
+		pendingJob = nullptr;
+		cancelFlag = false;
+		running = true;
+		lock.unlock();
+		job(cancelFlag);
+		// Free what the job holds before anyone learns that it finished
+		job = nullptr;
+		lock.lock();
+		running = false;
+		idleCond.notify_all();
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/// A queue of fixed size for one producer thread and one consumer thread, that never locks.
+/// @tparam Capacity Maximal number of elements. Must be a power of two.
+template <typename T, size_t Capacity>
+class SpscQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	/// Add an element. Only called by the producer.
+	/// @return False if the queue is full.
+	bool push(const T& value) {
+		const size_t tail = writePos.load(std::memory_order_relaxed);
+		if (tail - readPos.load(std::memory_order_acquire) == Capacity) return false;
+		items[tail & (Capacity - 1)] = value;
+		writePos.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Take the oldest element. Only called by the consumer.
+	/// @return False if the queue is empty.
+	bool pop(T& value) {
+		const size_t head = readPos.load(std::memory_order_relaxed);
+		if (head == writePos.load(std::memory_order_acquire)) return false;
+		value = items[head & (Capacity - 1)];
+		readPos.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> items;
+	std::atomic<size_t> writePos{0}; ///< Number of pushed elements. Only changed by the producer.
+	std::atomic<size_t> readPos{0}; ///< Number of popped elements. Only changed by the consumer.
+};
+
+/// How far a carve on the worker got.
+struct CarveProgress {
+	uint64_t job = 0; ///< Id that the owner gave to the job.
+	int done = 0; ///< Number of removed seams.
+	int total = 0; ///< Number of seams to remove.
+};
+
+/// Runs carving jobs on its own thread, one at a time, so that the UI thread doesn't wait for them. Starting a job
+/// cancels the one that is running, and the jobs report their progress through a queue that the UI thread reads.
+/// @note All functions except reportProgress are meant to be called from one thread, the UI thread.
+class CarveWorker {
+public:
+	/// A job. It should stop soon after the flag becomes true, e.g. by passing it as CarveOptions::cancel.
+	using Job = std::function<void(const std::atomic<bool>& cancel)>;
+
+	CarveWorker();
+	~CarveWorker(); ///< Cancels the jobs and waits for the thread.
+
+	CarveWorker(const CarveWorker&) = delete;
+	CarveWorker& operator=(const CarveWorker&) = delete;
+
+	/// Run @p job on the worker thread. The running job is cancelled, and the one waiting to start is dropped.
+	void submit(Job job);
+
+	/// Cancel the running job and drop the one waiting to start. Doesn't wait for them.
+	void cancel();
+
+	/// Wait until no job is running or waiting to start.
+	void wait();
+
+	/// Return true if a job is running or waiting to start.
+	bool isBusy();
+
+	/// Report the progress of the running job. Only called from the jobs. The report is dropped if the queue is
+	/// full, since a newer one follows soon.
+	void reportProgress(const CarveProgress& progress);
+
+	/// Take the oldest progress report.
+	/// @return False if there is none.
+	bool popProgress(CarveProgress& progress);
+
+private:
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable jobCond; ///< Signals the worker that there is a new job, or that it has to stop.
+	std::condition_variable idleCond; ///< Signals that the worker finished a job.
+	Job pendingJob; ///< The job waiting to start. Guarded by mutex.
+	bool running = false; ///< True while a job runs. Guarded by mutex.
+	bool stopping = false; ///< Set to true when the worker has to exit. Guarded by mutex.
+	std::atomic<bool> cancelFlag{false}; ///< Given to the running job.
+	SpscQueue<CarveProgress, 64> progressQueue;
+
+	/// Main function of the worker thread.
+	void workerLoop();
+};
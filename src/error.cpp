@@ -9,7 +9,7 @@
 	va_list __args{}; \
 	char __buffer[2048]; \
 	va_start(__args, __fmt); \
-	vsprintf_s(__buffer, __fmt, __args); \
+	vsnprintf(__buffer, sizeof(__buffer), __fmt, __args); \
 	va_end(__args); \
 	msg = std::string(__buffer);
 
@@ -41,3 +41,7 @@ Error::operator bool() {
 void Error::print() {
 	printf("Error: %s\n", msg.c_str());
 }
+
+const std::string& Error::getMessage() const {
+	return msg;
+}
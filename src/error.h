@@ -22,6 +22,9 @@ public:
 	/// Print the message.
 	void print();
 
+	/// Return the message, empty if there is no error.
+	const std::string& getMessage() const;
+
 private:
 	int code = 0;
 	std::string msg;
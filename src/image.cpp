@@ -1,8 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <string.h>
 
-#include "app.h"
+#include "carveHelper.h"
 #include "FreeImage.h"
 #include "image.h"
+#include "scratchMemory.h"
+#include "simd.h"
+#include "trace.h"
+
+/// See setPrintTimings.
+static std::atomic<bool> printTimings{false};
+
+void setPrintTimings(bool enabled) {
+	printTimings = enabled;
+}
 
 /// Get load flags for a given image format.
 static int getImageLoadFlags(FREE_IMAGE_FORMAT imgFormat) {
@@ -39,13 +52,77 @@ inline static float toSRGB(float x) {
 		: 1.055f * powf(x, 1.0f/2.4f) - 0.055f;
 }
 
-inline static float computeLuma(const float& r, const float& g, const float& b) {
-	return toSRGB(
-		0.2126f * toLinear(r) +
-		0.7152f * toLinear(g) +
-		0.0722f * toLinear(b));
+/// Return the bits of a float.
+inline static uint32_t getFloatBits(float x) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
 }
 
+/// Return the float with the given bits.
+inline static float getBitsFloat(uint32_t bits) {
+	float x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+/// Lookup tables for the luma. A pixel has only 256 values per channel, so toLinear is done once for each of them.
+/// toSRGB is interpolated between values that are precomputed for the leading bits of the float: the exponent and
+/// the top mantissa bits. That splits each power of two into equal steps, so the steps get smaller where the curve
+/// bends the most, and the result is within 1e-5 of powf.
+struct LumaTables {
+	static constexpr int stepBits = 6; ///< Number of mantissa bits that select a step. 64 steps per power of two.
+	static constexpr int fractionBits = 23 - stepBits; ///< The other mantissa bits interpolate inside the step.
+	/// Index of 2^-9 in the table. That is below 0.0031308, where the linear part of toSRGB ends.
+	static constexpr uint32_t encodeBase = (127u - 9u) << (23 - fractionBits);
+	/// Index of 1.0f in the table.
+	static constexpr uint32_t encodeEnd = 127u << (23 - fractionBits);
+
+	float linear[256]; ///< toLinear of each 8-bit channel value.
+	float encode[encodeEnd - encodeBase + 1]; ///< toSRGB at the start of each step, and at 1.0f.
+
+	LumaTables() {
+		const float k = 1.0f / 255.0f;
+		for (int i = 0; i < 256; ++i) {
+			linear[i] = toLinear(k * float(i));
+		}
+		for (uint32_t i = encodeBase; i <= encodeEnd; ++i) {
+			encode[i - encodeBase] = toSRGB(getBitsFloat(i << fractionBits));
+		}
+	}
+
+	/// Fast version of toSRGB for values in [0, 1].
+	float encodeSRGB(float x) const {
+		if (x <= 0.0031308f) return x * 12.92f;
+		if (x >= 1.0f) return encode[encodeEnd - encodeBase];
+		const uint32_t bits = getFloatBits(x);
+		const float* step = &encode[(bits >> fractionBits) - encodeBase];
+		const float t = float(bits & ((1u << fractionBits) - 1)) * (1.0f / float(1u << fractionBits));
+		return step[0] + (step[1] - step[0]) * t;
+	}
+
+	/// Compute the luma of a pixel from its 8-bit channels.
+	float computeLuma(uint8_t r, uint8_t g, uint8_t b) const {
+		return encodeSRGB(0.2126f * linear[r] + 0.7152f * linear[g] + 0.0722f * linear[b]);
+	}
+
+	/// Compute the luma of a row of pixels.
+	void computeLumaRow(const Pixel* pixels, float* luma, int count) const {
+		for (int i = 0; i < count; ++i) {
+			luma[i] = computeLuma(pixels[i].r, pixels[i].g, pixels[i].b);
+		}
+	}
+
+	/// Return the tables. They are built at the first call.
+	static const LumaTables& get() {
+		static const LumaTables tables;
+		return tables;
+	}
+};
+
+/// Minimal number of pixels for a thread to compute the energies of.
+static constexpr int energyPixelsPerJob = 16 * 1024;
+
 // ################################################################################################################################
 // # Image
 // ################################################################################################################################
@@ -55,7 +132,20 @@ Image::operator bool() {
 }
 
 void Image::copyFrom(Image& other) {
-	const int numPixels = other.stride * other.height;
+	if (&other == this) return;
+	width = other.width;
+	height = other.height;
+	stride = other.stride;
+	capacity = other.capacity;
+	data = other.data;
+	energy = other.energy;
+	luma = other.luma;
+	energyScale = other.energyScale;
+}
+
+void Image::copyPlanesFrom(Image& other) {
+	if (&other == this) return;
+	const size_t numPixels = size_t(other.stride) * other.height;
 	allocMemory(numPixels);
 
 	width = other.width;
@@ -63,12 +153,46 @@ void Image::copyFrom(Image& other) {
 	stride = other.stride;
 	memcpy(data.get(), other.data.get(), numPixels * sizeof(data[0]));
 	memcpy(energy.get(), other.energy.get(), numPixels * sizeof(energy[0]));
+	memcpy(luma.get(), other.luma.get(), numPixels * sizeof(luma[0]));
+	energyScale = other.energyScale;
 }
 
-Error Image::load(const char* path) {
+Error Image::load(const char* path, ThreadPool* pool) {
+	TRACE_SCOPE("load");
 	FREE_IMAGE_FORMAT imgFormat = getImageFormat(path);
 	const int imgFlags = getImageLoadFlags(imgFormat);
-	FIBITMAP* fib = FreeImage_Load(imgFormat, path, imgFlags);
+	FIBITMAP* fib = nullptr;
+	{
+		TRACE_SCOPE("decode");
+		fib = FreeImage_Load(imgFormat, path, imgFlags);
+	}
+	return loadBitmap(fib, pool);
+}
+
+Error Image::loadFromMemory(const uint8_t* bytes, size_t size, ThreadPool* pool) {
+	TRACE_SCOPE("load");
+	if (size > UINT32_MAX) {
+		return Error("Image data is too large to load");
+	}
+	// FreeImage only reads from the memory, the cast is needed by its API
+	FIMEMORY* memory = FreeImage_OpenMemory(const_cast<BYTE*>(bytes), DWORD(size));
+	if (!memory) {
+		return Error("Failed to open image data");
+	}
+	const FREE_IMAGE_FORMAT imgFormat = FreeImage_GetFileTypeFromMemory(memory, 0 /*not used*/);
+	FIBITMAP* fib = nullptr;
+	if (imgFormat != FIF_UNKNOWN) {
+		TRACE_SCOPE("decode");
+		fib = FreeImage_LoadFromMemory(imgFormat, memory, getImageLoadFlags(imgFormat));
+	}
+	FreeImage_CloseMemory(memory);
+	if (imgFormat == FIF_UNKNOWN) {
+		return Error("Unknown image format");
+	}
+	return loadBitmap(fib, pool);
+}
+
+Error Image::loadBitmap(FIBITMAP* fib, ThreadPool* pool) {
 	if (!fib) {
 		return Error("Failed to load image");
 	}
@@ -76,16 +200,13 @@ Error Image::load(const char* path) {
 	const int imgW = FreeImage_GetWidth(fib);
 	const int imgH = FreeImage_GetHeight(fib);
 
-	// Check image size. We don't handle images that are larger than INT_MAX or smaller than 2 pixels.
+	// Check image size. We don't handle images with sides smaller than 2 pixels. The pixel count may exceed INT_MAX,
+	// all offsets into the planes are 64 bit.
 	if (imgW <= 1 || imgH <= 1) {
 		FreeImage_Unload(fib);
 		return Error("Image is too small to load");
 	}
 	const size_t numPixels = size_t(imgW) * imgH;
-	if (numPixels > 0x7fffffff) {
-		FreeImage_Unload(fib);
-		return Error("Image too large to load");
-	}
 
 	// We want to pass 24 bit RGB values to OpenGL
 	if (FreeImage_GetBPP(fib) != 24) {
@@ -97,45 +218,45 @@ Error Image::load(const char* path) {
 		}
 	}
 
-	// Copy the image data to our internal memory.
+	// Copy the image data to our internal memory, and compute the luma and the energies while each row is in the cache.
 	width = imgW;
 	height = imgH;
 	stride = width;
 	allocMemory(numPixels);
 
-	for (int row = 0; row < height; ++row) {
+	const LumaTables& tables = LumaTables::get();
+	computeEnergies(pool, [&](int row, float* rowLuma, bool isHalo) {
 		// FreeImage stores the bottom of the image first (upside-down)
 		const RGBTRIPLE* src = reinterpret_cast<RGBTRIPLE*>(FreeImage_GetScanLine(fib, height - 1 - row));
-		Pixel* dst = &data[row * stride];
-		Pixel* last = &data[(row+1) * stride];
-		for (; dst != last; ++dst, ++src) {
-			static_assert(sizeof(dst->r) == sizeof(src->rgbtRed));
-			dst->r = uint8_t(src->rgbtRed);
-			dst->g = uint8_t(src->rgbtGreen);
-			dst->b = uint8_t(src->rgbtBlue);
+		static_assert(sizeof(data[0].r) == sizeof(src->rgbtRed));
+		if (isHalo) {
+			for (int col = 0; col < width; ++col) {
+				rowLuma[col] = tables.computeLuma(src[col].rgbtRed, src[col].rgbtGreen, src[col].rgbtBlue);
+			}
+			return;
 		}
-	}
+		Pixel* dst = &data[size_t(row) * stride];
+		for (int col = 0; col < width; ++col) {
+			dst[col].r = uint8_t(src[col].rgbtRed);
+			dst[col].g = uint8_t(src[col].rgbtGreen);
+			dst[col].b = uint8_t(src[col].rgbtBlue);
+			rowLuma[col] = tables.computeLuma(dst[col].r, dst[col].g, dst[col].b);
+		}
+	});
 
 	FreeImage_Unload(fib);
-	computeEnergies();
 	return Error();
 }
 
-Error Image::save(const char* path) {
-	FREE_IMAGE_FORMAT imgFormat = getImageFormat(path);
-	if (imgFormat == FIF_UNKNOWN) {
-		return Error("Unsupported image format \"%s\"", path);
-	}
+FIBITMAP* Image::makeBitmap() const {
 	FIBITMAP* fib = FreeImage_Allocate(width, height, 24/*bits per pixel*/);
-	if (!fib) {
-		return Error("Failed to allocate image memory");
-	}
+	if (!fib) return nullptr;
 
 	for (int row = 0; row < height; ++row) {
 		// FreeImage stores the bottom of the image first (upside-down)
 		RGBTRIPLE* dst = reinterpret_cast<RGBTRIPLE*>(FreeImage_GetScanLine(fib, height - 1 - row));
-		const Pixel* src = &data[row * stride];
-		const Pixel* last = &data[row * stride + width];
+		const Pixel* src = &data[size_t(row) * stride];
+		const Pixel* last = src + width;
 		for (; src != last; ++dst, ++src) {
 			static_assert(sizeof(dst->rgbtRed) == sizeof(src->r));
 			dst->rgbtRed = BYTE(src->r);
@@ -143,13 +264,84 @@ Error Image::save(const char* path) {
 			dst->rgbtBlue = BYTE(src->b);
 		}
 	}
+	return fib;
+}
 
-	if (!FreeImage_Save(imgFormat, fib, path)) {
+Error Image::save(const char* path) {
+	TRACE_SCOPE("save");
+	FREE_IMAGE_FORMAT imgFormat = getImageFormat(path);
+	if (imgFormat == FIF_UNKNOWN) {
+		return Error("Unsupported image format \"%s\"", path);
+	}
+	FIBITMAP* fib = makeBitmap();
+	if (!fib) {
+		return Error("Failed to allocate image memory");
+	}
+
+	bool saved = false;
+	{
+		TRACE_SCOPE("encode");
+		saved = FreeImage_Save(imgFormat, fib, path);
+	}
+	FreeImage_Unload(fib);
+	if (!saved) {
+		return Error("Failed to save image");
+	}
+	return Error();
+}
+
+Error Image::saveToMemory(const char* format, std::vector<uint8_t>& bytes) {
+	TRACE_SCOPE("save");
+	bytes.clear();
+	const FREE_IMAGE_FORMAT imgFormat = FreeImage_GetFIFFromFormat(format);
+	if (imgFormat == FIF_UNKNOWN) {
+		return Error("Unsupported image format \"%s\"", format);
+	}
+	FIBITMAP* fib = makeBitmap();
+	if (!fib) {
+		return Error("Failed to allocate image memory");
+	}
+	FIMEMORY* memory = FreeImage_OpenMemory();
+	if (!memory) {
+		FreeImage_Unload(fib);
+		return Error("Failed to allocate image memory");
+	}
+
+	bool saved = false;
+	{
+		TRACE_SCOPE("encode");
+		saved = FreeImage_SaveToMemory(imgFormat, fib, memory);
+	}
+	FreeImage_Unload(fib);
+	BYTE* encoded = nullptr;
+	DWORD size = 0;
+	if (saved && FreeImage_AcquireMemory(memory, &encoded, &size)) {
+		bytes.assign(encoded, encoded + size);
+	} else {
+		saved = false;
+	}
+	FreeImage_CloseMemory(memory);
+	if (!saved) {
 		return Error("Failed to save image");
 	}
 	return Error();
 }
 
+Error Image::create(int imgW, int imgH, const Pixel* pixels, ThreadPool* pool) {
+	if (imgW <= 1 || imgH <= 1) {
+		return Error("Image is too small to create");
+	}
+	const size_t numPixels = size_t(imgW) * imgH;
+
+	width = imgW;
+	height = imgH;
+	stride = width;
+	allocMemory(numPixels);
+	memcpy(data.get(), pixels, numPixels * sizeof(data[0]));
+	computeEnergies(pool);
+	return Error();
+}
+
 int Image::getWidth() const {
 	return width;
 }
@@ -174,273 +366,271 @@ bool Image::isValid() const {
 	return (width > 0) && (height > 0) && data;
 }
 
-/// Helper struct that implements the seam carving algorithm. It uses a template argument to determine
-/// if it should carve (remove) rows or columns. We copy the image energies and remove only columns.
-/// This way we have the data locally coherent, which improves speed a lot. At the end, we move the actual
-/// image data only once.
-/// @note The struct creates a new 2d array with the data needed for the dynamic algorithm. The elements
-///     do not move, instead there is another 2d table with indices (idxMap). After removing each seam, only
-///     that map changes - each pixel in a row gets moved by one. When removing seams, these two tables hold
-///     old the necessary information. The map transforms virtual (row, col) into actual offsets in our dynamic
-///     table. (dyn[idxMap[r*idxStride + c]]).
-///     At the end we move the image data into the correct places. Then we use the stored originalIdx.
-///     (image.data[r*imgStride+c] = image.data[ dyn[idxMap[r*idxStride+c]].originalIdx ])
-/// @tparam doCols If true, it removes columns, otherwise it removes rows.
+/// Run the seam carving with the table storage selected in the options.
 template <bool doCols>
-struct CarveHelper {
-	Image& image; ///< Reference to the image to carve.
-	const int& rows; ///< Virtual rows.
-	int& cols; ///< Virtual columns.
-	/// Number of pixels to the next row of the index map. It is the number of columns of the image, but we can't use
-	/// them directly, since they will change after each seam.
-	const int idxStride = 0;
-	/// Stores the offset of each pixel in the image. When removing a seam, remove it from this map and do
-	/// changes only here.
-	std::vector<int> idxMap;
-	/// Struct to keep the whole dynamic state. A bottleneck in the performance is accesing memory that is
-	/// far away. So this will keep everything we need next to each other.
-	struct DynamicState {
-		float energy; ///< Keeps the image energy.
-		float total; ///< Dynamic table for computing the lowest energies.
-		int originalIdx; ///< Index inside the image data of this pixel.
-		int8_t prev; ///< Stores the indices of the seam for each row or column.
-	};
-	std::vector<DynamicState> dyn;
-	std::vector<int> seam; ///< Stores the indices of the seam for each row or column.
-
-	explicit CarveHelper(Image& _image)
-		: image(_image)
-		, rows(doCols ? _image.height : _image.width)
-		, cols(doCols ? _image.width : _image.height)
+static void carveImage(Image& image, int howMany, const CarveOptions& options) {
+	// Seams that follow a guide only read the energies, never the totals. The packed table moves the fewest bytes
+	// for each removed pixel, as long as no seam has to be found in the full table.
+	const SeamGuide* guide = options.guide;
+	const int rows = doCols ? image.getHeight() : image.getWidth();
+	const int cols = doCols ? image.getWidth() : image.getHeight();
+	if (guide && options.guideBand > 0 && guide->rows == rows && guide->cols == cols &&
+		guide->getNumSeams() >= howMany)
 	{
-		const_cast<int&>(idxStride) = cols;
-	}
-
-	/// Removes @p howMany seams from the image with the lowest energy.
-	void carve(int howMany) {
-		if (howMany == 0) return;
-
-		dyn.resize(cols * rows);
-		idxMap.resize(cols * rows);
-		seam.resize(rows);
-
-		// Initialize tables.
-		for (int r = 0; r < rows; ++r) {
-			for (int c = 0; c < cols; ++c) {
-				const int idx = r*idxStride + c;
-				idxMap[idx] = idx;
-				dyn[idx].originalIdx = at(r, c);
-				dyn[idx].energy = image.energy[dyn[idx].originalIdx];
-				dyn[idx].total = 1e38f;
-				dyn[idx].prev = 0;
-			}
-		}
+		CarveHelper<doCols, PackedTable> helper(image, options);
+		helper.carve(howMany);
+	} else if (options.storage == CarveStorage::Compact) {
+		CarveHelper<doCols, CompactTable> helper(image, options);
+		helper.carve(howMany);
+	} else if (options.storage == CarveStorage::LowMemory) {
+		CarveHelper<doCols, PackedTable> helper(image, options);
+		helper.carve(howMany);
+	} else {
+		CarveHelper<doCols, IndexedTable> helper(image, options);
+		helper.carve(howMany);
+	}
+}
 
-		// First pass. Compute the full dynamic table.
-		for (int c = 0; c < cols; ++c) {
-			dyn[c].total = dyn[c].energy;
+/// Images are transposed in square blocks with this many pixels on each side, so that both the block that is read
+/// and the one that is written fit in the L1 cache.
+static constexpr int transposeBlockSize = 32;
+
+/// Size of the cache that should hold the cache lines of one image column, when carving rows in place. If they don't
+/// fit, it is faster to transpose the image.
+static constexpr int transposeCacheSize = 256 * 1024;
+
+/// Transpose a small block of elements, so that dst[x*dstStride + y] = src[y*srcStride + x]. Blocks are small, so
+/// the offsets inside them fit in an int.
+template <typename T>
+static void transposeTile(const T* src, int srcStride, T* dst, int dstStride, int width, int height) {
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			dst[x*dstStride + y] = src[y*srcStride + x];
 		}
-		for (int r = 1; r < rows; ++r) {
-			int offset = r*idxStride;
-			computePixel(r, 0, 0);
-			computePixel(r, 0, 1);
-			dyn[offset].total += dyn[offset].energy;
-			for (int c=1, cEnd=cols-1; c<cEnd; ++c) {
-				offset = r*idxStride + c;
-				computePixel(r, c, 0);
-				computePixel(r, c,-1);
-				computePixel(r, c, 1);
-				dyn[offset].total += dyn[offset].energy;
-			}
-			offset = r*idxStride + cols-1;
-			computePixel(r, cols-1, 0);
-			computePixel(r, cols-1,-1);
-			dyn[offset].total += dyn[offset].energy;
-		}
-
-		// Now that we have the dynamic table, we can find seams.
-		while (howMany) {
-			--howMany;
-
-			// Find the start of the optimal seam
-			int minSeam = cols-1;
-			for (int c = cols-2; c >= 0; --c) {
-				if (dyn[getIdx(rows-1, minSeam)].total > dyn[getIdx(rows-1, c)].total) {
-					minSeam = c;
-				}
-			}
-
-			// Find all pixels of the seam
-			for (int r = rows-1; r >= 0; --r) {
-				seam[r] = minSeam;
-				minSeam += dyn[getIdx(r, minSeam)].prev;
-			}
-
-			// Remove the seam
-			for (int r = 0; r < rows; ++r) {
-				for (int c = seam[r]+1; c < cols; ++c) {
-					const int offset = r*idxStride + c;
-					idxMap[offset - 1] = idxMap[offset];
-				}
-			}
+	}
+}
 
-			--cols;
-
-			// If we have to remove more seams, update the dynamic table
-			if (howMany) {
-				for (int r = 1; r < rows; ++r) {
-					int c = std::max(0, seam[r]-r);
-					const int cEnd = std::min(cols-1, seam[r]+r);
-
-					int offset = getIdx(r, c);
-					dyn[offset].total = 1e38f;
-					computePixel(r, c, 0);
-					if (c > 0) computePixel(r, c, -1);
-					if (c+1 < cols) computePixel(r, c, 1);
-					dyn[offset].total += dyn[offset].energy;
-
-					for (++c; c < cEnd; ++c) {
-						offset = getIdx(r, c);
-						dyn[offset].total = 1e38f;
-						computePixel(r, c, 0);
-						computePixel(r, c, -1);
-						computePixel(r, c, 1);
-						dyn[offset].total += dyn[offset].energy;
-					}
-
-					offset = getIdx(r, c);
-					dyn[offset].total = 1e38f;
-					computePixel(r, c, 0);
-					if (c > 0) computePixel(r, c, -1);
-					if (c+1 < cols) computePixel(r, c, 1);
-					dyn[offset].total += dyn[offset].energy;
-				}
-			}
-		}
+/// Floats have a SIMD version.
+static void transposeTile(const float* src, int srcStride, float* dst, int dstStride, int width, int height) {
+	transposeBlock(src, srcStride, dst, dstStride, width, height);
+}
 
-		// After all seams are removed, compact the final image
-		for (int r = 0; r < rows; ++r) {
-			const int offset = doCols ? 1 : image.stride;
-			int dst = at(r, 0);
-			for (int c = 0; c < cols; ++c, dst += offset) {
-				const int src = dyn[getIdx(r, c)].originalIdx;
-				if (dst == src) continue;
-				image.data[dst] = image.data[src];
-				image.energy[dst] = image.energy[src];
+/// Transpose a whole plane of @p width x @p height elements. Each thread gets a few rows of blocks.
+template <typename T>
+static void transposePlane(const T* src, int srcStride, T* dst, int dstStride, int width, int height,
+	ThreadPool& pool)
+{
+	const int numBlockRows = (height + transposeBlockSize - 1) / transposeBlockSize;
+	const int grain = std::max(1, 64 * 1024 / (transposeBlockSize * width));
+	pool.parallelFor(0, numBlockRows, grain, [&](int bBegin, int bEnd) {
+		for (int by = bBegin; by < bEnd; ++by) {
+			const int y = by * transposeBlockSize;
+			const int blockH = std::min(transposeBlockSize, height - y);
+			for (int x = 0; x < width; x += transposeBlockSize) {
+				const int blockW = std::min(transposeBlockSize, width - x);
+				transposeTile(src + size_t(y)*srcStride + x, srcStride, dst + size_t(x)*dstStride + y, dstStride,
+					blockW, blockH);
 			}
 		}
-	}
+	});
+}
 
-	/// Get the offset in the image for a given virtual row and column.
-	int at(const int& r, const int& c) {
-		return doCols
-			? c + r*image.stride
-			: r + c*image.stride;
-	}
+void Image::transposeTo(Image& dst, ThreadPool& pool) {
+	TRACE_SCOPE("transpose");
+	dst.allocMemory(size_t(width) * height);
+	dst.width = height;
+	dst.height = width;
+	dst.stride = height;
+	transposePlane(data.get(), stride, dst.data.get(), dst.stride, width, height, pool);
+	transposePlane(energy.get(), stride, dst.energy.get(), dst.stride, width, height, pool);
+	transposePlane(luma.get(), stride, dst.luma.get(), dst.stride, width, height, pool);
+	dst.energyScale = energyScale;
+}
 
-	/// Get the offset in our dynamic table for a given virtual row and column.
-	int getIdx(const int& r, const int& c) {
-		return idxMap[r*idxStride + c];
+bool Image::shouldTranspose(int howMany, const CarveOptions& options) const {
+	if (howMany <= 0) return false;
+	switch (options.transpose) {
+	case TransposeMode::Never:
+		return false;
+	case TransposeMode::Always:
+		return true;
+	default:
+		// The transposed image is a full copy, which the low memory storage avoids.
+		if (options.storage == CarveStorage::LowMemory) return false;
+		// Carving rows in place reads one image column at a time, which touches one cache line per row.
+		return size_t(height) * 64 > transposeCacheSize;
 	}
+}
 
-	/// Updates a pixel in the dynamic table.
-	void computePixel(const int& r, const int& c, const int& _prev) {
-		const int currOffset = getIdx(r, c);
-		const int prevOffset = getIdx(r-1, c+_prev);
-		if (dyn[currOffset].total > dyn[prevOffset].total) {
-			dyn[currOffset].total = dyn[prevOffset].total;
-			dyn[currOffset].prev = _prev;
+void Image::carveRows(int howMany, const CarveOptions& options) {
+	TRACE_SCOPE("carve rows");
+	std::chrono::high_resolution_clock clock;
+	std::chrono::time_point startTime = clock.now();
+	CarveWorkspace localWorkspace;
+	CarveOptions workspaceOptions = options;
+	workspaceOptions.workspace = options.workspace ? options.workspace : &localWorkspace;
+	CarveWorkspace& workspace = *workspaceOptions.workspace;
+
+	if (shouldTranspose(howMany, options)) {
+		// Carve the columns of the transposed image, where the rows are contiguous.
+		ThreadPool localPool;
+		ThreadPool& pool = options.threadPool ? *options.threadPool : localPool;
+		Image& transposed = workspace.transposed;
+		transposeTo(transposed, pool);
+		if (options.onPreview) {
+			// The previews are of the transposed image
+			workspaceOptions.onPreview = [&](const CarvePreview& preview) {
+				workspace.transposedPreview.resize(size_t(preview.width) * preview.height);
+				Pixel* pixels = workspace.transposedPreview.data();
+				transposePlane(preview.pixels, preview.width, pixels, preview.height, preview.width, preview.height, pool);
+				options.onPreview(CarvePreview{pixels, preview.height, preview.width, preview.seams});
+			};
+		}
+		if (options.removalOrder) {
+			// The removal order has to be transposed as well, since it uses the offsets in the image.
+			const int oldStride = stride;
+			workspace.transposedOrder.resize(size_t(width) * height);
+			int* order = workspace.transposedOrder.data();
+			transposePlane(options.removalOrder, oldStride, order, height, width, height, pool);
+			workspaceOptions.removalOrder = order;
+			carveImage<true>(transposed, howMany, workspaceOptions);
+			transposePlane(order, height, options.removalOrder, oldStride, height, width, pool);
+		} else {
+			carveImage<true>(transposed, howMany, workspaceOptions);
 		}
+		transposed.transposeTo(*this, pool);
+	} else {
+		carveImage<false>(*this, howMany, workspaceOptions);
 	}
-};
 
-void Image::carveRows(int howMany) {
-	std::chrono::high_resolution_clock clock;
-	std::chrono::time_point startTime = clock.now();
-	CarveHelper<false> helper(*this);
-	helper.carve(howMany);
-	auto deltaTime = clock.now() - startTime;
-	printf("Carve %d rows: %.03fms\n", howMany, 1e-6f * deltaTime.count());
+	if (printTimings) {
+		auto deltaTime = clock.now() - startTime;
+		printf("Carve %d rows: %.03fms\n", howMany, 1e-6f * deltaTime.count());
+	}
 }
 
-void Image::carveCols(int howMany) {
+void Image::carveCols(int howMany, const CarveOptions& options) {
+	TRACE_SCOPE("carve cols");
 	std::chrono::high_resolution_clock clock;
 	std::chrono::time_point startTime = clock.now();
-	CarveHelper<true> helper(*this);
-	helper.carve(howMany);
-	auto deltaTime = clock.now() - startTime;
-	printf("Carve %d cols: %.03fms\n", howMany, 1e-6f * deltaTime.count());
+	CarveWorkspace localWorkspace;
+	CarveOptions workspaceOptions = options;
+	workspaceOptions.workspace = options.workspace ? options.workspace : &localWorkspace;
+
+	carveImage<true>(*this, howMany, workspaceOptions);
+
+	if (printTimings) {
+		auto deltaTime = clock.now() - startTime;
+		printf("Carve %d cols: %.03fms\n", howMany, 1e-6f * deltaTime.count());
+	}
 }
 
-void Image::computeEnergies() {
+void Image::computeEnergies(ThreadPool* pool) {
 	if (!isValid()) return;
-	const int memSize = stride * height;
-	std::unique_ptr<float[]> luma = std::make_unique<float[]>(memSize);
 
+	const LumaTables& tables = LumaTables::get();
+	computeEnergies(pool, [&](int row, float* rowLuma, bool) {
+		tables.computeLumaRow(&data[size_t(row) * stride], rowLuma, width);
+	});
+}
+
+void Image::computeEnergies(ThreadPool* threadPool, const std::function<void(int, float*, bool)>& loadRow) {
+	TRACE_SCOPE("energy");
 	std::chrono::high_resolution_clock clock;
 	std::chrono::time_point startTime = clock.now();
 
-	const float k = 1.0f / 255.0f;
-	for (int idx=0; idx<memSize; ++idx) {
-		luma[idx] = computeLuma(
-			k * float(data[idx].r),
-			k * float(data[idx].g),
-			k * float(data[idx].b)
-		);
-	}
-
-	int offset = 0;
-	int iterEnd = 0;
-	// First row
-	energy[offset] = (fabsf(luma[offset+1] - luma[offset]) + fabsf(luma[offset+stride] - luma[offset]))*2.0f;
-	++offset;
-	for (iterEnd = offset+width-2; offset < iterEnd; ++offset) {
-		energy[offset] = fabsf(luma[offset+1] - luma[offset-1]) + fabsf(luma[offset+stride] - luma[offset])*2.0f;
-	}
-	energy[offset] = (fabsf(luma[offset] - luma[offset-1]) + fabsf(luma[offset+stride] - luma[offset]))*2.0f;
-	++offset;
-
-	// Middle rows
-	for (int row = 1; row < height-1; ++row) {
-		energy[offset] = fabsf(luma[offset+1] - luma[offset])*2.0f + fabsf(luma[offset+stride] - luma[offset-stride]);
-		++offset;
-		for (iterEnd = offset+width-2; offset < iterEnd; ++offset) {
-			energy[offset] = fabsf(luma[offset+1] - luma[offset-1]) + fabsf(luma[offset+stride] - luma[offset-stride]);
+	ThreadPool localPool;
+	ThreadPool& pool = threadPool ? *threadPool : localPool;
+
+	// Each job takes a band of rows and goes over it once. For each row, it loads the luma of the next row and
+	// then computes the energies, while all three rows are still in the cache. The luma of the rows just outside the
+	// band (the halo) is loaded into a buffer of its own, since those rows belong to the neighbouring jobs.
+	const int numJobs = pool.getNumJobs(height, std::max(1, energyPixelsPerJob / width));
+	std::vector<float> jobMaxEnergy(numJobs, 0.0f);
+	pool.run(numJobs, [&](int job) {
+		const int rBegin = int(int64_t(height) * job / numJobs);
+		const int rEnd = int(int64_t(height) * (job+1) / numJobs);
+		std::vector<float> halo(2 * size_t(width));
+		auto getLumaRow = [&](int r) -> float* {
+			if (r < rBegin) return halo.data();
+			if (r >= rEnd) return halo.data() + width;
+			return &luma[size_t(r) * stride];
+		};
+
+		if (rBegin > 0) {
+			loadRow(rBegin-1, getLumaRow(rBegin-1), true);
 		}
-		energy[offset] = fabsf(luma[offset] - luma[offset-1])*2.0f + fabsf(luma[offset+stride] - luma[offset-stride]);
-		++offset;
-	}
-
-	// Last row
-	energy[offset] = (fabsf(luma[offset+1] - luma[offset]) + fabsf(luma[offset] - luma[offset-stride]))*2.0f;
-	++offset;
-	for (iterEnd = offset+width-2; offset < iterEnd; ++offset) {
-		energy[offset] = fabsf(luma[offset+1] - luma[offset-1]) + fabsf(luma[offset] - luma[offset-stride])*2.0f;
-	}
-	energy[offset] = (fabsf(luma[offset] - luma[offset-1]) + fabsf(luma[offset] - luma[offset-stride]))*2.0f;
-	++offset;
+		loadRow(rBegin, getLumaRow(rBegin), false);
+		float maxEnergy = 0.0f;
+		for (int r = rBegin; r < rEnd; ++r) {
+			const bool hasDown = r+1 < height;
+			if (hasDown) {
+				loadRow(r+1, getLumaRow(r+1), r+1 >= rEnd);
+			}
+			const float* center = getLumaRow(r);
+			const float rowMax = computeEnergyRow(
+				(r > 0) ? getLumaRow(r-1) : center,
+				center,
+				hasDown ? getLumaRow(r+1) : center,
+				(r > 0 && hasDown) ? 1.0f : 2.0f,
+				&energy[size_t(r) * stride], width);
+			maxEnergy = std::max(maxEnergy, rowMax);
+		}
+		jobMaxEnergy[job] = maxEnergy;
+	});
 
 	// Normalize energy to 1.0f
-	float maxE = 0.0f;
-	for (int i = 0; i < memSize; ++i) {
-		if (maxE < energy[i]) {
-			maxE = energy[i];
+	TRACE_SCOPE("normalize energy");
+	const float maxEnergy = *std::max_element(jobMaxEnergy.begin(), jobMaxEnergy.end());
+	energyScale = (maxEnergy > 0.0f) ? 1.0f/maxEnergy : 1.0f;
+	pool.parallelFor(0, height, std::max(1, energyPixelsPerJob / width), [&](int rBegin, int rEnd) {
+		for (int r = rBegin; r < rEnd; ++r) {
+			float* rowEnergy = &energy[size_t(r) * stride];
+			for (int c = 0; c < width; ++c) {
+				rowEnergy[c] *= energyScale;
+			}
 		}
+	});
+
+	if (printTimings) {
+		auto deltaTime = clock.now() - startTime;
+		printf("Computed energies: %.03fms\n", 1e-6f * deltaTime.count());
 	}
-	maxE = 1.0f/maxE;
-	for (int i = 0; i < memSize; ++i) {
-		energy[i] *= maxE;
-	}
+}
 
-	auto deltaTime = clock.now() - startTime;
-	printf("Computed energies: %.03fms\n", 1e-6f * deltaTime.count());
+void Image::computeEnergiesFromLuma(ThreadPool& pool) {
+	TRACE_SCOPE("energy from luma");
+	pool.parallelFor(0, height, std::max(1, energyPixelsPerJob / width), [&](int rBegin, int rEnd) {
+		for (int r = rBegin; r < rEnd; ++r) {
+			const float* center = &luma[size_t(r) * stride];
+			const bool hasUp = r > 0;
+			const bool hasDown = r+1 < height;
+			float* rowEnergy = &energy[size_t(r) * stride];
+			computeEnergyRow(
+				hasUp ? center - stride : center,
+				center,
+				hasDown ? center + stride : center,
+				(hasUp && hasDown) ? 1.0f : 2.0f,
+				rowEnergy, width);
+			if (energyScale != 1.0f) {
+				for (int c = 0; c < width; ++c) {
+					rowEnergy[c] *= energyScale;
+				}
+			}
+		}
+	});
 }
 
-void Image::allocMemory(int newCap) {
-	if (newCap <= capacity) return;
+bool Image::isShared() const {
+	return data.use_count() > 1 || energy.use_count() > 1 || luma.use_count() > 1;
+}
+
+void Image::allocMemory(size_t newCap) {
+	if (newCap <= capacity && !isShared()) return;
 
-	data = std::make_unique<Pixel[]>(newCap);
-	energy = std::make_unique<float[]>(newCap);
+	data = makeScratchArray<Pixel>(newCap);
+	energy = makeScratchArray<float>(newCap);
+	luma = makeScratchArray<float>(newCap);
 	capacity = newCap;
 }
 
@@ -448,6 +638,12 @@ void Image::allocMemory(int newCap) {
 // # ImageManager
 // ################################################################################################################################
 
+ImageManager::ImageManager()
+	: workspace(std::make_unique<CarveWorkspace>())
+{}
+
+ImageManager::~ImageManager() = default;
+
 bool ImageManager::accepts(const char* path) {
 	FREE_IMAGE_FORMAT imgFormat = getImageFormat(path);
 	return FreeImage_FIFSupportsReading(imgFormat);
@@ -462,12 +658,15 @@ Image& ImageManager::getOriginalImage() {
 }
 
 void ImageManager::triggerLoad(const char* path) {
-	Error err = originalImage.load(path);
+	stopCarving();
+	Error err = originalImage.load(path, &threadPool);
 	if (err) {
 		err.print();
 		return;
 	}
 	isSeamModified = false;
+	seamIndex.clear();
+	versions.clear();
 	saveHandler.setImageLoaded(path);
 
 	notify(&ImageManagerObserver::onImageChange);
@@ -489,19 +688,266 @@ void ImageManager::triggerSave() {
 void ImageManager::triggerSeam(int targetWidth, int targetHeight) {
 	Image* img = &getActiveImage();
 	if (img->getWidth() == targetWidth && img->getHeight() == targetHeight) {
+		cancelSeam();
+		return;
+	}
+
+	// With the index, any smaller size is a single pass over the original image
+	if (seamIndex.covers(targetWidth, targetHeight)) {
+		stopCarving();
+		seamIndex.apply(originalImage, targetWidth, targetHeight, activeImage, threadPool);
+		isSeamModified = true;
+		notify(&ImageManagerObserver::onImageSeamed);
+		return;
+	}
+
+	// Only the newest size is carved. The running carving is cancelled, and update starts the next one from what
+	// it got done, once the worker is free. Until then, newer sizes just replace this one.
+	pendingWidth = targetWidth;
+	pendingHeight = targetHeight;
+	hasPendingSeam = true;
+	if (carveWorker.isBusy()) {
+		carveWorker.cancel();
+		++lastSeamJob;
+	} else {
+		startSeam();
+	}
+}
+
+void ImageManager::startSeam() {
+	hasPendingSeam = false;
+	const int targetWidth = pendingWidth;
+	const int targetHeight = pendingHeight;
+
+	// Start from the smallest image that is still large enough: the active one, an earlier result, or the original.
+	Image* start = &originalImage;
+	auto tryStart = [&](Image& image) {
+		if (image.getWidth() >= targetWidth && image.getHeight() >= targetHeight
+			&& size_t(image.getWidth()) * image.getHeight() < size_t(start->getWidth()) * start->getHeight())
+		{
+			start = &image;
+		}
+	};
+	if (isSeamModified) {
+		tryStart(activeImage);
+	}
+	for (const std::unique_ptr<Image>& version : versions) {
+		tryStart(*version);
+	}
+	if (start->getWidth() == targetWidth && start->getHeight() == targetHeight) {
+		// Nothing to carve, e.g. when the slider comes back to the size of an earlier result
+		activeImage.copyFrom(*start);
+		isSeamModified = true;
+		dropPreview();
+		notify(&ImageManagerObserver::onImageSeamed);
 		return;
 	}
 
-	if (!isSeamModified || (img->getWidth() < targetWidth || img->getHeight() < targetHeight)) {
-		activeImage.copyFrom(originalImage);
+	// Carve a copy in the background. Copies share the planes, so nothing is copied until the carving writes the
+	// result, and the active image can still be shown meanwhile.
+	std::shared_ptr<Image> carved = std::make_shared<Image>();
+	carved->copyFrom(*start);
+	const uint64_t job = ++lastSeamJob;
+	const int diffWidth = carved->getWidth() - targetWidth;
+	const int diffHeight = carved->getHeight() - targetHeight;
+	seamProgress = CarveProgress{job, 0, diffWidth + diffHeight};
+	carveWorker.submit([this, job, carved, diffWidth, diffHeight](const std::atomic<bool>& cancel) {
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.workspace = workspace.get();
+		options.cancel = &cancel;
+		int doneBefore = 0; // Seams removed by the earlier direction
+		options.onProgress = [&](int done) {
+			carveWorker.reportProgress(CarveProgress{job, doneBefore + done, diffWidth + diffHeight});
+		};
+		// Previews are copied outside of the lock, and then swapped with the pending one
+		std::vector<Pixel> previewPixels;
+		options.previewMillis = previewMillis;
+		options.onPreview = [&](const CarvePreview& preview) {
+			previewPixels.assign(preview.pixels, preview.pixels + size_t(preview.width) * preview.height);
+			std::lock_guard<std::mutex> lock(carvedMutex);
+			std::swap(pendingPreview.pixels, previewPixels);
+			pendingPreview.width = preview.width;
+			pendingPreview.height = preview.height;
+			pendingPreview.job = job;
+		};
+		const int startWidth = carved->getWidth();
+		const int startHeight = carved->getHeight();
+		carved->carveCols(diffWidth, options);
+		doneBefore = diffWidth;
+		if (!cancel) {
+			carved->carveRows(diffHeight, options);
+		}
+
+		std::lock_guard<std::mutex> lock(carvedMutex);
+		if (!cancel) {
+			carvedImage = carved;
+			carvedJob = job;
+		} else if (carved->getWidth() < startWidth || carved->getHeight() < startHeight) {
+			// The seams removed so far are still valid, and the next carving can start from them
+			partialImage = carved;
+		}
+	});
+}
+
+void ImageManager::cancelSeam() {
+	hasPendingSeam = false;
+	carveWorker.cancel();
+	// Ignore anything that the carving sends until it stops
+	++lastSeamJob;
+	dropPreview();
+}
+
+bool ImageManager::isCarving() {
+	return hasPendingSeam || carveWorker.isBusy();
+}
+
+const CarveProgress& ImageManager::getSeamProgress() const {
+	return seamProgress;
+}
+
+const SeamPreview& ImageManager::getSeamPreview() const {
+	return seamPreview;
+}
+
+void ImageManager::update() {
+	CarveProgress progress;
+	while (carveWorker.popProgress(progress)) {
+		if (progress.job == lastSeamJob) {
+			seamProgress = progress;
+		}
+	}
+
+	// Checked first, so that the result of a carving that ends meanwhile is still taken below
+	const bool isIdle = !carveWorker.isBusy();
+	if (numThreads != threadPool.getNumThreads() && isIdle) {
+		threadPool.resize(numThreads);
+	}
+
+	std::shared_ptr<Image> carved;
+	std::shared_ptr<Image> partial;
+	std::unique_ptr<SeamIndex> builtIndex;
+	bool hasPreview = false;
+	{
+		std::lock_guard<std::mutex> lock(carvedMutex);
+		if (carvedJob == lastSeamJob) {
+			carved = std::move(carvedImage);
+		}
+		carvedImage.reset();
+		if (builtSeamIndexJob == lastSeamJob) {
+			builtIndex = std::move(builtSeamIndex);
+		}
+		builtSeamIndex.reset();
+		partial = std::move(partialImage);
+		if (pendingPreview.job == lastSeamJob && !pendingPreview.pixels.empty()) {
+			std::swap(seamPreview, pendingPreview);
+			hasPreview = true;
+		}
+		pendingPreview.pixels.clear();
+	}
+
+	if (partial) {
+		keepVersion(*partial);
+	}
+	if (builtIndex) {
+		seamIndex = std::move(*builtIndex);
+	}
+	if (carved) {
+		seamPreview.pixels.clear();
+		activeImage.copyFrom(*carved);
 		isSeamModified = true;
-		img = &activeImage;
+		keepVersion(activeImage);
+		notify(&ImageManagerObserver::onImageSeamed);
+	} else if (hasPreview) {
+		notify(&ImageManagerObserver::onSeamPreview);
 	}
 
-	const int diffWidth = img->getWidth() - targetWidth;
-	const int diffHeight = img->getHeight() - targetHeight;
-	img->carveCols(diffWidth);
-	img->carveRows(diffHeight);
+	// Start the newest size once the cancelled carving stopped
+	if (hasPendingSeam && isIdle) {
+		startSeam();
+	}
+}
+
+void ImageManager::keepVersion(Image& image) {
+	if (versions.size() >= maxVersions) {
+		versions.erase(versions.begin());
+	}
+	versions.push_back(std::make_unique<Image>());
+	versions.back()->copyFrom(image);
+}
 
+void ImageManager::stopCarving() {
+	hasPendingSeam = false;
+	carveWorker.cancel();
+	carveWorker.wait();
+	++lastSeamJob;
+	{
+		std::lock_guard<std::mutex> lock(carvedMutex);
+		carvedImage.reset();
+		partialImage.reset();
+		builtSeamIndex.reset();
+		pendingPreview.pixels.clear();
+	}
+	dropPreview();
+}
+
+void ImageManager::dropPreview() {
+	if (seamPreview.pixels.empty()) return;
+	// Show the active image again
+	seamPreview.pixels.clear();
 	notify(&ImageManagerObserver::onImageSeamed);
 }
+
+void ImageManager::triggerBuildSeamIndex() {
+	if (!originalImage) return;
+	stopCarving();
+
+	// The index is built from a copy that shares the planes, since the original can be loaded again meanwhile
+	std::shared_ptr<Image> source = std::make_shared<Image>();
+	source->copyFrom(originalImage);
+	const uint64_t job = ++lastSeamJob;
+	const int total = (source->getWidth() - 1) + (source->getHeight() - 1);
+	seamProgress = CarveProgress{job, 0, total};
+	carveWorker.submit([this, job, source, total](const std::atomic<bool>& cancel) {
+		std::chrono::high_resolution_clock clock;
+		std::chrono::time_point startTime = clock.now();
+		CarveOptions options;
+		options.threadPool = &threadPool;
+		options.workspace = workspace.get();
+		options.cancel = &cancel;
+		options.onProgress = [&](int done) {
+			carveWorker.reportProgress(CarveProgress{job, done, total});
+		};
+		std::unique_ptr<SeamIndex> built = std::make_unique<SeamIndex>();
+		Error err = built->build(*source, 1, 1, options);
+		if (cancel) return;
+		if (err) {
+			err.print();
+			return;
+		}
+		if (printTimings) {
+			auto deltaTime = clock.now() - startTime;
+			printf("Built seam index: %.03fms\n", 1e-6f * deltaTime.count());
+		}
+
+		std::lock_guard<std::mutex> lock(carvedMutex);
+		builtSeamIndex = std::move(built);
+		builtSeamIndexJob = job;
+	});
+}
+
+bool ImageManager::hasSeamIndex() const {
+	return seamIndex.covers(originalImage.getWidth(), originalImage.getHeight());
+}
+
+void ImageManager::setNumThreads(int _numThreads) {
+	numThreads = _numThreads;
+}
+
+int ImageManager::getNumThreads() const {
+	return numThreads;
+}
+
+const CarveWorkspace& ImageManager::getWorkspace() const {
+	return *workspace;
+}
@@ -1,12 +1,120 @@
 #pragma once
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
+#include "carveWorker.h"
 #include "error.h"
 #include "observer.h"
 #include "saveHandler.h"
+#include "seamIndex.h"
+#include "threadPool.h"
 
-template <bool>
+template <bool, typename>
 struct CarveHelper;
+struct CarveWorkspace;
+struct CarvePreview;
+struct FIBITMAP;
+
+/// How the dynamic table is stored while carving.
+enum class CarveStorage {
+	/// The table elements never move. A map of indices is updated after each seam instead.
+	Indexed,
+	/// Each row is kept compacted, with separate arrays for each field. Removing a seam moves more memory, but the
+	/// table is read without any indirection, and it is smaller. Faster on all the images we measured.
+	Compact,
+	/// Like Compact, but only two rows of totals are kept, and the parents are packed into 2 bits. The dynamic state
+	/// takes 0.25 bytes per pixel instead of 5, but the whole table is computed again after each seam, instead of
+	/// only the part that changed. Meant for removing a few seams, or many seams in batches, from large images. With
+	/// TransposeMode::Auto, rows are carved in place, so that the image is not copied.
+	LowMemory,
+};
+
+/// When to transpose the image before carving rows.
+enum class TransposeMode {
+	Auto, ///< Transpose when it is expected to be faster.
+	Never, ///< Carve rows in place, reading the image one column at a time.
+	Always, ///< Transpose the image, carve its columns and transpose it back.
+};
+
+/// Numbers collected while carving. Used to compare the results of different options.
+struct CarveStats {
+	int seams = 0; ///< Number of removed seams.
+	int passes = 0; ///< Number of times seams were searched in an up to date dynamic table.
+	double energy = 0.0; ///< Sum of the energies of all removed pixels. Lower is better.
+};
+
+/// The seams removed by a carve, in the order they were removed. Given to the next carve as CarveOptions::guide, e.g.
+/// for the next frame of a video, so that it removes similar seams.
+struct SeamGuide {
+	int rows = 0; ///< Number of rows that each seam crosses.
+	int cols = 0; ///< Number of columns before the first seam was removed.
+	/// Column of each seam in each row, one seam after another. The columns are those of the image at the time the
+	/// seam was removed, so seam i of two images of the same size can be compared directly.
+	std::vector<int> seams;
+
+	/// Return the number of recorded seams.
+	int getNumSeams() const {
+		return rows > 0 ? int(seams.size() / rows) : 0;
+	}
+
+	/// Return the column of seam @p i in each row.
+	const int* getSeam(int i) const {
+		return &seams[size_t(i) * rows];
+	}
+};
+
+/// Settings for the seam carving. Except for batchSize, pyramidBand, guide and updateEnergy, they change how the
+/// work is done, but never the result.
+struct CarveOptions {
+	ThreadPool* threadPool = nullptr; ///< Threads to split the work between. If null, we carve on the calling thread.
+	CarveStorage storage = CarveStorage::Compact; ///< How to store the dynamic table.
+	TransposeMode transpose = TransposeMode::Auto; ///< When to transpose the image to carve rows.
+	/// Maximal number of seams removed from one dynamic table, before it is computed again. With more than one, the
+	/// result is approximate: the seams can't touch or cross each other, and each of them ignores the pixels removed
+	/// by the others. Much faster when removing many seams. Use CarveStats::energy to see how much quality is lost.
+	int batchSize = 1;
+	CarveStats* stats = nullptr; ///< If set, the numbers from the carving are added to it.
+	/// If positive, large images are carved coarse-to-fine. The energy is downscaled a few times, each seam is
+	/// found on the smallest level, and then refined on each larger one only within this many pixels of it. The
+	/// result is approximate, but the work per seam on the full image grows with its height times the band, instead
+	/// of its size. Takes precedence over batchSize. The levels are rebuilt every pyramidBand / 2 seams, so a narrow
+	/// band spends its time rebuilding them, and a wide one searching it: on 16k pixel wide images, 32 to 64 is
+	/// faster than the exact carving, and 16 or less, or 128 or more, is slower.
+	int pyramidBand = 0;
+	int pyramidMinPixels = 4 * 1024 * 1024; ///< Smaller images are carved exactly, even with pyramidBand.
+	/// If set, and it was recorded from an image of the same size, seam i is only searched within guideBand pixels
+	/// of seam i of the guide. Seams past the ones of the guide are carved exactly. Meant for the frames of a video:
+	/// the seams stay close to those of the previous frame, so they don't jump around between frames, and the work
+	/// per seam grows with the height times the band, instead of the size of the image. Takes precedence over
+	/// pyramidBand and batchSize.
+	const SeamGuide* guide = nullptr;
+	int guideBand = 8; ///< Number of columns on each side of a seam of the guide that are searched.
+	/// If set, receives the removed seams, to guide the next carve. Must not be the same as guide.
+	SeamGuide* recordGuide = nullptr;
+	/// Recompute the energy of the pixels next to each removed seam, as if the energies of the smaller image were
+	/// computed again. Otherwise, pixels keep the energy they had in the original image.
+	bool updateEnergy = true;
+	/// If set, each removed pixel gets the number of seams removed before it, at its offset in the image data. The
+	/// other pixels are not changed. Must have stride * height elements.
+	int* removalOrder = nullptr;
+	/// Buffers to carve with. If set, they are kept for the next carve, so that it doesn't have to allocate them
+	/// again. If null, they are allocated for this carve only.
+	CarveWorkspace* workspace = nullptr;
+	/// If set, it is checked before each seam, and once it is true, no more seams are removed. The image is still
+	/// valid then, with the seams removed so far.
+	const std::atomic<bool>* cancel = nullptr;
+	/// If set, called after each removed seam, or batch of seams, with the number of seams removed so far.
+	std::function<void(int)> onProgress;
+	/// If set, called every previewSeams seams or previewMillis milliseconds, whichever comes first, with the
+	/// image as it is so far. The pixels are gathered through the table, without compacting the image, into a
+	/// buffer of the workspace, so they are only valid during the call. No preview is made after the last seam.
+	std::function<void(const CarvePreview&)> onPreview;
+	int previewSeams = 0; ///< Seams between previews. Zero only uses previewMillis.
+	int previewMillis = 0; ///< Milliseconds between previews. Zero only uses previewSeams.
+};
 
 /// Represents one pixel.
 struct Pixel {
@@ -15,9 +123,22 @@ struct Pixel {
 	uint8_t b;
 };
 
+/// The image in the middle of a carving, see CarveOptions::onPreview.
+struct CarvePreview {
+	const Pixel* pixels; ///< The rows, without padding.
+	int width; ///< Width in pixels.
+	int height; ///< Height in pixels.
+	int seams; ///< Number of seams removed so far.
+};
+
+/// Print how long carving and computing the energies takes. Off by default, the application turns it on.
+void setPrintTimings(bool enabled);
+
 class Image {
-	template<bool>
+	template<bool, typename>
 	friend struct CarveHelper;
+	friend struct CarveWorkspace;
+	friend class SeamIndex;
 
 public:
 	/// We shouldn't need to copy images around.
@@ -26,15 +147,35 @@ public:
 	/// Return true if the image has size and data.
 	operator bool();
 
-	/// Copy the given image into this.
+	/// Copy the given image into this. The planes are shared until one of the images changes them, so this is cheap.
 	void copyFrom(Image& other);
+	/// Copy the given image into planes that belong to this image only. Its planes are reused if they are large
+	/// enough, so carving the copy doesn't have to allocate and copy them first.
+	void copyPlanesFrom(Image& other);
 
 	/// Load an image given its path.
 	/// The image can be any of the supported types by FreeImage library. Called by the ImageManager
 	/// after checking that the given path is an image that we can read.
-	Error load(const char* path);
+	/// @param pool Threads to split the energy computation between. If null, it is done on the calling thread.
+	Error load(const char* path, ThreadPool* pool = nullptr);
+	/// Load an image from the bytes of an encoded file. The format is deduced from the bytes.
+	/// @param bytes The encoded file, e.g. the contents of a PNG file.
+	/// @param size Size of @p bytes in bytes.
+	/// @param pool Threads to split the energy computation between. If null, it is done on the calling thread.
+	Error loadFromMemory(const uint8_t* bytes, size_t size, ThreadPool* pool = nullptr);
 	/// Save the image to the given file path.
 	Error save(const char* path);
+	/// Encode the image into memory.
+	/// @param format Name of the format as known by FreeImage, e.g. "png" or "jpg".
+	/// @param bytes Receives the encoded file. Its capacity is kept, so reusing it for each image avoids allocations.
+	Error saveToMemory(const char* format, std::vector<uint8_t>& bytes);
+
+	/// Create an image from pixel data and compute its energies.
+	/// @param width Width in pixels.
+	/// @param height Height in pixels.
+	/// @param pixels The pixels, row by row, without any padding.
+	/// @param pool Threads to split the energy computation between. If null, it is done on the calling thread.
+	Error create(int width, int height, const Pixel* pixels, ThreadPool* pool = nullptr);
 
 	/// @{
 	/// Accessors.
@@ -50,34 +191,85 @@ public:
 
 	/// Find horizontal seams with lowest energies connecting both vertical borders and removes them.
 	/// @param howMany Number of seams to remove.
-	void carveRows(int howMany);
+	/// @param options How to do the carving.
+	void carveRows(int howMany, const CarveOptions& options = CarveOptions());
 
 	/// Find vertical seams with lowest energies connecting both horizontal borders and removes them.
 	/// @param howMany Number of seams to remove.
-	void carveCols(int howMany);
+	/// @param options How to do the carving.
+	void carveCols(int howMany, const CarveOptions& options = CarveOptions());
 
 private:
 	int width = 0; /// Width in pixels.
 	int height = 0; /// Height in pixels.
 	int stride = 0; /// Offset in pixels to the next row.
-	int capacity = 0; ///< Size of allocated arrays.
+	size_t capacity = 0; ///< Size of allocated arrays.
+	/// The planes below can be shared by several images (see copyFrom). Before changing a shared plane, an image
+	/// gets new ones with allocMemory.
+	/// @{
 	/// Holds the image data as 8bit RGBA values. Alpha is not used.
-	std::unique_ptr<Pixel[]> data;
+	std::shared_ptr<Pixel[]> data;
 	/// Holds the pixel energies used to do seam carving.
-	std::unique_ptr<float[]> energy;
+	std::shared_ptr<float[]> energy;
+	/// Holds the luma of each pixel. Kept so that energies can be recomputed after removing seams.
+	std::shared_ptr<float[]> luma;
+	/// @}
+	/// The energies are normalized with this, so that the largest one at load time is 1.0f.
+	float energyScale = 1.0f;
+
+	/// Copy the pixels of a decoded image and compute the energies.
+	/// @param fib The decoded image, unloaded by this. Null if the decoding failed.
+	/// @param pool Threads to split the energy computation between. If null, it is done on the calling thread.
+	Error loadBitmap(FIBITMAP* fib, ThreadPool* pool);
+
+	/// Return a copy of the pixels for FreeImage to encode, or null if it can't be allocated. The caller unloads it.
+	FIBITMAP* makeBitmap() const;
 
-	/// Calculated the energies for the image.
-	void computeEnergies();
+	/// Calculate the luma and the energies for the image, and normalize the energies.
+	/// @param pool Threads to split the work between. If null, it is done on the calling thread.
+	void computeEnergies(ThreadPool* pool = nullptr);
 
-	/// Allocates all memory.
+	/// Same as above, but the luma of each row comes from @p loadRow, so that it can be computed from any source
+	/// while the row is being read.
+	/// @param loadRow Called as loadRow(row, rowLuma, isHalo) to write the luma of a row into rowLuma. Each row is
+	///     loaded once with isHalo == false, which is when the row's pixels can be written as well. Rows next to
+	///     the bands of other threads are loaded again, with isHalo == true, and only need the luma.
+	void computeEnergies(ThreadPool* pool, const std::function<void(int, float*, bool)>& loadRow);
+
+	/// Calculate the energies from the luma, and multiply them with energyScale.
+	/// @param pool Threads to split the work between.
+	void computeEnergiesFromLuma(ThreadPool& pool);
+
+	/// Write the transposed image into @p dst, which must be a different image.
+	/// @param pool Threads to split the work between.
+	void transposeTo(Image& dst, ThreadPool& pool);
+
+	/// Return true if carving rows should be done on the transposed image.
+	bool shouldTranspose(int howMany, const CarveOptions& options) const;
+
+	/// Return true if the planes are shared with another image (see copyFrom). Shared planes must not be changed.
+	bool isShared() const;
+
+	/// Allocates all memory. Shared planes are never reused, since the other images still use them.
 	/// @param newCap Capacity.
-	void allocMemory(int newCap);
+	void allocMemory(size_t newCap);
+};
+
+/// A copy of the image in the middle of a carving in the background.
+struct SeamPreview {
+	std::vector<Pixel> pixels; ///< The rows, without padding. Empty if there is no preview.
+	int width = 0; ///< Width in pixels.
+	int height = 0; ///< Height in pixels.
+	uint64_t job = 0; ///< Id of the carving that made it.
 };
 
 class ImageManager
 	: public Observable<ImageManagerObserver>
 {
 public:
+	ImageManager();
+	~ImageManager();
+
 	/// Check if the file is an image that we can load.
 	/// @param path The file path.
 	/// @return True if it can be loaded.
@@ -95,7 +287,41 @@ public:
 
 	/// Start the seam carving. We remove seams until the image reaches the given size.
 	/// If the image is smaller than the target size, we start over from the original.
+	/// The carving runs in the background. The active image changes when it is done, in update. With the seam
+	/// index, the image is resized right away.
+	/// Meant to be called on every change of the size, e.g. while a slider is dragged: a carving that is still
+	/// running is cancelled, and the newest size is carved from what it got done once it stops. Sizes requested
+	/// meanwhile are dropped.
 	void triggerSeam(int targetWidth, int targetHeight);
+	/// Stop the carving that runs in the background. The active image stays as it is.
+	void cancelSeam();
+	/// Return true while a carving runs in the background, or waits to start.
+	bool isCarving();
+	/// Return how far the carving in the background got.
+	const CarveProgress& getSeamProgress() const;
+	/// Return the last preview of the carving in the background. Observers are notified with onSeamPreview when
+	/// it changes, and with onImageSeamed when the carving ends or is stopped. Empty if there is none.
+	const SeamPreview& getSeamPreview() const;
+
+	/// Called on the main thread every frame. Takes the previews and the result of a finished carving and notifies
+	/// the observers, so that they always see complete images on the main thread.
+	void update();
+
+	/// Carve the original image down to 1x1 once and remember the order of the removed pixels. After that,
+	/// triggerSeam produces any smaller size without carving again.
+	/// The carving runs in the background like the one of triggerSeam, with the same progress, and can be stopped
+	/// with cancelSeam. The index is used once update takes it.
+	void triggerBuildSeamIndex();
+	/// Return true if triggerSeam can use the seam index, i.e. it is fast enough to call on every change.
+	bool hasSeamIndex() const;
+
+	/// Set the number of threads used for seam carving. Applied once no carving runs.
+	void setNumThreads(int numThreads);
+	/// Return the number of threads used for seam carving.
+	int getNumThreads() const;
+
+	/// Return the carve workspace, which is reused by all carves.
+	const CarveWorkspace& getWorkspace() const;
 
 private:
 	/// Used to get the file path for the saved image.
@@ -113,4 +339,57 @@ private:
 
 	/// Set to true when we apply seam carving to the image. When true, we use the active image.
 	bool isSeamModified = false;
+
+	/// Number of carved images that are kept in #versions.
+	static constexpr size_t maxVersions = 4;
+	/// Time between the previews of a carving in the background. A few frames, so that the gathering doesn't slow
+	/// down the carving much.
+	static constexpr int previewMillis = 50;
+	/// The last carved images, from the oldest one. When the user goes back to a larger size, we start from the
+	/// smallest one that is large enough, instead of the original. The newest one shares its planes with the active
+	/// image until the active image is carved again.
+	std::vector<std::unique_ptr<Image>> versions;
+
+	/// Order of the removed pixels of the original image. Empty until triggerBuildSeamIndex is called.
+	SeamIndex seamIndex;
+
+	/// Threads used for seam carving. By default, we use all cores.
+	ThreadPool threadPool{int(std::thread::hardware_concurrency())};
+
+	/// Buffers used for seam carving. Kept between carves, so that carving again doesn't allocate memory.
+	std::unique_ptr<CarveWorkspace> workspace;
+	/// Number of threads that the pool gets once no carving runs.
+	int numThreads = threadPool.getNumThreads();
+
+	/// The carving in the background. While it runs, it owns the thread pool and the workspace, and it carves a copy
+	/// of the start image. The active image is only replaced on the main thread once the copy is done, so what is
+	/// shown is always complete.
+	/// @{
+	uint64_t lastSeamJob = 0; ///< Id of the last started carving. Results and progress of older ones are ignored.
+	CarveProgress seamProgress; ///< Last progress of the carving with id lastSeamJob.
+	SeamPreview seamPreview; ///< The preview given to the observers.
+	bool hasPendingSeam = false; ///< True if the size below waits for the worker to get free.
+	int pendingWidth = 0; ///< Newest requested width.
+	int pendingHeight = 0; ///< Newest requested height.
+	std::mutex carvedMutex; ///< Guards the members below.
+	std::shared_ptr<Image> carvedImage; ///< The finished image, until update takes it.
+	uint64_t carvedJob = 0; ///< Id of the carving that produced carvedImage.
+	/// What a cancelled carving got done, if it removed any seams. Kept as a version to start the next one from.
+	std::shared_ptr<Image> partialImage;
+	std::unique_ptr<SeamIndex> builtSeamIndex; ///< The finished seam index, until update takes it.
+	uint64_t builtSeamIndexJob = 0; ///< Id of the carving that produced builtSeamIndex.
+	SeamPreview pendingPreview; ///< The newest preview, until update takes it. Swapped, never copied.
+	/// Declared last, so that its thread is stopped before anything it uses is destroyed.
+	CarveWorker carveWorker;
+	/// @}
+
+	/// Cancel the carving in the background, wait for it, and drop its result. Must be called before using the
+	/// thread pool or the workspace on the main thread.
+	void stopCarving();
+	/// Forget the preview, and tell the observers to show the active image again, if a preview was shown.
+	void dropPreview();
+	/// Start carving the pending size in the background, from the smallest image that is large enough.
+	void startSeam();
+	/// Keep a copy of a carved image in #versions, dropping the oldest one if there are too many.
+	void keepVersion(Image& image);
 };
@@ -1,6 +1,7 @@
 #include "app.h"
 
 int main() {
+	setPrintTimings(true);
 	App app;
 	app.run();
 }
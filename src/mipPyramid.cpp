@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "mipPyramid.h"
+#include "simd.h"
+#include "trace.h"
+
+void MipPyramid::reset(const PlaneView& base, int minSize) {
+	views.clear();
+	views.push_back(base);
+	numBuilt = 1;
+	PlaneView level = base;
+	while (level.width > minSize || level.height > minSize) {
+		level.width = (level.width + 1) / 2;
+		level.height = (level.height + 1) / 2;
+		level.stride = size_t(level.width) * level.channels;
+		level.data = nullptr;
+		views.push_back(level);
+	}
+	if (buffers.size() + 1 < views.size()) {
+		buffers.resize(views.size() - 1);
+	}
+}
+
+void MipPyramid::clear() {
+	views.clear();
+	numBuilt = 0;
+}
+
+bool MipPyramid::empty() const {
+	return views.empty();
+}
+
+int MipPyramid::getNumLevels() const {
+	return int(views.size());
+}
+
+const PlaneView& MipPyramid::getLevel(int level) {
+	for (; numBuilt <= level; ++numBuilt) {
+		TRACE_SCOPE("build mip level");
+		const PlaneView& src = views[numBuilt - 1];
+		PlaneView& dst = views[numBuilt];
+		std::vector<uint8_t>& buffer = buffers[numBuilt - 1];
+		buffer.resize(dst.stride * dst.height);
+		dst.data = buffer.data();
+		for (int y = 0; y < dst.height; ++y) {
+			// On an odd height, the last row uses its only source row twice
+			const int y0 = 2*y;
+			const int y1 = std::min(2*y + 1, src.height - 1);
+			downsampleRow(src.at(0, y0), src.at(0, y1), &buffer[y * dst.stride], src.width, src.channels);
+		}
+	}
+	return views[level];
+}
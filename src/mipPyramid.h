@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// A plane of 8-bit pixels, with one or more channels. It doesn't own the pixels.
+struct PlaneView {
+	const uint8_t* data = nullptr; ///< The first row.
+	size_t stride = 0; ///< Offset in bytes to the next row.
+	int width = 0; ///< Width in pixels.
+	int height = 0; ///< Height in pixels.
+	int channels = 0; ///< Bytes per pixel.
+
+	/// Return the pixel in column @p x of row @p y.
+	const uint8_t* at(int x, int y) const {
+		return data + y * stride + size_t(x) * channels;
+	}
+};
+
+/// Smaller copies of an image, each one half the size of the previous one, for drawing the image zoomed out. The
+/// levels are built when they are first asked for, so a pyramid that is only looked at up close costs nothing.
+class MipPyramid {
+public:
+	/// Start a new pyramid. Level 0 is @p base itself, it is not copied, so it must stay valid while the pyramid is
+	/// used. Buffers of the earlier levels are reused.
+	/// @param minSize The last level is the first one that fits in this many pixels on each side.
+	void reset(const PlaneView& base, int minSize);
+
+	/// Forget the base.
+	void clear();
+
+	/// Return true if there is no base.
+	bool empty() const;
+
+	/// Return the number of levels, including the base.
+	int getNumLevels() const;
+
+	/// Return a level, and build it and the ones before it if they aren't built yet.
+	/// @param level In [0, getNumLevels()).
+	const PlaneView& getLevel(int level);
+
+private:
+	std::vector<PlaneView> views; ///< All levels. Only the first numBuilt ones have pixels.
+	std::vector<std::vector<uint8_t>> buffers; ///< Pixels of the levels after the base. Never shrink.
+	int numBuilt = 0; ///< Number of levels with pixels.
+};
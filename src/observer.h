@@ -32,4 +32,6 @@ private:
 struct ImageManagerObserver {
 	virtual void onImageChange() = 0;
 	virtual void onImageSeamed() = 0;
+	/// A new preview of the carving that is still running is available, see ImageManager::getSeamPreview.
+	virtual void onSeamPreview() = 0;
 };
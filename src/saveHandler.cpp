@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <filesystem>
-//#include <shlwapi.h>
-#include <shobjidl_core.h> // For file browser dialog
 
 #include "saveHandler.h"
 
+#ifdef _WIN32
+//#include <shlwapi.h>
+#include <shobjidl_core.h> // For file browser dialog
+
 static const COMDLG_FILTERSPEC fileTypeOptions[] = {
 	{L"Any", L"*.*"},
 	{L"Bitmap", L"*.bmp"},
@@ -37,12 +39,6 @@ SaveImageHandler::~SaveImageHandler() {
 	}
 }
 
-void SaveImageHandler::setImageLoaded(const char* _path) {
-	std::filesystem::path path = _path;
-	filenameSuggestion = path.stem().wstring() + L"_seam";
-	directorySuggestion = path.parent_path().wstring();
-}
-
 bool SaveImageHandler::getSavePath(std::string& savePath) {
 	HRESULT result = 0;
 	// Set the default save name.
@@ -78,3 +74,22 @@ bool SaveImageHandler::getSavePath(std::string& savePath) {
 
 	return false;
 }
+
+#else // _WIN32
+
+// There is no file dialog on other systems. The headless tools choose the paths themselves.
+SaveImageHandler::SaveImageHandler() {}
+
+SaveImageHandler::~SaveImageHandler() {}
+
+bool SaveImageHandler::getSavePath(std::string& /*savePath*/) {
+	return false;
+}
+
+#endif // _WIN32
+
+void SaveImageHandler::setImageLoaded(const char* _path) {
+	std::filesystem::path path = _path;
+	filenameSuggestion = path.stem().wstring() + L"_seam";
+	directorySuggestion = path.parent_path().wstring();
+}
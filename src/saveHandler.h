@@ -4,6 +4,7 @@
 struct IFileSaveDialog;
 
 /// Creates a windows file browser window that allows the user to select where to save the image.
+/// @note Other systems have no dialog, so getSavePath always returns false there.
 class SaveImageHandler {
 public:
 	/// Constructor. Initializes the COM system and sets up the dialog window parameters.
@@ -0,0 +1,150 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+
+#include "scratchMemory.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/// A buffer that is mapped to a temporary file.
+struct Mapping {
+	size_t size = 0; ///< Size of the mapping in bytes.
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE; ///< The temporary file. It is deleted when closed.
+	HANDLE mapping = nullptr; ///< The file mapping object.
+#endif
+};
+
+/// Holds the settings and the current mappings.
+struct ScratchState {
+	std::atomic<size_t> threshold{0};
+	std::atomic<int> numMappings{0}; ///< Lets freeScratch skip the lock when nothing is mapped.
+	std::mutex mutex; ///< Guards the members below.
+	std::string dir;
+	std::unordered_map<void*, Mapping> mappings;
+};
+
+static ScratchState& getState() {
+	static ScratchState state;
+	return state;
+}
+
+/// Map @p bytes to a new temporary file in @p dir. Return null on failure.
+static void* mapTemporaryFile(size_t bytes, const std::string& dir, Mapping& result) {
+	result.size = bytes;
+#ifdef _WIN32
+	char tempDir[MAX_PATH];
+	char path[MAX_PATH];
+	if (dir.empty() && !GetTempPathA(MAX_PATH, tempDir)) return nullptr;
+	if (!GetTempFileNameA(dir.empty() ? tempDir : dir.c_str(), "sc", 0, path)) return nullptr;
+	result.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (result.file == INVALID_HANDLE_VALUE) return nullptr;
+	result.mapping = CreateFileMappingA(result.file, nullptr, PAGE_READWRITE,
+		DWORD(uint64_t(bytes) >> 32), DWORD(bytes & 0xffffffff), nullptr);
+	void* ptr = result.mapping ? MapViewOfFile(result.mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : nullptr;
+	if (!ptr) {
+		if (result.mapping) CloseHandle(result.mapping);
+		CloseHandle(result.file);
+	}
+	return ptr;
+#else
+	const char* tempDir = getenv("TMPDIR");
+	std::string path = dir.empty() ? std::string(tempDir ? tempDir : "/tmp") : dir;
+	path += "/seam-scratch-XXXXXX";
+	const int fd = mkstemp(&path[0]);
+	if (fd < 0) return nullptr;
+	// The file is removed right away. It stays until the mapping is gone.
+	unlink(path.c_str());
+	void* ptr = nullptr;
+	if (ftruncate(fd, off_t(bytes)) == 0) {
+		ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) ptr = nullptr;
+	}
+	close(fd);
+	return ptr;
+#endif
+}
+
+/// Release a mapping from mapTemporaryFile.
+static void unmapTemporaryFile(void* ptr, const Mapping& mapping) {
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+	CloseHandle(mapping.mapping);
+	CloseHandle(mapping.file);
+#else
+	munmap(ptr, mapping.size);
+#endif
+}
+
+void setScratchFileThreshold(size_t bytes) {
+	getState().threshold = bytes;
+}
+
+size_t getScratchFileThreshold() {
+	return getState().threshold;
+}
+
+void setScratchFileDir(const char* path) {
+	ScratchState& state = getState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.dir = path ? path : "";
+}
+
+bool parseScratchSize(const char* text, size_t& bytes) {
+	// strtoull would accept a sign and spaces as well
+	if (!text || *text < '0' || *text > '9') return false;
+	char* end = nullptr;
+	const unsigned long long value = strtoull(text, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'K': case 'k': shift = 10; ++end; break;
+	case 'M': case 'm': shift = 20; ++end; break;
+	case 'G': case 'g': shift = 30; ++end; break;
+	}
+	if (*end != '\0' || value > (SIZE_MAX >> shift)) return false;
+	bytes = size_t(value) << shift;
+	return true;
+}
+
+void* allocateScratch(size_t bytes) {
+	ScratchState& state = getState();
+	const size_t threshold = state.threshold;
+	if (threshold > 0 && bytes >= threshold) {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		Mapping mapping;
+		if (void* ptr = mapTemporaryFile(bytes, state.dir, mapping)) {
+			state.mappings[ptr] = mapping;
+			++state.numMappings;
+			return ptr;
+		}
+	}
+	return ::operator new(bytes);
+}
+
+void freeScratch(void* ptr) {
+	if (!ptr) return;
+	ScratchState& state = getState();
+	if (state.numMappings > 0) {
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto it = state.mappings.find(ptr);
+		if (it != state.mappings.end()) {
+			unmapTemporaryFile(ptr, it->second);
+			state.mappings.erase(it);
+			--state.numMappings;
+			return;
+		}
+	}
+	::operator delete(ptr);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/// Large buffers, like the image planes and the dynamic tables, can be kept in memory-mapped temporary files instead
+/// of the heap. When the physical memory runs out, the operating system writes their pages to those files, and reads
+/// them back when they are used. The carving goes over its buffers row by row, so the pages are mostly accessed in
+/// order, and images larger than the physical memory can be carved. Disabled by default.
+
+/// Map buffers with at least this many bytes to temporary files. 0 disables it, which is the default.
+void setScratchFileThreshold(size_t bytes);
+
+/// Return the size above which buffers are mapped to temporary files. 0 if it is disabled.
+size_t getScratchFileThreshold();
+
+/// Set the directory for the temporary files. If empty, the temporary directory of the system is used.
+void setScratchFileDir(const char* path);
+
+/// Parse a size for setScratchFileThreshold, in bytes or with a K, M or G suffix, like 512M.
+/// @return False if it is not a valid size.
+bool parseScratchSize(const char* text, size_t& bytes);
+
+/// Allocate @p bytes. Large buffers are mapped to temporary files, see setScratchFileThreshold. If that fails,
+/// they are allocated on the heap.
+/// @throw std::bad_alloc If there is no memory, same as operator new.
+void* allocateScratch(size_t bytes);
+
+/// Free memory returned by allocateScratch.
+void freeScratch(void* ptr);
+
+/// Allocator for containers that can be mapped to temporary files.
+template <typename T>
+struct ScratchAllocator {
+	using value_type = T;
+
+	ScratchAllocator() = default;
+	template <typename U>
+	ScratchAllocator(const ScratchAllocator<U>&) {}
+
+	T* allocate(size_t count) {
+		return static_cast<T*>(allocateScratch(count * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, size_t) {
+		freeScratch(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const ScratchAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const ScratchAllocator<U>&) const { return false; }
+};
+
+/// A vector that can be mapped to a temporary file.
+template <typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+/// Allocate an array that can be mapped to a temporary file. The elements are not initialized.
+template <typename T>
+std::shared_ptr<T[]> makeScratchArray(size_t count) {
+	static_assert(std::is_trivially_default_constructible_v<T> && std::is_trivially_destructible_v<T>,
+		"The elements are neither constructed nor destroyed");
+	return std::shared_ptr<T[]>(static_cast<T*>(allocateScratch(count * sizeof(T))), freeScratch);
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <assert.h>
+#include <vector>
+
+#include "image.h"
+#include "seamIndex.h"
+#include "trace.h"
+
+/// Minimal number of pixels for a thread to gather at once.
+static constexpr int minPixelsPerJob = 16 * 1024;
+
+Error SeamIndex::build(Image& image, int _minWidth, int _minHeight, const CarveOptions& options) {
+	TRACE_SCOPE("build seam index");
+	clear();
+	if (!image) {
+		return Error("No image to index");
+	}
+
+	const size_t numPixels = size_t(image.getStride()) * image.getHeight();
+	std::unique_ptr<int[]> newColOrder = std::make_unique<int[]>(numPixels);
+	std::unique_ptr<int[]> newRowOrder = std::make_unique<int[]>(numPixels);
+	std::fill_n(newColOrder.get(), numPixels, image.getWidth());
+	std::fill_n(newRowOrder.get(), numPixels, image.getHeight());
+
+	// Carve each direction separately, on a copy with the same stride, so that the offsets match.
+	CarveOptions carveOptions = options;
+	carveOptions.batchSize = 1;
+	carveOptions.guide = nullptr;
+	carveOptions.recordGuide = nullptr;
+	int doneBefore = 0; // Seams removed in the earlier direction
+	if (options.onProgress) {
+		carveOptions.onProgress = [&](int done) { options.onProgress(doneBefore + done); };
+	}
+	Image carved;
+	const int newMinWidth = std::clamp(_minWidth, 1, image.getWidth());
+	carved.copyFrom(image);
+	carveOptions.removalOrder = newColOrder.get();
+	carved.carveCols(image.getWidth() - newMinWidth, carveOptions);
+	if (options.cancel && *options.cancel) {
+		return Error("Building the seam index was cancelled");
+	}
+	doneBefore = image.getWidth() - newMinWidth;
+
+	const int newMinHeight = std::clamp(_minHeight, 1, image.getHeight());
+	carved.copyFrom(image);
+	carveOptions.removalOrder = newRowOrder.get();
+	carved.carveRows(image.getHeight() - newMinHeight, carveOptions);
+	if (options.cancel && *options.cancel) {
+		return Error("Building the seam index was cancelled");
+	}
+
+	width = image.getWidth();
+	height = image.getHeight();
+	stride = image.getStride();
+	minWidth = newMinWidth;
+	minHeight = newMinHeight;
+	updateEnergy = options.updateEnergy;
+	colOrder = std::move(newColOrder);
+	rowOrder = std::move(newRowOrder);
+	return Error();
+}
+
+void SeamIndex::clear() {
+	width = height = stride = 0;
+	updateEnergy = false;
+	minWidth = minHeight = 0;
+	colOrder.reset();
+	rowOrder.reset();
+}
+
+bool SeamIndex::covers(int targetWidth, int targetHeight) const {
+	return colOrder
+		&& targetWidth >= minWidth && targetWidth <= width
+		&& targetHeight >= minHeight && targetHeight <= height;
+}
+
+void SeamIndex::apply(Image& image, int targetWidth, int targetHeight, Image& result, ThreadPool& pool) const {
+	TRACE_SCOPE("apply seam index");
+	assert(covers(targetWidth, targetHeight) && image.getWidth() == width && image.getHeight() == height);
+	const int removeCols = width - targetWidth;
+	const int removeRows = height - targetHeight;
+
+	// Remove the columns. Each seam has exactly one pixel in every row, so all rows keep the same number of pixels.
+	// Only the columns of the kept pixels are stored, so that the list stays small on large images.
+	std::vector<int> kept(size_t(targetWidth) * height);
+	pool.parallelFor(0, height, std::max(1, minPixelsPerJob / width), [&](int rBegin, int rEnd) {
+		for (int r = rBegin; r < rEnd; ++r) {
+			int* dst = &kept[size_t(r) * targetWidth];
+			const int* order = &colOrder[size_t(r) * stride];
+			for (int c = 0; c < width; ++c) {
+				if (order[c] >= removeCols) {
+					*dst++ = c;
+				}
+			}
+			assert(dst == &kept[size_t(r) * targetWidth] + targetWidth);
+		}
+	});
+
+	result.allocMemory(size_t(targetWidth) * targetHeight);
+	result.width = targetWidth;
+	result.height = targetHeight;
+	result.stride = targetWidth;
+	result.energyScale = image.energyScale;
+
+	// Remove the rows. Each column keeps the pixels that are removed last by the row seams.
+	pool.parallelFor(0, targetWidth, std::max(1, minPixelsPerJob / height), [&](int cBegin, int cEnd) {
+		std::vector<int64_t> keys(height);
+		std::vector<uint8_t> keep(height);
+		for (int c = cBegin; c < cEnd; ++c) {
+			if (removeRows == 0) {
+				std::fill(keep.begin(), keep.end(), 1);
+			} else {
+				for (int r = 0; r < height; ++r) {
+					keys[r] = (int64_t(rowOrder[size_t(r) * stride + kept[size_t(r) * targetWidth + c]]) << 32) | r;
+				}
+				std::nth_element(keys.begin(), keys.begin() + removeRows, keys.end());
+				std::fill(keep.begin(), keep.end(), 0);
+				for (int i = removeRows; i < height; ++i) {
+					keep[int(keys[i] & 0xffffffff)] = 1;
+				}
+			}
+
+			size_t dst = c;
+			for (int r = 0; r < height; ++r) {
+				if (!keep[r]) continue;
+				const size_t src = size_t(r) * stride + kept[size_t(r) * targetWidth + c];
+				result.data[dst] = image.data[src];
+				result.energy[dst] = image.energy[src];
+				result.luma[dst] = image.luma[src];
+				dst += targetWidth;
+			}
+		}
+	});
+
+	// Same energies as after carving, but computed all at once
+	if (updateEnergy) {
+		result.computeEnergiesFromLuma(pool);
+	}
+}
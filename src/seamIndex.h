@@ -0,0 +1,51 @@
+#pragma once
+#include <memory>
+
+#include "error.h"
+
+class Image;
+class ThreadPool;
+struct CarveOptions;
+
+/// Remembers in which order seam carving removes the pixels of an image, for both directions. With that, the image
+/// can be resized to any smaller size with a single pass over the pixels, without running the seam carving again.
+/// @note Widths are exact, they give the same pixels as carveCols. Heights are exact as long as the width is not
+///     changed. When both are reduced, each column keeps the pixels that the row carving of the original image
+///     removes last, so the result is close to, but not the same as carving the columns and then the rows.
+class SeamIndex {
+public:
+	/// Carve a copy of the image down to the minimal size in both directions and record the order of the pixels.
+	/// @param image The image to index. It is not changed.
+	/// @param minWidth The smallest width that the index can produce.
+	/// @param minHeight The smallest height that the index can produce.
+	/// @param options How to do the carving. The batch size and the guide are ignored, since the index has to be
+	///     exact. If CarveOptions::cancel becomes true, the build stops and the index stays empty.
+	///     CarveOptions::onProgress gets the number of seams removed in both directions, columns first.
+	Error build(Image& image, int minWidth, int minHeight, const CarveOptions& options);
+
+	/// Forget the indexed image.
+	void clear();
+
+	/// Return true if the index can produce an image with the given size.
+	bool covers(int targetWidth, int targetHeight) const;
+
+	/// Produce the resized image.
+	/// @param image The image that the index was built from.
+	/// @param targetWidth Width of the result. Must be covered by the index.
+	/// @param targetHeight Height of the result. Must be covered by the index.
+	/// @param[out] result The resized image. Must be different from @p image.
+	/// @param pool Threads to split the work between.
+	void apply(Image& image, int targetWidth, int targetHeight, Image& result, ThreadPool& pool) const;
+
+private:
+	int width = 0; ///< Width of the indexed image.
+	int height = 0; ///< Height of the indexed image.
+	int stride = 0; ///< Stride of the indexed image. Both orders use it.
+	int minWidth = 0; ///< The smallest width that can be produced.
+	int minHeight = 0; ///< The smallest height that can be produced.
+	bool updateEnergy = false; ///< True if the carving updated the energies, so the results must do it as well.
+	/// Number of column seams removed before each pixel. Pixels that are never removed have the largest values.
+	std::unique_ptr<int[]> colOrder;
+	/// Number of row seams removed before each pixel. Pixels that are never removed have the largest values.
+	std::unique_ptr<int[]> rowOrder;
+};
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "sequenceCarver.h"
+#include "threadPool.h"
+#include "trace.h"
+
+/// Milliseconds since @p start.
+static double getMillis(std::chrono::steady_clock::time_point start) {
+	const std::chrono::duration<double, std::milli> delta = std::chrono::steady_clock::now() - start;
+	return delta.count();
+}
+
+/// A frame on its way through the pipeline. Only the thread of its current stage touches it.
+struct SequenceFrame {
+	std::unique_ptr<Image> image; ///< The loaded frame. Null if it failed, and once it is saved.
+	FrameResult result;
+};
+
+/// State shared by the stages of the pipeline.
+struct SequencePipeline {
+	std::mutex mutex;
+	/// Signals that a frame moved to the next stage or left the pipeline, or that the carving is done.
+	std::condition_variable changed;
+	std::vector<SequenceFrame> frames;
+	std::vector<uint8_t> isLoaded; ///< Set for each frame that the carving can take. Guarded by mutex.
+	int nextLoad = 0; ///< The next frame to load. Guarded by mutex.
+	int numInFlight = 0; ///< Frames that are loaded, carved or saved right now. Guarded by mutex.
+	std::deque<int> carved; ///< Frames waiting to be saved, in order. Guarded by mutex.
+	bool carvingDone = false; ///< Set once all frames are carved. Guarded by mutex.
+	std::mutex reportMutex; ///< Makes the calls of onFrame one at a time.
+	int numFailed = 0; ///< Guarded by reportMutex.
+};
+
+/// Load frames until all of them are taken. Frames are taken in order, so the carving never waits for a frame that
+/// can't be loaded because too many later ones are in flight.
+static void loadFrames(const std::vector<std::string>& inputs, SequencePipeline& pipeline, int maxFramesInFlight) {
+	const int numFrames = int(inputs.size());
+	for (;;) {
+		int index = 0;
+		{
+			std::unique_lock<std::mutex> lock(pipeline.mutex);
+			pipeline.changed.wait(lock, [&]() {
+				return pipeline.nextLoad == numFrames || pipeline.numInFlight < maxFramesInFlight;
+			});
+			if (pipeline.nextLoad == numFrames) return;
+			index = pipeline.nextLoad++;
+			++pipeline.numInFlight;
+		}
+
+		SequenceFrame& frame = pipeline.frames[index];
+		const auto start = std::chrono::steady_clock::now();
+		std::unique_ptr<Image> image = std::make_unique<Image>();
+		frame.result.frame = index;
+		frame.result.error = image->load(inputs[index].c_str());
+		frame.result.loadMillis = getMillis(start);
+		if (!frame.result.error) {
+			frame.result.width = image->getWidth();
+			frame.result.height = image->getHeight();
+			frame.image = std::move(image);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(pipeline.mutex);
+			pipeline.isLoaded[index] = 1;
+		}
+		pipeline.changed.notify_all();
+	}
+}
+
+/// Carve the frames in order. Each one follows the seams of the last carved frame.
+static void carveFrames(SequencePipeline& pipeline, const SequenceOptions& options) {
+	// The seams of the last frame and of the current one, for the columns and the rows
+	SeamGuide lastGuides[2];
+	SeamGuide guides[2];
+	CarveOptions carveOptions = options.carve;
+	carveOptions.guideBand = options.band;
+	const auto matches = [](const SeamGuide& guide, int rows, int cols) {
+		return guide.rows == rows && guide.cols == cols && guide.getNumSeams() > 0;
+	};
+
+	for (int index = 0; index < int(pipeline.frames.size()); ++index) {
+		{
+			std::unique_lock<std::mutex> lock(pipeline.mutex);
+			pipeline.changed.wait(lock, [&]() { return pipeline.isLoaded[index] != 0; });
+		}
+
+		SequenceFrame& frame = pipeline.frames[index];
+		if (frame.image) {
+			TRACE_SCOPE("carve frame");
+			Image& image = *frame.image;
+			FrameResult& result = frame.result;
+			options.getTargetSize(result.width, result.height, result.targetWidth, result.targetHeight);
+			const bool forceKeyframe = options.band <= 0 ||
+				(options.keyframeInterval > 0 && index % options.keyframeInterval == 0);
+			// Columns are carved first, so the row seams run along the carved width
+			const bool colsGuided = !forceKeyframe && matches(lastGuides[0], result.height, result.width);
+			const bool rowsGuided = !forceKeyframe && matches(lastGuides[1], result.targetWidth, result.height);
+			result.isKeyframe = !colsGuided && !rowsGuided;
+
+			const auto start = std::chrono::steady_clock::now();
+			carveOptions.guide = colsGuided ? &lastGuides[0] : nullptr;
+			carveOptions.recordGuide = &guides[0];
+			image.carveCols(result.width - result.targetWidth, carveOptions);
+			carveOptions.guide = rowsGuided ? &lastGuides[1] : nullptr;
+			carveOptions.recordGuide = &guides[1];
+			image.carveRows(result.height - result.targetHeight, carveOptions);
+			result.carveMillis = getMillis(start);
+			std::swap(lastGuides[0], guides[0]);
+			std::swap(lastGuides[1], guides[1]);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(pipeline.mutex);
+			pipeline.carved.push_back(index);
+		}
+		pipeline.changed.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pipeline.mutex);
+		pipeline.carvingDone = true;
+	}
+	pipeline.changed.notify_all();
+}
+
+/// Save the carved frames and report them, until the carving is done and all frames are saved.
+static void saveFrames(SequencePipeline& pipeline, const SequenceOptions& options) {
+	for (;;) {
+		int index = 0;
+		{
+			std::unique_lock<std::mutex> lock(pipeline.mutex);
+			pipeline.changed.wait(lock, [&]() { return !pipeline.carved.empty() || pipeline.carvingDone; });
+			if (pipeline.carved.empty()) return;
+			index = pipeline.carved.front();
+			pipeline.carved.pop_front();
+		}
+
+		SequenceFrame& frame = pipeline.frames[index];
+		FrameResult& result = frame.result;
+		if (frame.image) {
+			const auto start = std::chrono::steady_clock::now();
+			result.output = options.getOutputPath(index, result.targetWidth, result.targetHeight);
+			result.error = frame.image->save(result.output.c_str());
+			result.saveMillis = getMillis(start);
+			frame.image.reset();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(pipeline.reportMutex);
+			if (result.error) {
+				++pipeline.numFailed;
+			}
+			if (options.onFrame) {
+				options.onFrame(result);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(pipeline.mutex);
+			--pipeline.numInFlight;
+		}
+		pipeline.changed.notify_all();
+	}
+}
+
+int carveSequence(const std::vector<std::string>& inputs, const SequenceOptions& options) {
+	SequencePipeline pipeline;
+	pipeline.frames.resize(inputs.size());
+	pipeline.isLoaded.assign(inputs.size(), 0);
+
+	// The carving runs on the calling thread, the loaders and savers get their own
+	const int numLoaders = std::max(1, options.numLoaders);
+	const int numSavers = std::max(1, options.numSavers);
+	const int maxFramesInFlight = std::max(options.maxFramesInFlight, numLoaders + numSavers + 1);
+	ThreadPool stages(1 + numLoaders + numSavers);
+	stages.run(stages.getNumThreads(), [&](int job) {
+		if (job == 0) {
+			setTraceThreadName("Carver");
+			carveFrames(pipeline, options);
+		} else if (job <= numLoaders) {
+			setTraceThreadName(("Loader " + std::to_string(job)).c_str());
+			loadFrames(inputs, pipeline, maxFramesInFlight);
+		} else {
+			setTraceThreadName(("Saver " + std::to_string(job - numLoaders)).c_str());
+			saveFrames(pipeline, options);
+		}
+	});
+	return pipeline.numFailed;
+}
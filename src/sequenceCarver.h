@@ -0,0 +1,57 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "error.h"
+#include "image.h"
+
+/// What happened to one frame of a sequence.
+struct FrameResult {
+	int frame = 0; ///< Index of the frame in the sequence.
+	Error error; ///< Set if the frame couldn't be loaded or saved.
+	int width = 0; ///< Size of the input.
+	int height = 0; ///< Size of the input.
+	int targetWidth = 0; ///< Size of the result.
+	int targetHeight = 0; ///< Size of the result.
+	std::string output; ///< Path of the result.
+	double loadMillis = 0.0; ///< Time to decode the frame and compute its energies.
+	double carveMillis = 0.0; ///< Time to remove the seams.
+	double saveMillis = 0.0; ///< Time to encode and write the result.
+	bool isKeyframe = false; ///< True if the frame was carved without following the seams of the previous one.
+};
+
+/// Settings for carving a sequence of frames.
+struct SequenceOptions {
+	/// Compute the size of a result from the size of its frame.
+	std::function<void(int width, int height, int& targetWidth, int& targetHeight)> getTargetSize;
+	/// Return the path to save a result to.
+	std::function<std::string(int frame, int targetWidth, int targetHeight)> getOutputPath;
+	/// Called after each frame is saved or failed, one call at a time, on one of the pipeline threads. Frames that
+	/// are saved at the same time can be reported out of order.
+	std::function<void(const FrameResult&)> onFrame;
+	/// How to carve each frame. The guides are set for each frame. Its thread pool and workspace are only used by
+	/// the carving thread.
+	CarveOptions carve;
+	/// Number of columns around each seam of the previous frame that its seam in the next frame is searched in.
+	/// Zero carves every frame on its own.
+	int band = 8;
+	/// If positive, every this many frames is carved on its own, so that the seams can move to where the content
+	/// went, e.g. after a cut. The frames after it follow its seams.
+	int keyframeInterval = 0;
+	int numLoaders = 2; ///< Number of frames decoded at the same time.
+	int numSavers = 2; ///< Number of frames encoded at the same time.
+	/// Maximal number of frames in memory at once, from the start of their loading to the end of their saving.
+	/// At least the number of loaders and savers plus one.
+	int maxFramesInFlight = 8;
+};
+
+/// Carve the frames of a video, given as image files in order. Frames are loaded, carved and saved in a pipeline:
+/// several threads decode the next frames and compute their energies, one thread carves them one after another,
+/// and several threads encode the results. Each frame searches its seams in a narrow band around the seams of the
+/// previous frame (see CarveOptions::guide), so the seams move smoothly over time, and a frame costs a fraction of
+/// a full carve.
+/// @param inputs Paths of the frames, in order.
+/// @param options How to carve them.
+/// @return The number of frames that failed.
+int carveSequence(const std::vector<std::string>& inputs, const SequenceOptions& options);
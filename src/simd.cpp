@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <assert.h>
+#include <cstring>
+#include <math.h>
+
+#include "simd.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+// MSVC lets us use any intrinsic in any function. GCC and Clang need the instruction set enabled per function.
+#if SIMD_X86 && !defined(_MSC_VER)
+#define SIMD_TARGET(arch) __attribute__((target(arch)))
+#else
+#define SIMD_TARGET(arch)
+#endif
+
+/// Initial value of the cumulative energy, before we look at the parents.
+static constexpr float maxTotal = 1e38f;
+
+// ################################################################################################################################
+// # Scalar
+// ################################################################################################################################
+
+static void computeTotalRowScalar(const float* prevTotal, const float* energy, float* total, int8_t* prev, int count) {
+	for (int i = 0; i < count; ++i) {
+		float m = maxTotal;
+		int8_t p = 0;
+		if (m > prevTotal[i]) {
+			m = prevTotal[i];
+		}
+		if (m > prevTotal[i-1]) {
+			m = prevTotal[i-1];
+			p = -1;
+		}
+		if (m > prevTotal[i+1]) {
+			m = prevTotal[i+1];
+			p = 1;
+		}
+		total[i] = m + energy[i];
+		prev[i] = p;
+	}
+}
+
+/// Energy of the first and last pixel of a row, which only have one horizontal neighbour. Returns the larger one.
+static float computeEnergyEdges(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count) {
+	if (count == 1) {
+		energy[0] = fabsf(down[0] - up[0])*verticalScale;
+		return energy[0];
+	}
+	const int last = count-1;
+	energy[0] = fabsf(center[1] - center[0])*2.0f + fabsf(down[0] - up[0])*verticalScale;
+	energy[last] = fabsf(center[last] - center[last-1])*2.0f + fabsf(down[last] - up[last])*verticalScale;
+	return (energy[0] < energy[last]) ? energy[last] : energy[0];
+}
+
+/// Energy of the pixels in [begin, end), which must not contain the first or last pixel of the row.
+static float computeEnergyInnerScalar(const float* up, const float* center, const float* down, float verticalScale, float* energy, int begin, int end, float maxEnergy) {
+	for (int i = begin; i < end; ++i) {
+		energy[i] = fabsf(center[i+1] - center[i-1]) + fabsf(down[i] - up[i])*verticalScale;
+		maxEnergy = (maxEnergy < energy[i]) ? energy[i] : maxEnergy;
+	}
+	return maxEnergy;
+}
+
+static float computeEnergyRowScalar(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count) {
+	const float maxEnergy = computeEnergyEdges(up, center, down, verticalScale, energy, count);
+	return computeEnergyInnerScalar(up, center, down, verticalScale, energy, 1, count-1, maxEnergy);
+}
+
+/// Return the position of the highest set bit in a non-zero mask.
+static int highestBit(unsigned mask) {
+	int bit = 31;
+	while (!(mask & (1u << bit))) --bit;
+	return bit;
+}
+
+static void transposeBlockScalar(const float* src, int srcStride, float* dst, int dstStride, int width, int height) {
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			dst[x*dstStride + y] = src[y*srcStride + x];
+		}
+	}
+}
+
+static void downsampleRowFrom(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, int begin, int srcCount,
+	int channels)
+{
+	const int dstCount = (srcCount + 1) / 2;
+	for (int i = begin; i < dstCount; ++i) {
+		const int a = 2*i * channels;
+		const int b = std::min(2*i + 1, srcCount - 1) * channels;
+		for (int k = 0; k < channels; ++k) {
+			dst[i*channels + k] = uint8_t((row0[a+k] + row0[b+k] + row1[a+k] + row1[b+k] + 2) >> 2);
+		}
+	}
+}
+
+static void downsampleRowScalar(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, int srcCount, int channels) {
+	downsampleRowFrom(row0, row1, dst, 0, srcCount, channels);
+}
+
+static int findLastMinScalar(const float* values, int count) {
+	int result = count-1;
+	for (int i = count-2; i >= 0; --i) {
+		if (values[result] > values[i]) {
+			result = i;
+		}
+	}
+	return result;
+}
+
+#if SIMD_X86
+
+// ################################################################################################################################
+// # SSE4
+// ################################################################################################################################
+
+SIMD_TARGET("sse4.1")
+static void computeTotalRowSSE4(const float* prevTotal, const float* energy, float* total, int8_t* prev, int count) {
+	const __m128 vMax = _mm_set1_ps(maxTotal);
+	const __m128 vLeft = _mm_set1_ps(-1.0f);
+	const __m128 vRight = _mm_set1_ps(1.0f);
+	int i = 0;
+	for (; i+4 <= count; i += 4) {
+		const __m128 center = _mm_loadu_ps(prevTotal + i);
+		const __m128 left = _mm_loadu_ps(prevTotal + i - 1);
+		const __m128 right = _mm_loadu_ps(prevTotal + i + 1);
+
+		// Same order of comparisons as the scalar version, so ties are resolved the same way.
+		__m128 m = _mm_min_ps(vMax, center);
+		__m128 mask = _mm_cmplt_ps(left, m);
+		m = _mm_blendv_ps(m, left, mask);
+		__m128 p = _mm_and_ps(mask, vLeft);
+		mask = _mm_cmplt_ps(right, m);
+		m = _mm_blendv_ps(m, right, mask);
+		p = _mm_blendv_ps(p, vRight, mask);
+
+		_mm_storeu_ps(total + i, _mm_add_ps(m, _mm_loadu_ps(energy + i)));
+		const __m128i p32 = _mm_cvtps_epi32(p);
+		const __m128i p16 = _mm_packs_epi32(p32, p32);
+		const int packed = _mm_cvtsi128_si32(_mm_packs_epi16(p16, p16));
+		memcpy(prev + i, &packed, 4);
+	}
+	computeTotalRowScalar(prevTotal + i, energy + i, total + i, prev + i, count - i);
+}
+
+SIMD_TARGET("sse4.1")
+static int findLastMinSSE4(const float* values, int count) {
+	const int vecEnd = count & ~3;
+	if (vecEnd == 0) {
+		return findLastMinScalar(values, count);
+	}
+
+	// Find the smallest value
+	__m128 vMin = _mm_loadu_ps(values);
+	for (int i = 4; i < vecEnd; i += 4) {
+		vMin = _mm_min_ps(vMin, _mm_loadu_ps(values + i));
+	}
+	vMin = _mm_min_ps(vMin, _mm_shuffle_ps(vMin, vMin, _MM_SHUFFLE(1, 0, 3, 2)));
+	vMin = _mm_min_ps(vMin, _mm_shuffle_ps(vMin, vMin, _MM_SHUFFLE(2, 3, 0, 1)));
+	float minValue = _mm_cvtss_f32(vMin);
+	for (int i = vecEnd; i < count; ++i) {
+		minValue = (values[i] < minValue) ? values[i] : minValue;
+	}
+
+	// Find its last position
+	for (int i = count-1; i >= vecEnd; --i) {
+		if (values[i] == minValue) return i;
+	}
+	vMin = _mm_set1_ps(minValue);
+	for (int i = vecEnd-4; i >= 0; i -= 4) {
+		const int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(values + i), vMin));
+		if (mask) {
+			return i + highestBit(unsigned(mask));
+		}
+	}
+	assert(false && "The minimum must be found");
+	return count-1;
+}
+
+SIMD_TARGET("sse4.1")
+static float computeEnergyRowSSE4(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count) {
+	const float edgeMax = computeEnergyEdges(up, center, down, verticalScale, energy, count);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 vScale = _mm_set1_ps(verticalScale);
+	__m128 vMax = _mm_set1_ps(edgeMax);
+	int i = 1;
+	for (; i+4 <= count-1; i += 4) {
+		const __m128 along = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(center + i + 1), _mm_loadu_ps(center + i - 1)));
+		const __m128 across = _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(down + i), _mm_loadu_ps(up + i)));
+		const __m128 e = _mm_add_ps(along, _mm_mul_ps(across, vScale));
+		_mm_storeu_ps(energy + i, e);
+		vMax = _mm_max_ps(vMax, e);
+	}
+	vMax = _mm_max_ps(vMax, _mm_shuffle_ps(vMax, vMax, _MM_SHUFFLE(1, 0, 3, 2)));
+	vMax = _mm_max_ps(vMax, _mm_shuffle_ps(vMax, vMax, _MM_SHUFFLE(2, 3, 0, 1)));
+	return computeEnergyInnerScalar(up, center, down, verticalScale, energy, i, count-1, _mm_cvtss_f32(vMax));
+}
+
+// ################################################################################################################################
+// # AVX2
+// ################################################################################################################################
+
+SIMD_TARGET("avx2")
+static void computeTotalRowAVX2(const float* prevTotal, const float* energy, float* total, int8_t* prev, int count) {
+	const __m256 vMax = _mm256_set1_ps(maxTotal);
+	const __m256 vLeft = _mm256_set1_ps(-1.0f);
+	const __m256 vRight = _mm256_set1_ps(1.0f);
+	int i = 0;
+	for (; i+8 <= count; i += 8) {
+		const __m256 center = _mm256_loadu_ps(prevTotal + i);
+		const __m256 left = _mm256_loadu_ps(prevTotal + i - 1);
+		const __m256 right = _mm256_loadu_ps(prevTotal + i + 1);
+
+		// Same order of comparisons as the scalar version, so ties are resolved the same way.
+		__m256 m = _mm256_min_ps(vMax, center);
+		__m256 mask = _mm256_cmp_ps(left, m, _CMP_LT_OQ);
+		m = _mm256_blendv_ps(m, left, mask);
+		__m256 p = _mm256_and_ps(mask, vLeft);
+		mask = _mm256_cmp_ps(right, m, _CMP_LT_OQ);
+		m = _mm256_blendv_ps(m, right, mask);
+		p = _mm256_blendv_ps(p, vRight, mask);
+
+		_mm256_storeu_ps(total + i, _mm256_add_ps(m, _mm256_loadu_ps(energy + i)));
+		const __m256i p32 = _mm256_cvtps_epi32(p);
+		const __m128i p16 = _mm_packs_epi32(_mm256_castsi256_si128(p32), _mm256_extracti128_si256(p32, 1));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(prev + i), _mm_packs_epi16(p16, p16));
+	}
+	computeTotalRowScalar(prevTotal + i, energy + i, total + i, prev + i, count - i);
+}
+
+SIMD_TARGET("avx2")
+static int findLastMinAVX2(const float* values, int count) {
+	const int vecEnd = count & ~7;
+	if (vecEnd == 0) {
+		return findLastMinScalar(values, count);
+	}
+
+	// Find the smallest value
+	__m256 vMin = _mm256_loadu_ps(values);
+	for (int i = 8; i < vecEnd; i += 8) {
+		vMin = _mm256_min_ps(vMin, _mm256_loadu_ps(values + i));
+	}
+	__m128 vMin4 = _mm_min_ps(_mm256_castps256_ps128(vMin), _mm256_extractf128_ps(vMin, 1));
+	vMin4 = _mm_min_ps(vMin4, _mm_shuffle_ps(vMin4, vMin4, _MM_SHUFFLE(1, 0, 3, 2)));
+	vMin4 = _mm_min_ps(vMin4, _mm_shuffle_ps(vMin4, vMin4, _MM_SHUFFLE(2, 3, 0, 1)));
+	float minValue = _mm_cvtss_f32(vMin4);
+	for (int i = vecEnd; i < count; ++i) {
+		minValue = (values[i] < minValue) ? values[i] : minValue;
+	}
+
+	// Find its last position
+	for (int i = count-1; i >= vecEnd; --i) {
+		if (values[i] == minValue) return i;
+	}
+	vMin = _mm256_set1_ps(minValue);
+	for (int i = vecEnd-8; i >= 0; i -= 8) {
+		const unsigned mask = unsigned(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), vMin, _CMP_EQ_OQ)));
+		if (mask) {
+			return i + highestBit(mask);
+		}
+	}
+	assert(false && "The minimum must be found");
+	return count-1;
+}
+
+SIMD_TARGET("avx2")
+static float computeEnergyRowAVX2(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count) {
+	const float edgeMax = computeEnergyEdges(up, center, down, verticalScale, energy, count);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 vScale = _mm256_set1_ps(verticalScale);
+	__m256 vMax = _mm256_set1_ps(edgeMax);
+	int i = 1;
+	for (; i+8 <= count-1; i += 8) {
+		const __m256 along = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(center + i + 1), _mm256_loadu_ps(center + i - 1)));
+		const __m256 across = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(down + i), _mm256_loadu_ps(up + i)));
+		const __m256 e = _mm256_add_ps(along, _mm256_mul_ps(across, vScale));
+		_mm256_storeu_ps(energy + i, e);
+		vMax = _mm256_max_ps(vMax, e);
+	}
+	__m128 vMax4 = _mm_max_ps(_mm256_castps256_ps128(vMax), _mm256_extractf128_ps(vMax, 1));
+	vMax4 = _mm_max_ps(vMax4, _mm_shuffle_ps(vMax4, vMax4, _MM_SHUFFLE(1, 0, 3, 2)));
+	vMax4 = _mm_max_ps(vMax4, _mm_shuffle_ps(vMax4, vMax4, _MM_SHUFFLE(2, 3, 0, 1)));
+	return computeEnergyInnerScalar(up, center, down, verticalScale, energy, i, count-1, _mm_cvtss_f32(vMax4));
+}
+
+// ################################################################################################################################
+// # SSE
+// ################################################################################################################################
+
+// SSE2 is part of x86-64, and all the CPUs we support for 32-bit have it as well, so it needs no dispatch.
+static void transposeBlockSSE(const float* src, int srcStride, float* dst, int dstStride, int width, int height) {
+	const int vecW = width & ~3;
+	const int vecH = height & ~3;
+	for (int y = 0; y < vecH; y += 4) {
+		for (int x = 0; x < vecW; x += 4) {
+			const float* s = src + y*srcStride + x;
+			__m128 row0 = _mm_loadu_ps(s);
+			__m128 row1 = _mm_loadu_ps(s + srcStride);
+			__m128 row2 = _mm_loadu_ps(s + 2*srcStride);
+			__m128 row3 = _mm_loadu_ps(s + 3*srcStride);
+			_MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+			float* d = dst + x*dstStride + y;
+			_mm_storeu_ps(d, row0);
+			_mm_storeu_ps(d + dstStride, row1);
+			_mm_storeu_ps(d + 2*dstStride, row2);
+			_mm_storeu_ps(d + 3*dstStride, row3);
+		}
+	}
+	// Right and bottom edges
+	transposeBlockScalar(src + vecW, srcStride, dst + vecW*dstStride, dstStride, width - vecW, vecH);
+	transposeBlockScalar(src + vecH*srcStride, srcStride, dst + vecH, dstStride, width, height - vecH);
+}
+
+/// Sum the pairs of bytes in each 16-bit lane of two rows, which gives the 2x2 sums of 8 pixels with one channel.
+static __m128i sumPairsSSE(__m128i row0, __m128i row1) {
+	const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+	const __m128i sum0 = _mm_add_epi16(_mm_and_si128(row0, lowBytes), _mm_srli_epi16(row0, 8));
+	const __m128i sum1 = _mm_add_epi16(_mm_and_si128(row1, lowBytes), _mm_srli_epi16(row1, 8));
+	return _mm_add_epi16(sum0, sum1);
+}
+
+static void downsampleRowSSE(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, int srcCount, int channels) {
+	const __m128i rounding = _mm_set1_epi16(2);
+	int i = 0;
+	if (channels == 1) {
+		// 16 source pixels give 8
+		for (; 2*i + 16 <= srcCount; i += 8) {
+			const __m128i sum = sumPairsSSE(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 2*i)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 2*i)));
+			const __m128i avg = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(avg, avg));
+		}
+	} else {
+		// The neighbouring pixels are 3 bytes apart, which SSE2 can't shuffle well. Add the rows in 16 bits with
+		// SSE, and then the neighbours from memory. 16 source pixels (48 bytes) give 8.
+		const __m128i zero = _mm_setzero_si128();
+		alignas(16) uint16_t sums[48];
+		for (; 2*i + 16 <= srcCount; i += 8) {
+			const uint8_t* src0 = row0 + 2*i*3;
+			const uint8_t* src1 = row1 + 2*i*3;
+			for (int part = 0; part < 3; ++part) {
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 16*part));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 16*part));
+				_mm_store_si128(reinterpret_cast<__m128i*>(sums + 16*part),
+					_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+				_mm_store_si128(reinterpret_cast<__m128i*>(sums + 16*part + 8),
+					_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+			}
+			uint8_t* out = dst + i*3;
+			for (int j = 0; j < 8; ++j) {
+				for (int k = 0; k < 3; ++k) {
+					out[3*j + k] = uint8_t((sums[6*j + k] + sums[6*j + 3 + k] + 2) >> 2);
+				}
+			}
+		}
+	}
+	downsampleRowFrom(row0, row1, dst, i, srcCount, channels);
+}
+
+#endif // SIMD_X86
+
+// ################################################################################################################################
+// # Dispatch
+// ################################################################################################################################
+
+/// The kernels of one level. The transpose and the downsampling only have an SSE2 version, which all the vector
+/// levels use.
+struct Kernels {
+	void (*computeTotalRow)(const float*, const float*, float*, int8_t*, int);
+	int (*findLastMin)(const float*, int);
+	float (*computeEnergyRow)(const float*, const float*, const float*, float, float*, int);
+	void (*transposeBlock)(const float*, int, float*, int, int, int);
+	void (*downsampleRow)(const uint8_t*, const uint8_t*, uint8_t*, int, int);
+};
+
+static Kernels getKernels(SimdLevel level) {
+	switch (level) {
+#if SIMD_X86
+	case SimdLevel::AVX2:
+		return {computeTotalRowAVX2, findLastMinAVX2, computeEnergyRowAVX2, transposeBlockSSE, downsampleRowSSE};
+	case SimdLevel::SSE4:
+		return {computeTotalRowSSE4, findLastMinSSE4, computeEnergyRowSSE4, transposeBlockSSE, downsampleRowSSE};
+#endif
+	default:
+		return {computeTotalRowScalar, findLastMinScalar, computeEnergyRowScalar, transposeBlockScalar,
+			downsampleRowScalar};
+	}
+}
+
+static SimdLevel detectSimdLevel() {
+#if SIMD_X86
+#ifdef _MSC_VER
+	int info[4] = {};
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+	__cpuid(info, 1);
+	const bool hasSSE41 = (info[2] & (1 << 19)) != 0;
+	const bool hasOSXSAVE = (info[2] & (1 << 27)) != 0;
+	const bool hasAVX = (info[2] & (1 << 28)) != 0;
+	bool hasAVX2 = false;
+	if (maxLeaf >= 7 && hasOSXSAVE && hasAVX && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		hasAVX2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (hasAVX2) return SimdLevel::AVX2;
+	if (hasSSE41) return SimdLevel::SSE4;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+	if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE4;
+#endif
+#endif
+	return SimdLevel::Scalar;
+}
+
+/// Holds the state of the dispatch.
+struct Dispatch {
+	SimdLevel supported = SimdLevel::Scalar;
+	SimdLevel level = SimdLevel::Scalar;
+	Kernels kernels;
+
+	Dispatch()
+		: supported(detectSimdLevel())
+		, level(supported)
+		, kernels(getKernels(supported))
+	{}
+};
+
+static Dispatch& getDispatch() {
+	static Dispatch dispatch;
+	return dispatch;
+}
+
+SimdLevel getSupportedSimdLevel() {
+	return getDispatch().supported;
+}
+
+SimdLevel getSimdLevel() {
+	return getDispatch().level;
+}
+
+void setSimdLevel(SimdLevel level) {
+	Dispatch& dispatch = getDispatch();
+	dispatch.level = (int(level) <= int(dispatch.supported)) ? level : dispatch.supported;
+	dispatch.kernels = getKernels(dispatch.level);
+}
+
+const char* getSimdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::SSE4: return "SSE4";
+	case SimdLevel::AVX2: return "AVX2";
+	default: return "Scalar";
+	}
+}
+
+void computeTotalRow(const float* prevTotal, const float* energy, float* total, int8_t* prev, int count) {
+	getDispatch().kernels.computeTotalRow(prevTotal, energy, total, prev, count);
+}
+
+int findLastMin(const float* values, int count) {
+	return getDispatch().kernels.findLastMin(values, count);
+}
+
+float computeEnergyRow(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count) {
+	return getDispatch().kernels.computeEnergyRow(up, center, down, verticalScale, energy, count);
+}
+
+void transposeBlock(const float* src, int srcStride, float* dst, int dstStride, int width, int height) {
+	getDispatch().kernels.transposeBlock(src, srcStride, dst, dstStride, width, height);
+}
+
+void downsampleRow(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, int srcCount, int channels) {
+	getDispatch().kernels.downsampleRow(row0, row1, dst, srcCount, channels);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+
+/// Instruction sets that we have vectorized kernels for. The kernels give bit-identical results on all levels.
+enum class SimdLevel {
+	Scalar, ///< Plain C++, used as a reference.
+	SSE4, ///< 4 floats at a time. Needs SSE4.1 for the blend instructions.
+	AVX2, ///< 8 floats at a time.
+};
+
+/// Return the best level supported by the CPU.
+SimdLevel getSupportedSimdLevel();
+
+/// Return the level that the kernels currently use. By default it is the best supported one.
+SimdLevel getSimdLevel();
+
+/// Force the kernels to use a given level. Used to compare the levels against each other.
+/// @param level The level to use. If the CPU doesn't support it, the best supported one is used.
+void setSimdLevel(SimdLevel level);
+
+/// Return a readable name of the level.
+const char* getSimdLevelName(SimdLevel level);
+
+/// Compute one row of the cumulative energy table. For each column i:
+///     total[i] = energy[i] + min(prevTotal[i], prevTotal[i-1], prevTotal[i+1])
+///     prev[i] = the offset (0, -1 or 1) of the smallest one. On ties, the first one in that order wins.
+/// @param prevTotal The previous row. Must be readable in [-1, count]. Use a huge value outside the image.
+/// @param energy The energy of each pixel in the row.
+/// @param[out] total Cumulative energy of each pixel in the row.
+/// @param[out] prev The offset to the parent of each pixel in the row.
+/// @param count Number of pixels in the row.
+void computeTotalRow(const float* prevTotal, const float* energy, float* total, int8_t* prev, int count);
+
+/// Return the index of the smallest value. On ties, the last index wins.
+/// @param values The values to check.
+/// @param count Number of values. Must be positive.
+int findLastMin(const float* values, int count);
+
+/// Compute the energy of one image row from the luma, and return the largest one. For each column i:
+///     energy[i] = |center[i+1] - center[i-1]| + |down[i] - up[i]| * verticalScale
+/// The first and last column use the difference to their only neighbour, times 2.
+/// @param up The luma of the row above. Use @p center on the top border.
+/// @param center The luma of the row.
+/// @param down The luma of the row below. Use @p center on the bottom border.
+/// @param verticalScale 2.0f on the top and bottom border, otherwise 1.0f.
+/// @param[out] energy The energy of each pixel in the row.
+/// @param count Number of pixels in the row. Must be positive.
+float computeEnergyRow(const float* up, const float* center, const float* down, float verticalScale, float* energy, int count);
+
+/// Transpose a block of floats, so that dst[x*dstStride + y] = src[y*srcStride + x]. Meant for blocks that fit in
+/// the cache. The vector levels use SSE for 4x4 tiles.
+/// @param width Number of columns in the source.
+/// @param height Number of rows in the source.
+void transposeBlock(const float* src, int srcStride, float* dst, int dstStride, int width, int height);
+
+/// Halve two rows of 8-bit pixels into one, by averaging 2x2 pixels. For each pixel i and channel k:
+///     dst[i][k] = (row0[2i][k] + row0[2i+1][k] + row1[2i][k] + row1[2i+1][k] + 2) / 4
+/// On an odd width, the last pixel uses its only source column twice. The vector levels use SSE2.
+/// @param channels Number of bytes per pixel, 1 or 3.
+/// @param srcCount Number of pixels in each source row. The result has (srcCount + 1) / 2 pixels.
+void downsampleRow(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, int srcCount, int channels);
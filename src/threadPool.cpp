@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <assert.h>
+#include <string>
+
+#include "threadPool.h"
+#include "trace.h"
+
+// ################################################################################################################################
+// # ThreadPool
+// ################################################################################################################################
+
+ThreadPool::ThreadPool(int numThreads) {
+	resize(numThreads);
+}
+
+ThreadPool::~ThreadPool() {
+	stop();
+}
+
+void ThreadPool::resize(int numThreads) {
+	numThreads = std::max(1, numThreads);
+	if (numThreads == getNumThreads()) return;
+
+	stop();
+	stopping = false;
+	for (int i = 1; i < numThreads; ++i) {
+		workers.emplace_back(&ThreadPool::workerLoop, this, i, generation);
+	}
+}
+
+int ThreadPool::getNumThreads() const {
+	return int(workers.size()) + 1;
+}
+
+void ThreadPool::runJob(int _numJobs, const JobFunc& func) {
+	_numJobs = std::min(std::max(1, _numJobs), getNumThreads());
+	TRACE_SCOPE("job");
+	if (_numJobs == 1) {
+		func.call(func.object, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		assert(job == nullptr && "Nested ThreadPool::run is not supported");
+		job = &func;
+		numJobs = _numJobs;
+		pending = int(workers.size());
+		++generation;
+	}
+	wakeCond.notify_all();
+
+	func.call(func.object, 0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCond.wait(lock, [this]() { return pending == 0; });
+	job = nullptr;
+}
+
+int ThreadPool::getNumJobs(int size, int grain) const {
+	if (size <= 0) return 0;
+	return std::min(getNumThreads(), std::max(1, size / std::max(1, grain)));
+}
+
+void ThreadPool::workerLoop(int index, uint64_t lastGeneration) {
+	setTraceThreadName(("Worker " + std::to_string(index)).c_str());
+	for (;;) {
+		const JobFunc* func = nullptr;
+		bool hasJob = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCond.wait(lock, [&]() { return stopping || generation != lastGeneration; });
+			if (stopping) return;
+			lastGeneration = generation;
+			func = job;
+			hasJob = (index < numJobs);
+		}
+
+		if (hasJob) {
+			TRACE_SCOPE("job");
+			func->call(func->object, index);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--pending;
+		}
+		doneCond.notify_one();
+	}
+}
+
+void ThreadPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeCond.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+// ################################################################################################################################
+// # SpinBarrier
+// ################################################################################################################################
+
+SpinBarrier::SpinBarrier(int _count)
+	: count(_count)
+	, remaining(_count)
+{}
+
+void SpinBarrier::wait() {
+	const uint32_t currPhase = phase.load(std::memory_order_acquire);
+	if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		remaining.store(count, std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			phase.fetch_add(1, std::memory_order_release);
+		}
+		cond.notify_all();
+		return;
+	}
+
+	for (int spins = 0; spins < 4096; ++spins) {
+		if (phase.load(std::memory_order_acquire) != currPhase) return;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	cond.wait(lock, [&]() { return phase.load(std::memory_order_acquire) != currPhase; });
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <type_traits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed group of worker threads that run one job at a time. The calling thread always takes part in the job,
+/// so a pool with one thread has no workers and runs everything inline.
+/// @note Jobs can't be nested. The pool is meant to be used from one thread at a time.
+class ThreadPool {
+public:
+	/// @param numThreads Number of threads, including the calling one. Values less than 1 are treated as 1.
+	explicit ThreadPool(int numThreads = 1);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// Stop the current workers and start new ones.
+	/// @param numThreads Number of threads, including the calling one.
+	void resize(int numThreads);
+
+	/// Return the number of threads, including the calling one.
+	int getNumThreads() const;
+
+	/// Run @p func on @p numJobs threads at the same time and wait for all of them to finish. Since every job gets
+	/// its own thread, the jobs can wait for each other (see SpinBarrier).
+	/// @param numJobs Number of jobs. It is clamped to [1, getNumThreads()].
+	/// @param func Called with the job index in [0, numJobs). It is only referenced, so starting a job doesn't
+	///     allocate any memory.
+	template <typename Func>
+	void run(int numJobs, Func&& func) {
+		using FuncType = std::remove_reference_t<Func>;
+		runJob(numJobs, JobFunc{
+			const_cast<void*>(static_cast<const void*>(&func)),
+			[](void* object, int jobIndex) { (*static_cast<FuncType*>(object))(jobIndex); }});
+	}
+
+	/// Split [begin, end) into contiguous chunks and process them in parallel. Small ranges are processed inline.
+	/// @param grain The minimal number of elements per chunk.
+	/// @param func Called with the [chunkBegin, chunkEnd) range of each chunk.
+	template <typename Func>
+	void parallelFor(int begin, int end, int grain, Func&& func) {
+		const int numJobs = getNumJobs(end - begin, grain);
+		if (numJobs <= 1) {
+			if (begin < end) func(begin, end);
+			return;
+		}
+		run(numJobs, [&](int job) {
+			const int64_t size = end - begin;
+			func(begin + int(size * job / numJobs), begin + int(size * (job+1) / numJobs));
+		});
+	}
+
+	/// Return how many jobs to use for a range of @p size elements, so that each gets at least @p grain.
+	int getNumJobs(int size, int grain) const;
+
+private:
+	/// A job function, called through a plain function pointer. Unlike std::function, it never owns a copy.
+	struct JobFunc {
+		void* object; ///< The function object.
+		void (*call)(void* object, int jobIndex); ///< Calls the function object with the job index.
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wakeCond; ///< Signals the workers that there is a new job.
+	std::condition_variable doneCond; ///< Signals the caller that all workers finished.
+	const JobFunc* job = nullptr; ///< The current job. Guarded by mutex.
+	int numJobs = 0; ///< Number of jobs in the current run. Guarded by mutex.
+	int pending = 0; ///< Number of workers that haven't finished the current job. Guarded by mutex.
+	uint64_t generation = 0; ///< Incremented for each job, so that workers know when to wake. Guarded by mutex.
+	bool stopping = false; ///< Set to true when the workers have to exit. Guarded by mutex.
+
+	/// Main function of a worker thread.
+	/// @param index The job index that this worker runs. The calling thread is always index 0.
+	/// @param lastGeneration The generation at the time the worker was started. Only newer jobs are run.
+	void workerLoop(int index, uint64_t lastGeneration);
+
+	/// Run a job, see run().
+	void runJob(int numJobs, const JobFunc& func);
+
+	/// Stop and join all workers.
+	void stop();
+};
+
+/// Makes a group of jobs, started with ThreadPool::run, wait for each other. It spins first, because the work between
+/// two waits is usually very short (a single row of the image), and sleeping would cost more than the work itself.
+/// If that takes too long, for example when there are more threads than cores, it goes to sleep.
+class SpinBarrier {
+public:
+	/// @param count Number of threads that have to call wait().
+	explicit SpinBarrier(int count);
+
+	/// Block until all threads have called wait().
+	void wait();
+
+private:
+	const int count;
+	std::atomic<int> remaining;
+	std::atomic<uint32_t> phase{0}; ///< Incremented when all threads arrive. Only changed while holding the mutex.
+	std::mutex mutex; ///< Used by the threads that stopped spinning.
+	std::condition_variable cond; ///< Wakes up the threads that stopped spinning.
+};
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+/// Each thread keeps at most this many spans, so that a long trace can't take all the memory.
+static constexpr size_t maxEventsPerThread = 1 << 20;
+
+/// One recorded span.
+struct TraceEvent {
+	const char* name;
+	int64_t start; ///< Nanoseconds since the trace started.
+	int64_t duration; ///< Nanoseconds.
+};
+
+/// Spans of one thread. Only that thread adds to it, the mutex is there for startTracing and writeTrace.
+struct ThreadTrace {
+	std::mutex mutex;
+	int id = 0; ///< Thread id in the trace.
+	std::string name; ///< Shown in the trace. Guarded by mutex.
+	std::vector<TraceEvent> events; ///< Guarded by mutex.
+	size_t numDropped = 0; ///< Spans that didn't fit. Guarded by mutex.
+	bool exited = false; ///< Set when the thread exits. Its spans are kept until the next trace starts.
+};
+
+/// Holds the traces of the threads that recorded spans. A thread gets one with its first span, so threads that
+/// never record anything don't take any memory. The traces of threads that exited are deleted by startTracing.
+struct TraceState {
+	std::atomic<bool> enabled{false};
+	std::atomic<int64_t> origin{0}; ///< Start of the trace, in nanoseconds of the steady clock.
+	std::mutex mutex; ///< Guards the members below.
+	std::vector<std::unique_ptr<ThreadTrace>> threads;
+	int lastId = 0; ///< Id of the last created ThreadTrace.
+};
+
+/// What each thread knows about itself, see getThreadInfo.
+struct ThreadInfo {
+	std::string name; ///< Set by setTraceThreadName. Empty uses "Thread <id>".
+	ThreadTrace* trace = nullptr; ///< Created with the first span of the thread.
+
+	~ThreadInfo() {
+		if (trace) {
+			std::lock_guard<std::mutex> lock(trace->mutex);
+			trace->exited = true;
+		}
+	}
+};
+
+/// Return the time of the steady clock in nanoseconds.
+static int64_t getClockTime() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceState& getState() {
+	static TraceState state;
+	return state;
+}
+
+static ThreadInfo& getThreadInfo() {
+	thread_local ThreadInfo info;
+	return info;
+}
+
+/// Return the trace of the calling thread. The first call of each thread creates it.
+static ThreadTrace& getThreadTrace() {
+	ThreadInfo& info = getThreadInfo();
+	if (!info.trace) {
+		TraceState& state = getState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.threads.push_back(std::make_unique<ThreadTrace>());
+		info.trace = state.threads.back().get();
+		info.trace->id = ++state.lastId;
+		info.trace->name = info.name.empty() ? "Thread " + std::to_string(info.trace->id) : info.name;
+	}
+	return *info.trace;
+}
+
+void startTracing() {
+	TraceState& state = getState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	auto hasExited = [](const std::unique_ptr<ThreadTrace>& thread) {
+		std::lock_guard<std::mutex> threadLock(thread->mutex);
+		return thread->exited;
+	};
+	state.threads.erase(std::remove_if(state.threads.begin(), state.threads.end(), hasExited), state.threads.end());
+	for (const std::unique_ptr<ThreadTrace>& thread : state.threads) {
+		std::lock_guard<std::mutex> threadLock(thread->mutex);
+		thread->events.clear();
+		thread->numDropped = 0;
+	}
+	state.origin = getClockTime();
+	state.enabled = true;
+}
+
+void stopTracing() {
+	getState().enabled = false;
+}
+
+bool isTracing() {
+	return getState().enabled.load(std::memory_order_relaxed);
+}
+
+/// Write a string with the JSON escapes.
+static void writeJsonString(FILE* file, const char* text) {
+	fputc('"', file);
+	for (const char* c = text; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', file);
+		}
+		fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+Error writeTrace(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		return Error("Failed to open \"%s\"", path);
+	}
+
+	TraceState& state = getState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	size_t numDropped = 0;
+	bool first = true;
+	fprintf(file, "{\"traceEvents\": [");
+	for (const std::unique_ptr<ThreadTrace>& thread : state.threads) {
+		std::lock_guard<std::mutex> threadLock(thread->mutex);
+		if (thread->events.empty()) continue;
+		numDropped += thread->numDropped;
+		fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+			first ? "" : ",", thread->id);
+		writeJsonString(file, thread->name.c_str());
+		fprintf(file, "}}");
+		first = false;
+		for (const TraceEvent& event : thread->events) {
+			// Chrome traces use microseconds
+			fprintf(file, ",\n{\"name\": ");
+			writeJsonString(file, event.name);
+			fprintf(file, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				thread->id, 1e-3 * double(event.start), 1e-3 * double(event.duration));
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0) {
+		return Error("Failed to write \"%s\"", path);
+	}
+	if (numDropped > 0) {
+		printf("Trace: dropped %zu spans\n", numDropped);
+	}
+	return Error();
+}
+
+void setTraceThreadName(const char* name) {
+	ThreadInfo& info = getThreadInfo();
+	info.name = name;
+	if (info.trace) {
+		std::lock_guard<std::mutex> lock(info.trace->mutex);
+		info.trace->name = name;
+	}
+}
+
+int64_t TraceSpan::getTraceTime() {
+	return getClockTime() - getState().origin.load(std::memory_order_relaxed);
+}
+
+void TraceSpan::end() {
+	const int64_t endTime = getTraceTime();
+	ThreadTrace& thread = getThreadTrace();
+	std::lock_guard<std::mutex> lock(thread.mutex);
+	if (thread.events.size() < maxEventsPerThread) {
+		thread.events.push_back({name, start, endTime - start});
+	} else {
+		++thread.numDropped;
+	}
+}
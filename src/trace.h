@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+
+#include "error.h"
+
+/// Records how long the phases of the work take, on each thread, and writes them as a Chrome trace. The file can be
+/// opened in chrome://tracing or in Perfetto (ui.perfetto.dev).
+/// Spans are only recorded between startTracing and stopTracing. Otherwise a span costs a single atomic load. Build
+/// with SEAM_TRACE_ENABLED=0 to remove them completely.
+/// @note Span names must be string literals, or live at least until the trace is written.
+
+#ifndef SEAM_TRACE_ENABLED
+#define SEAM_TRACE_ENABLED 1
+#endif
+
+/// Clear all recorded spans and start recording.
+void startTracing();
+
+/// Stop recording. Spans that are still open are recorded when they end.
+void stopTracing();
+
+/// Return true if spans are being recorded.
+bool isTracing();
+
+/// Write the recorded spans in the Chrome trace format. Must be called after stopTracing, once the spans that were
+/// open have ended.
+Error writeTrace(const char* path);
+
+/// Set the name of the calling thread in the trace. Threads only take memory in the trace once they record a span.
+void setTraceThreadName(const char* name);
+
+/// Records the time from its construction to its destruction on the calling thread. Use TRACE_SCOPE.
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* _name)
+		: name(isTracing() ? _name : nullptr)
+		, start(name ? getTraceTime() : 0)
+	{}
+
+	~TraceSpan() {
+		if (name) {
+			end();
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char* name; ///< Null if nothing is recorded.
+	int64_t start; ///< Start time in nanoseconds.
+
+	/// Return the time since the trace started in nanoseconds.
+	static int64_t getTraceTime();
+
+	/// Record the span.
+	void end();
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if SEAM_TRACE_ENABLED
+/// Record a span with the given name until the end of the enclosing scope.
+#define TRACE_SCOPE(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+#include "simd.h"
+
+/// Huge total outside the image, as the carving uses it.
+static constexpr float maxTotal = 1e38f;
+
+/// Largest row length to check. It covers several whole vectors of each level and every tail shorter than one.
+static constexpr int maxCount = 70;
+
+static int numFailures = 0;
+
+/// Count a failure and print which case it was.
+static void check(bool ok, const char* kernel, SimdLevel level, int count, const char* detail = "") {
+	if (!ok) {
+		printf("%s differs from Scalar on %s with count %d%s\n", kernel, getSimdLevelName(level), count, detail);
+		++numFailures;
+	}
+}
+
+/// Results of all kernels on one input, on the current level.
+struct Results {
+	std::vector<float> total;
+	std::vector<int8_t> prev;
+	int lastMin = 0;
+	std::vector<float> energy[2]; ///< With a vertical scale of 1 and 2.
+	float maxEnergy[2] = {};
+	std::vector<float> transposed;
+	std::vector<uint8_t> downsampled[2]; ///< With 1 and 3 channels.
+};
+
+/// Input rows of one count. Few distinct values, so that there are many ties.
+struct Inputs {
+	int count = 0;
+	std::vector<float> prevTotal; ///< count + 2 values, the first and last one are outside the image.
+	std::vector<float> energy;
+	std::vector<float> block; ///< count x count, with a stride of count + 1.
+	std::vector<uint8_t> rows[2]; ///< 3 * count bytes each.
+
+	Inputs(int count, std::mt19937& rng)
+		: count(count)
+		, prevTotal(count + 2)
+		, energy(count)
+		, block(size_t(count) * (count + 1))
+	{
+		std::uniform_int_distribution<int> dist(0, 15);
+		for (float& v : prevTotal) v = 0.25f * float(dist(rng));
+		for (float& v : energy) v = 0.125f * float(dist(rng));
+		prevTotal.front() = prevTotal.back() = maxTotal;
+		for (float& v : block) v = float(dist(rng));
+		std::uniform_int_distribution<int> byteDist(0, 255);
+		for (std::vector<uint8_t>& row : rows) {
+			row.resize(3 * size_t(count));
+			for (uint8_t& v : row) v = uint8_t(byteDist(rng));
+		}
+	}
+
+	Results run() const {
+		Results r;
+		r.total.resize(count);
+		r.prev.resize(count);
+		computeTotalRow(&prevTotal[1], energy.data(), r.total.data(), r.prev.data(), count);
+		r.lastMin = findLastMin(energy.data(), count);
+		for (int i = 0; i < 2; ++i) {
+			r.energy[i].resize(count);
+			r.maxEnergy[i] = computeEnergyRow(
+				&prevTotal[0], &prevTotal[1], energy.data(), float(i + 1), r.energy[i].data(), count);
+		}
+		// A block that isn't square, so that swapped sides show up
+		const int height = (count + 1) / 2;
+		const int dstStride = height + 3;
+		r.transposed.assign(size_t(count) * dstStride, -1.0f);
+		transposeBlock(block.data(), count + 1, r.transposed.data(), dstStride, count, height);
+		for (int i = 0; i < 2; ++i) {
+			const int channels = i == 0 ? 1 : 3;
+			// One extra byte, to catch writes past the end
+			r.downsampled[i].assign(size_t(channels) * ((count + 1) / 2) + 1, 0xCD);
+			downsampleRow(rows[0].data(), rows[1].data(), r.downsampled[i].data(), count, channels);
+		}
+		return r;
+	}
+};
+
+/// Check the scalar transpose and downsampling against the formulas of simd.h, so that the other levels are
+/// compared against something known to be right.
+static void checkScalarReference(const Inputs& in, const Results& r) {
+	const int count = in.count;
+	const int height = (count + 1) / 2;
+	const int dstStride = height + 3;
+	bool ok = true;
+	for (int x = 0; x < count; ++x) {
+		for (int y = 0; y < dstStride; ++y) {
+			const float expected = y < height ? in.block[size_t(y) * (count + 1) + x] : -1.0f;
+			ok &= r.transposed[size_t(x) * dstStride + y] == expected;
+		}
+	}
+	if (!ok) {
+		printf("transposeBlock is wrong on Scalar with count %d\n", count);
+		++numFailures;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		const int channels = i == 0 ? 1 : 3;
+		const int dstCount = (count + 1) / 2;
+		ok = r.downsampled[i][size_t(channels) * dstCount] == 0xCD;
+		for (int p = 0; p < dstCount; ++p) {
+			const int left = 2 * p;
+			const int right = std::min(left + 1, count - 1);
+			for (int k = 0; k < channels; ++k) {
+				const int sum = in.rows[0][left * channels + k] + in.rows[0][right * channels + k]
+					+ in.rows[1][left * channels + k] + in.rows[1][right * channels + k];
+				ok &= r.downsampled[i][p * channels + k] == uint8_t((sum + 2) >> 2);
+			}
+		}
+		if (!ok) {
+			printf("downsampleRow is wrong on Scalar with count %d and %d channels\n", count, channels);
+			++numFailures;
+		}
+	}
+}
+
+/// Compare all kernels of every supported level against the scalar ones, on all row lengths up to maxCount. Returns
+/// a nonzero exit code if any of them differs.
+int main() {
+	const SimdLevel supported = getSupportedSimdLevel();
+	printf("Supported: %s\n", getSimdLevelName(supported));
+
+	std::mt19937 rng(1234);
+	for (int count = 1; count <= maxCount; ++count) {
+		for (int repeat = 0; repeat < 4; ++repeat) {
+			const Inputs in(count, rng);
+			setSimdLevel(SimdLevel::Scalar);
+			const Results reference = in.run();
+			if (repeat == 0) {
+				checkScalarReference(in, reference);
+			}
+
+			for (int level = int(SimdLevel::Scalar) + 1; level <= int(supported); ++level) {
+				setSimdLevel(SimdLevel(level));
+				const Results r = in.run();
+				check(r.total == reference.total && r.prev == reference.prev, "computeTotalRow", SimdLevel(level), count);
+				check(r.lastMin == reference.lastMin, "findLastMin", SimdLevel(level), count);
+				for (int i = 0; i < 2; ++i) {
+					check(r.energy[i] == reference.energy[i] && r.maxEnergy[i] == reference.maxEnergy[i],
+						"computeEnergyRow", SimdLevel(level), count, i == 0 ? "" : " on a border");
+				}
+				check(r.transposed == reference.transposed, "transposeBlock", SimdLevel(level), count);
+				for (int i = 0; i < 2; ++i) {
+					check(r.downsampled[i] == reference.downsampled[i], "downsampleRow", SimdLevel(level), count,
+						i == 0 ? " and 1 channel" : " and 3 channels");
+				}
+			}
+		}
+	}
+	setSimdLevel(supported);
+
+	if (numFailures > 0) {
+		printf("%d checks failed\n", numFailures);
+		return 1;
+	}
+	printf("All levels match Scalar\n");
+	return 0;
+}